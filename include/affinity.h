@@ -0,0 +1,54 @@
+/*
+ * socket
+ * Copyright (C) log2 2013 - Present <aaron.hebert@log2.co>
+ *
+ * log2sockets is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * log2sockets is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TCP_AFFINITY_H
+#define	TCP_AFFINITY_H
+
+#include <string>
+#include <vector>
+#include <cstddef>
+
+namespace tcp {
+
+    // CPU numbers as the kernel counts them
+    typedef std::vector<int> cpu_list;
+
+    // "0-3,8,10-11", false on a malformed list
+    bool parse_cpu_list(const std::string &list, cpu_list &cpus);
+
+    /* restricts the calling thread to cpus. threads it
+     * creates afterwards inherit the mask. an empty list
+     * leaves the thread alone. */
+    bool pin_thread(const cpu_list &cpus);
+
+    /* undoes an inherited pin, the calling thread may run
+     * on every CPU its cpuset allows */
+    bool unpin_thread(void);
+
+    /* the CPU that handled the last packet of the socket,
+     * where its receive interrupts land. -1 if unknown. */
+    int incoming_cpu(int socket);
+
+    /* fresh anonymous pages, touched by the calling thread
+     * so first-touch places them on its NUMA node. nullptr
+     * on failure. */
+    void *alloc_local(size_t size);
+    void free_local(void *buf, size_t size);
+}
+
+#endif	/* TCP_AFFINITY_H */
@@ -0,0 +1,86 @@
+/*
+ * socket
+ * Copyright (C) log2 2013 - Present <aaron.hebert@log2.co>
+ *
+ * log2sockets is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * log2sockets is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TCP_CHANNEL_H
+#define	TCP_CHANNEL_H
+
+#include <string>
+#include <cstddef>
+#include <cstdint>
+#include "codec.h"
+
+namespace tcp {
+
+    /* logical channels inside one connection.
+     *
+     * a message on a channel travels as one or more binary
+     * frames, the last one flagged FRAME_FIN. frames of
+     * different channels interleave, so a large message does
+     * not hold up a small one. the receiver grants credit
+     * back with WINDOW frames, a sender keeps at most
+     * CHANNEL_WINDOW bytes per channel in flight.
+     *
+     * header, network byte order:
+     *   <CTL> 'F' kind flags channel:16 length:32 <payload>
+     */
+    enum class frame_kind : uint8_t {
+        DATA = 'D', WINDOW = 'W'
+    };
+
+    static const uint8_t FRAME_FIN = 1;
+
+    // largest payload in one frame
+    static const size_t FRAME_MAX = 16 * 1024;
+
+    // credit per channel until the receiver grants more
+    static const size_t CHANNEL_WINDOW = 256 * 1024;
+
+    /* largest message the server collects on one channel.
+     * credit comes back before the message is complete, so
+     * this, not the window, bounds the receive buffer */
+    static const size_t CHANNEL_MESSAGE_MAX = 16 * 1024 * 1024;
+
+    struct frame_header {
+        uint8_t ctl;
+        uint8_t type;
+        uint8_t kind;
+        uint8_t flags;
+        uint16_t channel;
+        // payload bytes, or the credit granted by WINDOW
+        uint32_t length;
+    };
+
+    typedef schema<frame_header,
+    TCP_FIELD(frame_header, ctl),
+    TCP_FIELD(frame_header, type),
+    TCP_FIELD(frame_header, kind),
+    TCP_FIELD(frame_header, flags),
+    TCP_FIELD(frame_header, channel),
+    TCP_FIELD(frame_header, length)> frame_schema;
+
+    // appends one frame, len must not exceed FRAME_MAX for DATA
+    void append_frame(std::string &out, frame_kind kind, uint16_t channel,
+            uint8_t flags, const char *data, uint32_t len);
+
+    /* appends msg as DATA frames of at most FRAME_MAX,
+     * the last one flagged FRAME_FIN */
+    void append_message(std::string &out, uint16_t channel,
+            const std::string &msg);
+}
+
+#endif	/* TCP_CHANNEL_H */
@@ -20,7 +20,15 @@
 #define	TCP_CLIENT_H
 
 #include <cstdint>
+#include <chrono>
+#include <deque>
+#include <map>
+#include <vector>
+#include <memory>
 #include "tcp.h"
+#include "channel.h"
+#include "reliable.h"
+#include "spill_journal.h"
 
 namespace tcp {
 
@@ -37,13 +45,186 @@ namespace tcp {
         connections redundent_conns;
         //connection_hashkey hashkey_conns;
 
+        // pause between failover rounds, doubles up to max
+        uint32_t backoff_initial_ms_;
+        uint32_t backoff_max_ms_;
+
+        // outbound side of a logical channel
+        struct channel_tx {
+            uint8_t priority;
+            size_t window;
+            std::deque<std::string> queue;
+            // bytes of queue.front() already framed
+            size_t offset;
+        };
+
+        std::map<uint16_t, channel_tx> channels_;
+        std::map<uint16_t, std::string> channel_rx_;
+        uint16_t last_channel_;
+
+        channel_tx *next_channel(void);
+
+        // reliable mode, 0 == off
+        uint64_t session_;
+        uint64_t next_seq_;
+
+        // sequenced lines the server has not acked, in order
+        std::deque<std::pair<uint64_t, std::string>> ring_;
+        size_t ring_bytes_;
+        size_t ring_max_;
+
+        // lines read while waiting for an ack
+        std::deque<std::string> replies_;
+
+        // post()ed while no endpoint answers
+        std::unique_ptr<spill_journal> journal_;
+        uint64_t next_attempt_ms_;
+        uint32_t attempt_backoff_ms_;
+
+        bool try_reconnect(void);
+        bool drain_spill(void);
+
+        /* hedging, see set_hedging(). the delay is a
+         * percentile of recent reply latencies, 0 until
+         * HEDGE_WARMUP replies were timed */
+        double hedge_percentile_;
+        double hedge_budget_;
+        double hedge_tokens_;
+        uint32_t hedge_delay_us_;
+        std::vector<uint32_t> latency_us_;
+        size_t latency_next_;
+        uint64_t hedged_;
+        uint64_t hedge_wins_;
+
+        // second connection, to an endpoint other than ours
+        std::unique_ptr<client> hedge_;
+
+        // replies to skip, their request was answered elsewhere
+        uint32_t owed_;
+
+        static const size_t HEDGE_SAMPLES = 256;
+        static const size_t HEDGE_WARMUP = 16;
+        // most hedges in a row the budget may save up
+        static const int HEDGE_BURST = 10;
+
+        client *hedge_client(void);
+        void time_reply(std::chrono::steady_clock::time_point start);
+        bool take_reply(std::string &line);
+        int wait_reply(client *other, int64_t timeout_us, std::string &line);
+
+        bool open_session(void);
+        bool take_ack(const std::string &line);
+        bool read_ack(void);
+
     public:
 
         client(std::string key = "", auth auth_ = tcp::auth::OFF);
 
+        /* host may be "unix:/path" or "unix:@name" for
+         * same host peers, port is then ignored. unix and
+         * TCP endpoints can be mixed in the failover list. */
         bool authenticate(std::string host, std::string port);
         void add_failover(std::string host, std::string port);
         bool failover(void);
+
+        /* asks the server to push messages published on
+         * topic to this connection. they arrive between
+         * replies and are read with readline(). policy is
+         * what the server does when we fall behind, BLOCK
+         * is taken as DROP_OLDEST. */
+        bool subscribe(const std::string &topic,
+                tx_policy policy = tx_policy::DROP_OLDEST);
+        bool unsubscribe(const std::string &topic);
+
+        /* logical channels, see channel.h. messages queued on
+         * a channel are framed and interleaved with the other
+         * channels, higher priority first. a channel out of
+         * credit waits for the server, channel_read() picks
+         * up the grants and resumes sending. */
+        void open_channel(uint16_t id, uint8_t priority = 0);
+        bool channel_send(uint16_t id, const std::string &msg);
+
+        // frames what credit allows, true once nothing is queued
+        bool channel_pump(void);
+
+        // blocks for the next complete message on any channel
+        bool channel_read(uint16_t &id, std::string &msg);
+
+        /* sequenced, acknowledged delivery, see reliable.h.
+         * lines sent with send_reliable() are kept until the
+         * server acks them, at most ring_bytes, and sent again
+         * after a failover; the server hands each to its
+         * reader once. call before authenticate(). */
+        void set_reliable(size_t ring_bytes = RELIABLE_RING);
+
+        /* blocks while ring_bytes are unacked. fails over
+         * when the connection is lost, false if not reliable */
+        bool send_reliable(const std::string &line);
+
+        /* next line from the server, acks taken out. after
+         * a failover an EOL alone, replies to lines sent
+         * before it may be lost. */
+        std::string read_reliable(void);
+
+        // blocks until everything sent is acked
+        bool wait_acked(void);
+
+        size_t unacked(void) {
+            return ring_.size();
+        }
+
+        /* messages post()ed while no endpoint answers go to
+         * a journal in dir, at most max_bytes, and are sent in
+         * order once a connection is back. segments left by
+         * an earlier run are sent first. */
+        bool set_spill(const std::string &dir, size_t max_bytes,
+                size_t segment_bytes = SPILL_SEGMENT);
+
+        /* sends msg, or journals it while disconnected. never
+         * waits out a failover, a reconnect is tried at most
+         * once per backoff step. false if msg was dropped. */
+        bool post(const std::string &msg);
+
+        // journaled bytes not sent yet
+        size_t spilled(void) {
+            return journal_ ? journal_->bytes() : 0;
+        }
+
+        /* writes line with a time budget, see deadline.h. past
+         * budget_ms the server replies a line tcp::expired()
+         * matches, else its handler sees what is left of the
+         * budget. send() as usual. */
+        size_t write_with_budget(const std::string &line, uint32_t budget_ms);
+
+        /* sends a one line request and returns its one line
+         * reply. an idempotent request with no reply after
+         * the hedge delay goes to a second endpoint as well,
+         * the first reply wins and the other is skipped. with
+         * a request timeout set the request carries it as its
+         * time budget, an expired reply is returned empty. */
+        std::string request(const std::string &line, bool idempotent = false);
+
+        /* hedge after the percentile of recent reply times,
+         * sending at most budget_pct extra requests per 100.
+         * the failover list needs a second endpoint.
+         * budget_pct 0 == off. */
+        void set_hedging(double percentile = 0.95, double budget_pct = 5);
+
+        uint64_t hedged(void) {
+            return hedged_;
+        }
+
+        // hedges answered before the first endpoint
+        uint64_t hedge_wins(void) {
+            return hedge_wins_;
+        }
+
+        /* when no endpoint answers, wait initial_ms before
+         * the next round and double it up to max_ms */
+        void set_reconnect_backoff(uint32_t initial_ms, uint32_t max_ms) {
+            backoff_initial_ms_ = initial_ms;
+            backoff_max_ms_ = max_ms;
+        }
     };
 }
 
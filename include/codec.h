@@ -0,0 +1,273 @@
+/*
+ * socket
+ * Copyright (C) log2 2013 - Present <aaron.hebert@log2.co>
+ *
+ * log2sockets is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * log2sockets is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TCP_CODEC_H
+#define	TCP_CODEC_H
+
+#include <array>
+#include <cstring>
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+
+/* compile-time message schemas.
+ *
+ * a schema lists the members of a struct; encode() writes
+ * the whole struct in one pass in network byte order and
+ * view<> decodes single fields in place, without copying
+ * the message out of the buffer it arrived in.
+ *
+ *   struct route { uint32_t prefix; uint8_t len; uint64_t next_hop; };
+ *
+ *   typedef tcp::schema<route,
+ *           TCP_FIELD(route, prefix),
+ *           TCP_FIELD(route, len),
+ *           TCP_FIELD(route, next_hop)> route_msg;
+ *
+ *   client.write_msg<route_msg>(r);
+ *   tcp::view<route_msg> v = server.read_msg<route_msg>();
+ *   uint32_t prefix = v.get<0>();
+ */
+
+#define TCP_FIELD(S, member) \
+    tcp::field<S, decltype(S::member), &S::member>
+
+namespace tcp {
+
+    // wire format of one value, network byte order
+    template <typename T, typename Enable = void>
+    struct wire;
+
+    template <typename T>
+    struct wire<T, typename std::enable_if<std::is_integral<T>::value &&
+    !std::is_same<T, bool>::value>::type> {
+        typedef typename std::make_unsigned<T>::type U;
+        static const size_t size = sizeof (T);
+
+        static void put(uint8_t *out, T v) {
+            U u = (U) v;
+            for (size_t i = 0; i < size; ++i)
+                out[i] = (uint8_t) (u >> (8 * (size - 1 - i)));
+        }
+
+        static T get(const uint8_t *in) {
+            U u = 0;
+            for (size_t i = 0; i < size; ++i)
+                u = (U) ((u << 8) | in[i]);
+            return (T) u;
+        }
+    };
+
+    template <>
+    struct wire<bool> {
+        static const size_t size = 1;
+
+        static void put(uint8_t *out, bool v) {
+            out[0] = v ? 1 : 0;
+        }
+
+        static bool get(const uint8_t *in) {
+            return in[0] != 0;
+        }
+    };
+
+    template <typename T>
+    struct wire<T, typename std::enable_if<std::is_enum<T>::value>::type> {
+        typedef typename std::underlying_type<T>::type U;
+        static const size_t size = sizeof (U);
+
+        static void put(uint8_t *out, T v) {
+            wire<U>::put(out, (U) v);
+        }
+
+        static T get(const uint8_t *in) {
+            return (T) wire<U>::get(in);
+        }
+    };
+
+    // IEEE 754, sent as the same-sized integer
+    template <typename T>
+    struct wire<T, typename std::enable_if<std::is_floating_point<T>::value>::type> {
+        typedef typename std::conditional<sizeof (T) == 4,
+        uint32_t, uint64_t>::type U;
+        static const size_t size = sizeof (U);
+
+        static void put(uint8_t *out, T v) {
+            U u;
+            memcpy(&u, &v, size);
+            wire<U>::put(out, u);
+        }
+
+        static T get(const uint8_t *in) {
+            U u = wire<U>::get(in);
+            T v;
+            memcpy(&v, &u, size);
+            return v;
+        }
+    };
+
+    // raw bytes, e.g. an MD5 digest or an IPv6 address
+    template <size_t N>
+    struct wire<std::array<uint8_t, N> > {
+        static const size_t size = N;
+
+        static void put(uint8_t *out, const std::array<uint8_t, N> &v) {
+            memcpy(out, v.data(), N);
+        }
+
+        static std::array<uint8_t, N> get(const uint8_t *in) {
+            std::array<uint8_t, N> v;
+            memcpy(v.data(), in, N);
+            return v;
+        }
+    };
+
+    // one struct member in a schema, see TCP_FIELD
+    template <typename S, typename T, T S::*M>
+    struct field {
+        typedef T type;
+        static const size_t size = wire<T>::size;
+
+        static void put(uint8_t *out, const S &s) {
+            wire<T>::put(out, s.*M);
+        }
+
+        static void get(const uint8_t *in, S &s) {
+            s.*M = wire<T>::get(in);
+        }
+
+        static T value(const uint8_t *in) {
+            return wire<T>::get(in);
+        }
+    };
+
+    template <typename... F>
+    struct fields_size;
+
+    template <>
+    struct fields_size<> {
+        static const size_t value = 0;
+    };
+
+    template <typename F, typename... R>
+    struct fields_size<F, R...> {
+        static const size_t value = F::size + fields_size<R...>::value;
+    };
+
+    // I'th field and its byte offset
+    template <size_t I, typename... F>
+    struct field_at;
+
+    template <typename F, typename... R>
+    struct field_at<0, F, R...> {
+        typedef F type;
+        static const size_t offset = 0;
+    };
+
+    template <size_t I, typename F, typename... R>
+    struct field_at<I, F, R...> {
+        typedef typename field_at<I - 1, R...>::type type;
+        static const size_t offset = F::size + field_at<I - 1, R...>::offset;
+    };
+
+    template <typename S, typename... F>
+    struct fields_codec;
+
+    template <typename S>
+    struct fields_codec<S> {
+
+        static void encode(const S &, uint8_t *) {
+        }
+
+        static void decode(const uint8_t *, S &) {
+        }
+    };
+
+    template <typename S, typename F, typename... R>
+    struct fields_codec<S, F, R...> {
+
+        static void encode(const S &s, uint8_t *out) {
+            F::put(out, s);
+            fields_codec<S, R...>::encode(s, out + F::size);
+        }
+
+        static void decode(const uint8_t *in, S &s) {
+            F::get(in, s);
+            fields_codec<S, R...>::decode(in + F::size, s);
+        }
+    };
+
+    template <typename S, typename... F>
+    struct schema {
+        typedef S type;
+
+        // encoded size, known at compile time
+        static const size_t size = fields_size<F...>::value;
+
+        template <size_t I>
+        struct at {
+            typedef typename field_at<I, F...>::type field;
+            static const size_t offset = field_at<I, F...>::offset;
+        };
+
+        static void encode(const S &s, uint8_t *out) {
+            fields_codec<S, F...>::encode(s, out);
+        }
+
+        static void decode(const uint8_t *in, S &s) {
+            fields_codec<S, F...>::decode(in, s);
+        }
+    };
+
+    /* decodes fields in place. only valid as long as the
+     * buffer it points into, for socket::read_msg() that
+     * is until the next read on the socket. */
+    template <typename Schema>
+    class view {
+    public:
+
+        explicit view(const uint8_t *data = nullptr) : data_(data) {
+        }
+
+        bool valid(void) const {
+            return data_ != nullptr;
+        }
+
+        template <size_t I>
+        typename Schema::template at<I>::field::type get(void) const {
+            typedef typename Schema::template at<I> f;
+            return f::field::value(data_ + f::offset);
+        }
+
+        // copy every field out
+        typename Schema::type decode(void) const {
+            typename Schema::type s;
+            Schema::decode(data_, s);
+            return s;
+        }
+
+        const uint8_t *data(void) const {
+            return data_;
+        }
+
+    private:
+        const uint8_t *data_;
+    };
+}
+
+#endif	/* TCP_CODEC_H */
@@ -0,0 +1,137 @@
+/*
+ * socket
+ * Copyright (C) log2 2013 - Present <aaron.hebert@log2.co>
+ *
+ * log2sockets is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * log2sockets is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TCP_COMPLETION_H
+#define	TCP_COMPLETION_H
+
+#include <map>
+#include <mutex>
+#include <atomic>
+#include <string>
+#include <memory>
+#include <condition_variable>
+#include <cstdint>
+#include "tx_queue.h"
+#include "conn_registry.h"
+
+namespace tcp {
+
+    /* replies a connection may owe before it stops reading
+     * further requests, see reply_order::wait_below() */
+    static const size_t ASYNC_OUTSTANDING_MAX = 1024;
+
+    /* puts the replies of one connection back in request
+     * order. requests are numbered as they are read, a reply
+     * completed early waits here until all before it are
+     * queued. safe to complete from any thread. */
+    class reply_order {
+    public:
+
+        reply_order(std::shared_ptr<tx_queue> txq, conn_counters *counters);
+
+        // numbers the next request, connection thread only
+        uint64_t issue(void);
+
+        /* reply for request seq, nullptr == no reply.
+         * false if the connection is gone. */
+        bool complete(uint64_t seq, shared_buffer reply);
+
+        // requests issued but not queued yet
+        size_t outstanding(void);
+
+        /* waits up to timeout_ms for fewer than n outstanding
+         * requests, true once there are or the order is closed */
+        bool wait_below(size_t n, uint32_t timeout_ms);
+
+        /* the connection is going away, completions from now on
+         * are dropped and never touch the counters */
+        void close(void);
+
+    private:
+        std::shared_ptr<tx_queue> txq_;
+        conn_counters *counters_;
+
+        uint64_t issued_;
+        uint64_t queued_;
+        bool closed_;
+        std::map<uint64_t, shared_buffer> ready_;
+
+        std::mutex mutex_;
+        std::condition_variable queued_cv_;
+    };
+
+    /* token for one request of an async handler.
+     *
+     * copies share the request, the first reply wins. once
+     * the last copy goes away without a reply the request is
+     * completed empty, so a lost token never holds up the
+     * replies behind it.
+     */
+    class completion {
+    public:
+
+        completion() {
+        }
+
+        bool reply(const std::string &msg);
+        bool reply(shared_buffer buf);
+
+        // completes without a reply
+        void cancel(void);
+
+        // true until replied or cancelled
+        bool pending(void) const;
+
+        /* microseconds left of the request's time budget,
+         * -1 if it carries none. see deadline.h */
+        int64_t remaining_us(void) const;
+
+    private:
+        friend class server;
+
+        struct request {
+
+            request(std::shared_ptr<reply_order> order, uint64_t seq,
+                    uint64_t deadline_ns) :
+            order(order), seq(seq), deadline_ns(deadline_ns), done(false) {
+            }
+
+            ~request();
+
+            std::shared_ptr<reply_order> order;
+            uint64_t seq;
+            // steady clock, 0 == none
+            uint64_t deadline_ns;
+            std::atomic<bool> done;
+        };
+
+        completion(std::shared_ptr<reply_order> order, uint64_t seq,
+                uint64_t deadline_ns = 0) :
+        request_(std::make_shared<request>(order, seq, deadline_ns)) {
+        }
+
+        std::shared_ptr<request> request_;
+    };
+
+    /* handler replying through a completion, from any thread
+     * and at any later time. the connection reads on, replies
+     * go out in request order. */
+    typedef void (*async_handler)(std::string, completion);
+}
+
+#endif	/* TCP_COMPLETION_H */
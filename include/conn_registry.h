@@ -0,0 +1,118 @@
+/*
+ * socket
+ * Copyright (C) log2 2013 - Present <aaron.hebert@log2.co>
+ *
+ * log2sockets is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * log2sockets is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TCP_CONN_REGISTRY_H
+#define	TCP_CONN_REGISTRY_H
+
+#include <deque>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <vector>
+#include <functional>
+#include <cstddef>
+#include <cstdint>
+#include "tx_queue.h"
+
+namespace tcp {
+
+    /* names one live connection. the generation in the high
+     * word makes a handle stale once its slot is reused,
+     * 0 is never a valid handle. */
+    typedef uint64_t conn_handle;
+
+    struct conn_stats {
+        int socket;
+        uint64_t connected_ms;
+        uint64_t requests;
+        uint64_t rx_bytes;
+        uint64_t tx_bytes;
+        // bytes waiting in the tx queue, 0 without one
+        size_t tx_pending;
+    };
+
+    // updated by the serving thread without taking the registry lock
+    struct conn_counters {
+        std::atomic<uint64_t> requests;
+        std::atomic<uint64_t> rx_bytes;
+        std::atomic<uint64_t> tx_bytes;
+    };
+
+    /* live connections in a slab. add, remove and lookup
+     * are O(1); freed slots are reused, bumping their
+     * generation. all members are safe to call from any
+     * thread. */
+    class conn_registry {
+    public:
+
+        conn_registry();
+
+        conn_handle add(int socket);
+        bool remove(conn_handle handle);
+
+        // stable for as long as the connection is registered
+        conn_counters *counters(conn_handle handle);
+
+        bool set_tx_queue(conn_handle handle, std::shared_ptr<tx_queue> txq);
+
+        // nullptr / -1 once the connection is gone
+        std::shared_ptr<tx_queue> tx_queue_of(conn_handle handle);
+        int socket_of(conn_handle handle);
+
+        /* shutdown(2) under the registry lock, the descriptor
+         * can not be closed and reused meanwhile */
+        bool shutdown(conn_handle handle);
+        void shutdown_all(void);
+
+        bool stats(conn_handle handle, conn_stats &stats);
+
+        /* calls fn on a snapshot of the live connections taken
+         * under the registry lock, fn runs without it and may kick,
+         * send to or query connections. the socket in the stats may
+         * be stale by then, go through the handle instead */
+        void for_each(std::function<void(conn_handle, const conn_stats &) > fn);
+
+        // every tx queue, for broadcast
+        void tx_queues(std::vector<std::shared_ptr<tx_queue>> &queues);
+
+        size_t size(void);
+
+    private:
+
+        struct slot {
+            uint32_t generation;
+            bool live;
+            int socket;
+            uint64_t connected_ms;
+            std::shared_ptr<tx_queue> txq;
+            conn_counters counters;
+        };
+
+        // a deque never moves its elements, counters stay put
+        std::deque<slot> slots_;
+        std::vector<uint32_t> free_;
+        size_t live_;
+        std::mutex mutex_;
+
+        slot *find(conn_handle handle);
+        conn_handle handle_of(uint32_t index);
+        void fill(const slot &s, conn_stats &stats);
+    };
+}
+
+#endif	/* TCP_CONN_REGISTRY_H */
@@ -0,0 +1,57 @@
+/*
+ * socket
+ * Copyright (C) log2 2013 - Present <aaron.hebert@log2.co>
+ *
+ * log2sockets is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * log2sockets is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TCP_DEADLINE_H
+#define	TCP_DEADLINE_H
+
+#include <string>
+#include <cstdint>
+
+namespace tcp {
+
+    /* a request's time budget travels in front of it.
+     *
+     *   <CTL> 'B' budget <line>
+     *
+     * budget is the microseconds the sender still waits for
+     * a reply, SEQ_DIGITS hex digits. it is relative, hosts
+     * need not agree on the time; the server turns it into
+     * a deadline when it reads the request. a request past
+     * its deadline is not dispatched, it is answered with
+     *
+     *   <CTL> 'B' EOL
+     *
+     * alone so the peer's replies stay in step.
+     */
+
+    // appends line with budget_us, EOL added if missing
+    void append_budget(std::string &out, uint64_t budget_us,
+            const std::string &line);
+
+    /* takes the budget off the front of line, false if
+     * it does not start with a well formed one */
+    bool take_budget(std::string &line, uint64_t &budget_us);
+
+    // appends the reply to a request past its deadline
+    void append_expired(std::string &out);
+
+    // true if line is the reply to a request past its deadline
+    bool expired(const std::string &line);
+}
+
+#endif	/* TCP_DEADLINE_H */
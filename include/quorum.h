@@ -0,0 +1,145 @@
+/*
+ * socket
+ * Copyright (C) log2 2013 - Present <aaron.hebert@log2.co>
+ *
+ * log2sockets is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * log2sockets is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TCP_QUORUM_H
+#define	TCP_QUORUM_H
+
+#include <deque>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <memory>
+#include <string>
+#include <vector>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include "client.h"
+
+namespace tcp {
+
+    struct replica_stats {
+        std::string host;
+        std::string port;
+        bool connected;
+        // writes not acknowledged yet, and the oldest one's age
+        size_t pending;
+        size_t pending_bytes;
+        uint64_t lag_ms;
+        uint64_t acked;
+        // fell more than max_lag behind, no longer written to
+        bool stale;
+        // writes it missed since, until readmit()
+        uint64_t missed;
+    };
+
+    /* writes one buffer to N replicas at once.
+     *
+     * every replica has its own connection and thread. a
+     * write is queued on all of them, sharing the buffer,
+     * and returns once k replicas answered it with a reply
+     * line, so it costs the k-th fastest replica. the others
+     * keep their queue and catch up in the background, in
+     * order; after a reconnect unacknowledged writes go
+     * again. replicas must tolerate a write seen twice.
+     */
+    class quorum_writer {
+    public:
+
+        quorum_writer(std::string key = "", auth auth_ = tcp::auth::MD5);
+        ~quorum_writer();
+
+        // before start()
+        void add_replica(const std::string &host, const std::string &port);
+
+        /* a replica more than max_bytes behind is dropped
+         * from the quorum, 0 == never */
+        void set_max_lag(size_t max_bytes) {
+            max_lag_ = max_bytes;
+        }
+
+        /* a stale replica takes writes again. the writes it
+         * missed are not replayed, the caller resyncs it
+         * first, from a snapshot or another replica. false
+         * if no such replica is stale. */
+        bool readmit(const std::string &host, const std::string &port);
+
+        /* connects every replica and starts its thread. an
+         * unreachable replica is retried in the background */
+        bool start(void);
+
+        /* buf should end with EOL. false if fewer than k
+         * replicas answered within timeout_ms, 0 == forever,
+         * or at once when fewer than k replicas that are not
+         * stale are left to answer it; the write stays queued
+         * on the rest either way */
+        bool write(shared_buffer buf, size_t k, uint32_t timeout_ms = 0);
+        bool write(const std::string &line, size_t k, uint32_t timeout_ms = 0);
+
+        std::vector<replica_stats> stats(void);
+
+    private:
+
+        struct write_op {
+            shared_buffer buf;
+            uint64_t queued_ms;
+            size_t acks;
+            // replicas it is still queued on
+            size_t owed;
+        };
+
+        struct replica {
+            std::string host;
+            std::string port;
+            std::unique_ptr<client> conn;
+
+            // oldest first, the first 'sent' are on the wire
+            std::deque<std::shared_ptr<write_op>> queue;
+            size_t sent;
+            size_t bytes;
+            uint64_t acked;
+            bool stale;
+            uint64_t missed;
+            std::atomic<bool> up;
+
+            // held while the connection is opened or closed
+            std::mutex conn_mutex;
+            std::thread worker;
+        };
+
+        std::string key_;
+        auth auth_;
+        size_t max_lag_;
+
+        std::vector<std::unique_ptr<replica>> replicas_;
+
+        // guards the queues and ack counts
+        std::mutex mutex_;
+        std::condition_variable work_cv_;
+        std::condition_variable ack_cv_;
+        std::atomic<bool> stop_;
+
+        // writes put on the wire in one send
+        static const size_t QUORUM_BATCH = 64;
+
+        void run(replica *r);
+        bool reconnect(replica *r);
+    };
+}
+
+#endif	/* TCP_QUORUM_H */
@@ -0,0 +1,71 @@
+/*
+ * socket
+ * Copyright (C) log2 2013 - Present <aaron.hebert@log2.co>
+ *
+ * log2sockets is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * log2sockets is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TCP_RELIABLE_H
+#define	TCP_RELIABLE_H
+
+#include <string>
+#include <cstddef>
+#include <cstdint>
+
+namespace tcp {
+
+    /* sequenced, acknowledged delivery.
+     *
+     * the client opens a session once per connection, the
+     * server answers with the last sequence it delivered for
+     * that session. the client drops what is acknowledged and
+     * sends the rest again; the server skips what it has
+     * seen. acks are cumulative and sent once the server has
+     * read everything buffered, or every ACK_EVERY messages.
+     *
+     *   <CTL> 'R' session <EOL>          open or resume
+     *   <CTL> 'Q' seq <line>             sequenced line
+     *   <CTL> 'A' seq <EOL>              delivered up to seq
+     *
+     * session and seq are SEQ_DIGITS hex digits, so a header
+     * never holds an EOL.
+     */
+    static const size_t SEQ_DIGITS = 16;
+
+    // messages read between acks while the peer keeps sending
+    static const size_t ACK_EVERY = 64;
+
+    // bytes a client keeps unacknowledged by default
+    static const size_t RELIABLE_RING = 1024 * 1024;
+
+    // sessions a server remembers, least recently used go first
+    static const size_t RELIABLE_SESSIONS = 64 * 1024;
+
+    void append_hex64(std::string &out, uint64_t value);
+
+    // false unless SEQ_DIGITS hex digits start at pos
+    bool parse_hex64(const std::string &str, size_t pos, uint64_t &value);
+
+    // "<CTL><type><value><EOL>", for RELIABLE and ACK
+    std::string reliable_line(char type, uint64_t value);
+
+    // appends line as sequence seq, EOL added if missing
+    void append_sequenced(std::string &out, uint64_t seq,
+            const std::string &line);
+
+    // the sequence acked by line, false if it is no ack
+    bool parse_ack(const std::string &line, uint64_t &seq);
+}
+
+#endif	/* TCP_RELIABLE_H */
@@ -0,0 +1,130 @@
+/*
+ * socket
+ * Copyright (C) log2 2013 - Present <aaron.hebert@log2.co>
+ *
+ * log2sockets is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * log2sockets is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TCP_REPLICATOR_H
+#define	TCP_REPLICATOR_H
+
+#include <deque>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <memory>
+#include <string>
+#include <vector>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include "client.h"
+
+namespace tcp {
+
+    struct standby_stats {
+        std::string host;
+        std::string port;
+        bool connected;
+        // sent or waiting, not yet acked by the standby
+        size_t lag_bytes;
+        uint64_t lag_ms;
+        uint64_t acked;
+        // fell more than max_lag behind, no longer fed
+        bool stale;
+        // lines it missed since, until readmit()
+        uint64_t missed;
+    };
+
+    /* streams a server's inbound lines to hot standbys.
+     *
+     * lines are appended in the order the server accepted
+     * them and each standby link sends whatever piled up
+     * since its last send in one write. the link is a
+     * reliable session (see reliable.h) marked as a replica
+     * link, the standby applies every line once with its
+     * standby callback and sends no replies, only acks. after
+     * a broken link unacked lines go again.
+     */
+    class replicator {
+    public:
+
+        replicator(std::string key, auth auth_, size_t max_lag);
+        ~replicator();
+
+        void add_standby(const std::string &host, const std::string &port);
+
+        // called by connection threads, never blocks on a standby
+        void append(const std::string &line);
+
+        /* a stale standby is fed again. the lines it missed
+         * are gone, the caller resyncs it first, say from a
+         * snapshot of the primary. false if no such standby
+         * is stale. */
+        bool readmit(const std::string &host, const std::string &port);
+
+        std::vector<standby_stats> stats(void);
+
+    private:
+
+        struct link {
+            std::string host;
+            std::string port;
+            std::unique_ptr<client> conn;
+            uint64_t session;
+
+            // appended, not sent yet, with the time they came in
+            std::deque<std::pair<uint64_t, std::string>> pending;
+            size_t pending_bytes;
+
+            // sent, not acked: sequence, time and framed line
+            struct sent_line {
+                uint64_t seq;
+                uint64_t at_ms;
+                std::string framed;
+            };
+            std::deque<sent_line> ring;
+            size_t ring_bytes;
+            uint64_t next_seq;
+            uint64_t acked;
+
+            bool stale;
+            uint64_t missed;
+            std::atomic<bool> up;
+
+            // held while the connection is opened or closed
+            std::mutex conn_mutex;
+            std::thread worker;
+        };
+
+        std::string key_;
+        auth auth_;
+        size_t max_lag_;
+
+        std::vector<std::unique_ptr<link>> links_;
+
+        std::mutex mutex_;
+        std::condition_variable work_cv_;
+        std::atomic<bool> stop_;
+
+        // longest a link sleeps before looking for acks
+        static const int ACK_POLL_MS = 50;
+
+        void run(link *l);
+        bool connect(link *l);
+        bool read_acks(link *l, int timeout_ms, bool *got_ack = nullptr);
+    };
+}
+
+#endif	/* TCP_REPLICATOR_H */
@@ -0,0 +1,91 @@
+/*
+ * socket
+ * Copyright (C) log2 2013 - Present <aaron.hebert@log2.co>
+ *
+ * log2sockets is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * log2sockets is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TCP_RESPONSE_CACHE_H
+#define	TCP_RESPONSE_CACHE_H
+
+#include <list>
+#include <mutex>
+#include <memory>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <cstddef>
+#include <cstdint>
+#include "tx_queue.h"
+
+namespace tcp {
+
+    struct cache_stats {
+        uint64_t hits;
+        uint64_t misses;
+        uint64_t inserts;
+        uint64_t evictions;
+        uint64_t expired;
+        size_t entries;
+        size_t bytes;
+    };
+
+    /* replies of idempotent requests keyed by the request
+     * line. sharded LRU, each shard holds an equal share
+     * of the byte budget. a hit hands out the stored buffer
+     * itself, nothing is copied or allocated. */
+    class response_cache {
+    public:
+
+        response_cache(size_t max_bytes, uint32_t ttl_ms, size_t shards = 16);
+
+        // false on a miss or an expired entry
+        bool lookup(const std::string &request, shared_buffer &reply);
+        void insert(const std::string &request, const std::string &reply);
+
+        void clear(void);
+        cache_stats stats(void);
+
+    private:
+
+        struct entry {
+            std::string request;
+            shared_buffer reply;
+            uint64_t expires;
+        };
+
+        typedef std::list<entry> lru_list;
+
+        struct shard {
+            std::mutex mutex;
+            // most recently used first
+            lru_list lru;
+            std::unordered_map<std::string, lru_list::iterator> index;
+            size_t bytes;
+            cache_stats counts;
+        };
+
+        size_t shard_bytes_;
+        uint32_t ttl_ms_;
+        std::vector<std::unique_ptr<shard>> shards_;
+
+        shard &shard_for(const std::string &request);
+        void erase(shard &, lru_list::iterator);
+
+        static size_t cost(const entry &);
+        static uint64_t now_ms(void);
+    };
+}
+
+#endif	/* TCP_RESPONSE_CACHE_H */
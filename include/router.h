@@ -0,0 +1,121 @@
+/*
+ * socket
+ * Copyright (C) log2 2013 - Present <aaron.hebert@log2.co>
+ *
+ * log2sockets is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * log2sockets is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TCP_ROUTER_H
+#define	TCP_ROUTER_H
+
+#include <mutex>
+#include <memory>
+#include <string>
+#include <vector>
+#include <utility>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include "client.h"
+
+namespace tcp {
+
+    /* routes requests by key over a pool of servers.
+     *
+     * every endpoint owns 'vnodes' points on a hash ring, a
+     * key goes to the first endpoint clockwise from its hash.
+     * an endpoint that fails is skipped until it answers
+     * again, only its keys move to their next endpoint.
+     * with bounded load an endpoint is passed over while it
+     * has more than load_factor times the mean number of
+     * requests in flight. connections are authenticated
+     * once and pooled per endpoint. safe to share between
+     * threads.
+     */
+    class hash_router {
+    public:
+
+        hash_router(std::string key = "", auth auth_ = tcp::auth::MD5,
+                size_t vnodes = 160, double load_factor = 1.25);
+
+        void add_endpoint(const std::string &host, const std::string &port);
+
+        // idle connections kept per endpoint, and the most open at once
+        void set_pool(size_t idle, size_t max) {
+            pool_idle_ = idle;
+            pool_max_ = max;
+        }
+
+        /* a reply that takes longer than ms counts as the
+         * endpoint failing, it is marked down. 0 == wait
+         * forever. applies to connections opened later. */
+        void set_request_timeout(uint32_t ms) {
+            request_timeout_ms_ = ms;
+        }
+
+        /* sends a one line request to key's endpoint and
+         * returns its reply. a broken endpoint is marked
+         * down and the next one tried. EOL alone if none
+         * answered. */
+        std::string request(const std::string &key, const std::string &line);
+
+        // key's endpoint as "host:port", empty if all are down
+        std::string route(const std::string &key);
+
+        size_t endpoints_up(void);
+
+    private:
+
+        struct endpoint {
+            std::string host;
+            std::string port;
+
+            std::vector<std::unique_ptr<client>> idle;
+            size_t open;
+            size_t in_flight;
+
+            // skipped until then, 0 == up
+            uint64_t down_until_ms;
+            uint32_t backoff_ms;
+        };
+
+        std::string key_;
+        auth auth_;
+        size_t vnodes_;
+        double load_factor_;
+        size_t pool_idle_;
+        size_t pool_max_;
+        uint32_t request_timeout_ms_;
+
+        std::vector<std::unique_ptr<endpoint>> endpoints_;
+
+        // sorted by hash, second is an index into endpoints_
+        std::vector<std::pair<uint64_t, size_t>> ring_;
+        size_t in_flight_;
+
+        std::mutex mutex_;
+        std::condition_variable pool_cv_;
+
+        static const uint32_t DOWN_MIN_MS = 100;
+        static const uint32_t DOWN_MAX_MS = 5000;
+
+        static uint64_t hash(const std::string &str);
+        int pick(uint64_t h, const std::vector<bool> &tried, bool bounded);
+        std::unique_ptr<client> checkout(endpoint &ep, bool &pooled);
+        void checkin(endpoint &ep, std::unique_ptr<client> conn);
+        void mark_down(endpoint &ep);
+    };
+}
+
+#endif	/* TCP_ROUTER_H */
@@ -23,12 +23,23 @@
 #include <vector>
 #include <string>
 #include <memory>
+#include <set>
+#include <map>
+#include <unordered_map>
+#include <atomic>
 #include "tcp.h"
+#include "timer_wheel.h"
+#include "response_cache.h"
+#include "conn_registry.h"
+#include "affinity.h"
+#include "channel.h"
+#include "completion.h"
+#include "reliable.h"
+#include "replicator.h"
+#include "deadline.h"
 
 namespace tcp {
 
-    typedef std::vector<std::shared_ptr<std::thread>> connection_threads;
-
     /* function pointer to call to handle the
      * actual connection. either is API or CLI */
     typedef void (*connection)(std::thread *, const int);
@@ -40,13 +51,52 @@ namespace tcp {
      */
     typedef std::string(*read_handler)(std::string);
 
+    /* hands a streaming handler's reply to the connection
+     * chunk by chunk. each write goes out before it returns
+     * and blocks while the peer is behind, so a reply never
+     * has to exist in memory as a whole. */
+    class reply_sink {
+    public:
+
+        // false once the connection failed, stop producing
+        bool write(const void *data, size_t len);
+        bool write(const std::string &chunk);
+        bool write(shared_buffer chunk);
+
+        bool ok(void) const {
+            return ok_;
+        }
+
+        uint64_t written(void) const {
+            return written_;
+        }
+
+    private:
+        friend class server;
+
+        explicit reply_sink(ip_point &ipend) :
+        ipend_(ipend), ok_(true), written_(0) {
+        }
+
+        ip_point &ipend_;
+        bool ok_;
+        uint64_t written_;
+    };
+
+    /* streaming reader, writes its reply to the sink as
+     * it is produced. the client sees the first chunk
+     * before the handler returns. */
+    typedef void (*stream_handler)(std::string, reply_sink &);
+
     class server : public socket {
     public:
 
         server(std::string key = "", auth auth_ = tcp::auth::OFF);
         virtual ~server();
 
-        // listens for incomming connections
+        /* listens for incomming connections. a host of
+         * "unix:/path" or "unix:@name" listens on an AF_UNIX
+         * socket, port is ignored. */
         bool listen(const std::string host,
                 const std::string port);
 
@@ -57,48 +107,368 @@ namespace tcp {
         }
 
         /* sets function to call when data is
-         * read form the stream */
-        void set_read_callback(read_handler reader) {
+         * read form the stream. a cacheable reader is a
+         * pure function of the line, with a response cache
+         * repeated lines are answered without calling it. */
+        void set_read_callback(read_handler reader, bool cacheable = false) {
             server::my_reader = reader;
+            server::reader_cacheable_ = cacheable;
         }
 
-        unsigned char *md5_auth_hash(void) {
-            return md5_auth_hash_;
+        /* lines go to a streaming handler instead of the
+         * read callback. the reply's framing is up to the
+         * handler, e.g. lines closed by an empty one. */
+        void set_stream_callback(stream_handler streamer) {
+            server::my_streamer = streamer;
+        }
+
+        /* lines go to an async handler instead of the read
+         * callback. it replies through its completion, from
+         * any thread; the connection reads on meanwhile and
+         * replies go out in request order. connections with
+         * an async handler reply through a tx queue and stay
+         * on TCP. */
+        void set_async_callback(async_handler handler) {
+            server::my_async = handler;
         }
 
-        // sets max number of connections we intend to buffer
+        /* streams every accepted line, in order, to a hot
+         * standby at host:port, which must use the same key.
+         * a standby more than max_lag bytes behind is dropped
+         * until readmit_standby(). channel frames are not
+         * replicated. */
+        void add_standby(const std::string &host, const std::string &port,
+                size_t max_lag = STANDBY_MAX_LAG) {
+            if (!replicator_)
+                replicator_.reset(new replicator(md5_key_, auth_type_, max_lag));
+            replicator_->add_standby(host, port);
+        }
+
+        /* feeds a dropped standby again, once the caller has
+         * resynced it; the lines it missed are not replayed */
+        bool readmit_standby(const std::string &host, const std::string &port) {
+            return replicator_ && replicator_->readmit(host, port);
+        }
+
+        std::vector<standby_stats> replication_stats(void) {
+            return replicator_ ? replicator_->stats() :
+                    std::vector<standby_stats>();
+        }
 
+        /* applies lines a primary replicates to us, their
+         * replies are dropped. the read callback if unset. */
+        void set_standby_callback(read_handler applier) {
+            server::my_standby = applier;
+        }
+
+        /* handles complete messages on a logical channel,
+         * the reply goes back on the same channel. channels
+         * without a handler go to the read callback. */
+        void set_channel_handler(uint16_t channel, read_handler handler) {
+            server::channel_handlers_[channel] = handler;
+        }
+
+        /* caches up to max_bytes of replies from a cacheable
+         * reader for ttl_ms each, 0 == until evicted. before
+         * listen() or takeover() only, connection threads read
+         * the cache unlocked; false once they may run. */
+        bool set_response_cache(size_t max_bytes, uint32_t ttl_ms,
+                size_t shards = 16) {
+            if (server::server_) return false;
+
+            server::cache_.reset(new response_cache(max_bytes, ttl_ms, shards));
+            return true;
+        }
+
+        // zeroes without a response cache
+        cache_stats response_cache_stats(void) {
+            return cache_ ? cache_->stats() : cache_stats();
+        }
+
+        unsigned char *md5_auth_hash(void) {
+            return md5_hash_.get();
+        }
+
+        /* sets max number of connections we intend to buffer,
+         * the listen() backlog. SOMAXCONN by default */
         void set_max_conn_buffer(const int conns) {
             server::max_conn_buffered = conns;
         }
 
-        void kill(void) {
-            server::kill_ = true;
+        /* wake accept only once the peer has sent data, its
+         * auth token or first request. gives up on silent
+         * peers after about 'seconds'. TCP only, 0 == off */
+        void set_defer_accept(uint32_t seconds) {
+            server::defer_accept_s_ = seconds;
+        }
+
+        /* bounds each connection's output queue, replies
+         * are written by a drain thread so a slow reader
+         * never stalls its connection thread */
+        void set_tx_budget(size_t low, size_t high,
+                tx_policy policy = tx_policy::DISCONNECT) {
+            server::conn_tx_low_ = low;
+            server::conn_tx_high_ = high;
+            server::conn_tx_policy_ = policy;
+        }
+
+        /* closes connections that send nothing for ms
+         * milliseconds, 0 == never */
+        void set_idle_timeout(uint32_t ms) {
+            idle_timeout_ms_ = ms;
+        }
+
+        /* closes connections that have not completed the
+         * auth exchange within ms milliseconds, 0 == never */
+        void set_handshake_timeout(uint32_t ms) {
+            handshake_timeout_ms_ = ms;
+        }
+
+        /* queues buf on every connection subscribed to topic,
+         * the buffer is shared, not copied. buf should end
+         * with EOL. returns the number of connections it
+         * was queued on. */
+        size_t publish(const std::string &topic, shared_buffer buf);
+        size_t publish(const std::string &topic, const std::string &msg);
+
+        /* queues buf on every connection with a tx queue,
+         * all of them once set_tx_budget() is in effect.
+         * subscribers never block, a set_tx_budget() BLOCK
+         * queue that is full makes the caller wait. */
+        size_t broadcast(shared_buffer buf);
+        size_t broadcast(const std::string &msg);
+
+        /* pins the accept thread to accept_cpus and each
+         * connection thread, which runs its handler and
+         * starts its tx queue drain, to io_cpus. with
+         * follow_irq a connection is pinned to the io CPU
+         * its packets arrive on. stream buffers of pinned
+         * connections are allocated on the local NUMA node.
+         * empty lists leave threads floating. */
+        void set_cpu_affinity(const cpu_list &accept_cpus,
+                const cpu_list &io_cpus, bool follow_irq = true) {
+            accept_cpus_ = accept_cpus;
+            io_cpus_ = io_cpus;
+            follow_irq_ = follow_irq;
         }
 
+        // live connections, see conn_registry
+        size_t connection_count(void) {
+            return registry_.size();
+        }
+
+        void for_each_connection(
+                std::function<void(conn_handle, const conn_stats &) > fn) {
+            registry_.for_each(fn);
+        }
+
+        bool connection_stats(conn_handle handle, conn_stats &stats) {
+            return registry_.stats(handle, stats);
+        }
+
+        // the connection a read handler is called for, 0 elsewhere
+        static conn_handle current_connection(void);
+
+        /* microseconds left of the time budget of the request
+         * a handler is called for, -1 if it carries none.
+         * calls downstream can be cut to fit. async handlers
+         * ask their completion. */
+        static int64_t remaining_us(void);
+
+        // requests answered expired because their budget ran out
+        uint64_t expired_requests(void) {
+            return expired_;
+        }
+
+        // shuts the connection down, false if already gone
+        bool kick(conn_handle handle);
+
+        /* queues buf on one connection, which needs a tx
+         * queue (set_tx_budget() or a subscription) */
+        bool send_to(conn_handle handle, shared_buffer buf);
+        bool send_to(conn_handle handle, const std::string &msg);
+
+        // stops accepting and wakes idle connections
+        void kill(void);
+
+        /* hands the listening socket to a process calling
+         * takeover() on the same unix socket path, idle
+         * connections follow when idle_conns is set. only
+         * a process of the same user is accepted on path.
+         * blocks until in-flight requests have drained, or
+         * drain_ms passed and the busy ones were cut off,
+         * the caller is then free to exit.
+         *
+         * only the socket moves. a connection with state in
+         * this process, subscriptions, channels, a reliable
+         * session, shared memory or a replica link, is closed
+         * instead and its peer reconnects to the new one. */
+        bool handoff(const std::string &path, bool idle_conns = true,
+                uint32_t drain_ms = 30000);
+
+        /* receives the listening socket and idle connections
+         * from a process calling handoff() on path */
+        bool takeover(const std::string &path);
+
     private:
 
+        /* all server state is per instance, any number of
+         * servers can run side by side in one process */
         std::unique_ptr<std::thread> server_;
-        static bool kill_;
+        std::atomic<bool> kill_;
+
+        // custom connection handler, nullptr == connection_loop
         connection my_connection;
 
-        static read_handler my_reader;
-        static int max_conn_buffered;
-        static connection_threads connections;
+        read_handler my_reader;
+        stream_handler my_streamer;
+        async_handler my_async;
+        read_handler my_standby;
+        bool reader_cacheable_;
+        std::map<uint16_t, read_handler> channel_handlers_;
+
+        // a channel's partial message and credit not yet granted back
+        struct channel_rx {
+
+            channel_rx() : ungranted(0) {
+            }
+
+            std::string message;
+            size_t ungranted;
+        };
+        typedef std::map<uint16_t, channel_rx> channel_map;
+
+        /* last sequence delivered for a reliable session,
+         * shared by the connections resuming it */
+        struct session_state {
+
+            session_state() : delivered(0), touched(0) {
+            }
+
+            std::atomic<uint64_t> delivered;
+            uint64_t touched;
+        };
 
-        static unsigned char md5_auth_hash_[MD5_HASH_SIZE];
-        static auth srv_auth_type_;
+        // the reliable session of one connection, if any
+        struct reliable_rx {
+
+            reliable_rx() : unacked(0), acked(0) {
+            }
+
+            std::shared_ptr<session_state> state;
+            size_t unacked;
+            uint64_t acked;
+        };
+
+        std::unordered_map<uint64_t, std::shared_ptr<session_state>> sessions_;
+        std::mutex sessions_mutex_;
+        uint64_t session_clock_;
+        std::unique_ptr<response_cache> cache_;
+
+        // standbys fed with what we accept, see add_standby()
+        std::unique_ptr<replicator> replicator_;
+        static const size_t STANDBY_MAX_LAG = 64 * 1024 * 1024;
+        int max_conn_buffered;
+        uint32_t defer_accept_s_;
+
+        cpu_list accept_cpus_;
+        cpu_list io_cpus_;
+        bool follow_irq_;
+
+        // most connections accepted per wake up
+        static const int ACCEPT_BATCH = 64;
+
+        // every connection being served
+        conn_registry registry_;
+
+        // per connection tx queue budget, 0 == unbounded stdio
+        size_t conn_tx_low_;
+        size_t conn_tx_high_;
+        tx_policy conn_tx_policy_;
+
+        // eventfd signalled by kill() and handoff()
+        int wake_fd_;
+
+        uint32_t idle_timeout_ms_;
+        uint32_t handshake_timeout_ms_;
+
+        // handshake and idle timer of one connection
+        struct conn_timer {
+            timer t;
+            int socket;
+            uint32_t idle_ms;
+            std::atomic<bool> busy;
+            std::atomic<uint64_t> last_active;
+        };
+
+        static void expire_handshake(void *);
+        static void expire_idle(void *);
+
+        /* accept, handoff and connection threads still
+         * running; the destructor waits for them */
+        std::atomic<int> threads_;
+
+        // connections being served, handoff() waits on 0
+        std::atomic<int> active_conns_;
+
+        std::atomic<uint64_t> expired_;
+
+        // the subscribers of each topic
+        std::map<std::string, std::set<conn_handle>> topics_;
+        std::mutex publish_mutex_;
+
+        // push and async queue budget without set_tx_budget()
+        static const size_t PUSH_TX_LOW = 256 * 1024;
+        static const size_t PUSH_TX_HIGH = 1024 * 1024;
+
+        // filesystem path of a "unix:" listener
+        std::string unix_path_;
+
+        std::atomic<bool> handing_off_;
+        bool handoff_conns_;
+        int handoff_channel_;
+        std::mutex handoff_mutex_;
 
         void bind(void);
 
+        void wake(void);
+        bool wait_readable(const int);
+        void spawn(std::thread *);
+        void place_connection(const int);
+
         /* listens for incomming connections and
          * calls the connections handler */
-        static void listen_loop(const int &, addrinfo, connection con);
+        void listen_loop(const int, connection con);
 
         // default connection handler
-        static void connection_loop(std::thread *, const int);
+        void connection_loop(std::thread *, const int);
+
+        // connections received from handoff(), already authorized
+        void handoff_loop(const int);
+        void serve(const int, bool authenticate);
+        bool hand_off_connection(ip_point &, conn_handle, const int);
+        bool drain_replies(reply_order &);
+
+        bool read_request(ip_point &, std::string &);
+        size_t input_pending(ip_point &);
+        int read_byte(ip_point &);
+        bool read_exact(ip_point &, std::string &, size_t);
+        bool channel_frame(ip_point &, channel_map &, const std::string &);
+        bool open_session(ip_point &, reliable_rx &, const std::string &);
+        bool sequenced(ip_point &, reliable_rx &, std::string &);
+        bool send_ack(ip_point &, reliable_rx &);
+        bool write_reply(ip_point &, const std::string &);
+        bool write_reply(ip_point &, const shared_buffer &);
+        bool control(ip_point &, conn_handle, const std::string &);
+        std::shared_ptr<tx_queue> own_tx_queue(ip_point &, conn_handle, tx_policy);
+        bool subscribe(ip_point &, conn_handle, const std::string &, tx_policy);
+        void unsubscribe(conn_handle, const std::string &);
+        bool subscribed(conn_handle);
+        void drop_subscriber(conn_handle);
+        size_t push(const std::vector<std::shared_ptr<tx_queue>> &,
+                shared_buffer);
 
-        static bool authorized(ip_point &);
+        bool authorized(ip_point &);
     };
 }
 
@@ -0,0 +1,147 @@
+/*
+ * socket
+ * Copyright (C) log2 2013 - Present <aaron.hebert@log2.co>
+ *
+ * log2sockets is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * log2sockets is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TCP_SHM_H
+#define	TCP_SHM_H
+
+#include <atomic>
+#include <string>
+#include <memory>
+#include <functional>
+#include <cstddef>
+#include <cstdint>
+
+namespace tcp {
+
+    struct shm_ring_header;
+
+    /* single-producer/single-consumer byte ring in shared
+     * memory. both ends spin briefly and only sleep on a
+     * futex when the ring stays empty (or full), so a busy
+     * link never enters the kernel. */
+    class shm_ring {
+    public:
+
+        shm_ring() : hdr_(nullptr), data_(nullptr), size_(0),
+        head_(0), tail_(0) {
+        }
+
+        // bytes of shared memory for a ring of 'size' bytes
+        static size_t footprint(size_t size);
+
+        void attach(void *mem, size_t size, bool init);
+
+        // producer side, written bytes are private until publish()
+        size_t try_write(const void *data, size_t len);
+        void publish(void);
+        bool wait_writable(int timeout_ms);
+
+        // consumer side
+        size_t try_read(void *data, size_t len);
+        bool wait_readable(int timeout_ms);
+
+        void close(void);
+        bool closed(void);
+
+    private:
+        shm_ring_header *hdr_;
+        char *data_;
+        size_t size_;
+
+        // local copies, only one side writes each
+        uint64_t head_;
+        uint64_t tail_;
+    };
+
+    /* a pair of rings shared by two processes on one host.
+     * the server hands the client a nonce over the
+     * authenticated connection, the client creates the
+     * region under it and the server maps only that name.
+     * the connection then stays open only to detect the
+     * peer going away. */
+    class shm_link {
+    public:
+
+        ~shm_link();
+
+        // client side, creates the region for the server's nonce
+        static std::shared_ptr<shm_link> create(size_t ring_size,
+                const std::string &nonce);
+
+        // server side, maps the region created for nonce
+        static std::shared_ptr<shm_link> open(const std::string &nonce);
+
+        // the region name for nonce
+        static std::string region(const std::string &nonce);
+
+        const std::string &name(void) {
+            return name_;
+        }
+
+        // the connection used for liveness checks
+        void set_socket(int socket) {
+            socket_ = socket;
+        }
+
+        size_t write(const void *data, size_t len);
+        void flush(void);
+
+        /* blocks until len bytes are read, the peer goes
+         * away or stop() returns true */
+        size_t read(void *data, size_t len,
+                std::function<bool(void) > stop = nullptr);
+
+        bool readline(std::string &line, char eol,
+                std::function<bool(void) > stop = nullptr);
+
+        void close(void);
+        bool closed(void);
+
+    private:
+
+        shm_link() : mem_(nullptr), mem_size_(0), creator_(false),
+        socket_(-1), rx_pos_(0), rx_len_(0) {
+        }
+
+        bool map(int fd, size_t ring_size, bool init);
+        bool peer_alive(void);
+        bool fill(std::function<bool(void) > &stop);
+
+        std::string name_;
+        void *mem_;
+        size_t mem_size_;
+        bool creator_;
+        int socket_;
+
+        shm_ring tx_;
+        shm_ring rx_;
+
+        // staging so lines are not read a byte at a time
+        char rx_buf_[4096];
+        size_t rx_pos_;
+        size_t rx_len_;
+    };
+
+    // true if the peer on socket runs on this host
+    bool same_host(int socket);
+
+    // 128 random bits in hex, names one connection's region
+    std::string shm_nonce(void);
+}
+
+#endif	/* TCP_SHM_H */
@@ -0,0 +1,64 @@
+/*
+ * socket
+ * Copyright (C) log2 2013 - Present <aaron.hebert@log2.co>
+ *
+ * log2sockets is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * log2sockets is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TCP_SOCKOPT_H
+#define	TCP_SOCKOPT_H
+
+#include <cstdint>
+
+namespace tcp {
+
+    // named option sets, see profile_options()
+    enum class sock_profile : uint8_t {
+        DEFAULT, LOW_LATENCY, BULK
+    };
+
+    /* socket options applied at connect and accept.
+     * -1 leaves the kernel default alone. */
+    struct sock_options {
+        int nodelay;
+        // TCP_QUICKACK is not sticky, it is re-armed after each read
+        int quickack;
+        int busy_poll_us;
+        int priority;
+        // IP_TOS, IPV6_TCLASS on IPv6
+        int tos;
+        int notsent_lowat;
+        int sndbuf;
+        int rcvbuf;
+
+        /* spin on the socket this long before blocking when
+         * a read finds nothing buffered, 0 == never */
+        uint32_t spin_us;
+    };
+
+    sock_options profile_options(sock_profile profile);
+
+    /* TCP level options are skipped on AF_UNIX sockets.
+     * false if any option was refused, the rest are set. */
+    bool apply_sock_options(int socket, const sock_options &opts);
+
+    // re-arm TCP_QUICKACK if opts ask for it
+    void rearm_quickack(int socket, const sock_options &opts);
+
+    /* poll the socket without sleeping for up to spin_us.
+     * true once it has data or EOF to read. */
+    bool spin_readable(int socket, uint32_t spin_us);
+}
+
+#endif	/* TCP_SOCKOPT_H */
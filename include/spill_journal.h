@@ -0,0 +1,106 @@
+/*
+ * socket
+ * Copyright (C) log2 2013 - Present <aaron.hebert@log2.co>
+ *
+ * log2sockets is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * log2sockets is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TCP_SPILL_JOURNAL_H
+#define	TCP_SPILL_JOURNAL_H
+
+#include <deque>
+#include <string>
+#include <cstddef>
+#include <cstdint>
+
+namespace tcp {
+
+    // default segment file size
+    static const size_t SPILL_SEGMENT = 4 * 1024 * 1024;
+
+    // bytes per write while a journal drains
+    static const size_t SPILL_BATCH = 256 * 1024;
+
+    /* append-only journal of outbound messages, kept while
+     * no endpoint is reachable.
+     *
+     * records go into fixed size segment files in dir, each
+     * memory mapped, so an append is a copy into the page
+     * cache and never waits on the disk. a full segment is
+     * followed by a new one, a drained one is unlinked.
+     * segments left by an earlier process are picked up in
+     * order. not thread safe, the owning client serializes.
+     *
+     * segment: head, then records of u32 length + payload
+     */
+    class spill_journal {
+    public:
+
+        // false from open() if dir can not hold segments
+        spill_journal(const std::string &dir, size_t max_bytes,
+                size_t segment_bytes);
+        ~spill_journal();
+
+        bool open(void);
+
+        // false once max_bytes are spilled, the record is dropped
+        bool append(const void *data, size_t len);
+
+        /* appends whole records from the oldest on to out,
+         * stopping before max_bytes. they stay journaled
+         * until pop(). returns the records appended. */
+        size_t peek(std::string &out, size_t max_bytes);
+        void pop(size_t records);
+
+        bool empty(void) const {
+            return records_ == 0;
+        }
+
+        size_t bytes(void) const {
+            return bytes_;
+        }
+
+    private:
+
+        struct head {
+            uint64_t magic;
+            // first free byte, and first unread record
+            uint64_t end;
+            uint64_t start;
+        };
+
+        struct segment {
+            uint64_t id;
+            char *mem;
+            head *h;
+        };
+
+        std::string dir_;
+        size_t max_bytes_;
+        size_t segment_bytes_;
+
+        std::deque<segment> segments_;
+        uint64_t next_id_;
+
+        // unread payload bytes and records, all segments
+        size_t bytes_;
+        size_t records_;
+
+        std::string path(uint64_t id) const;
+        bool map(uint64_t id, bool create);
+        void unlink_front(void);
+    };
+}
+
+#endif	/* TCP_SPILL_JOURNAL_H */
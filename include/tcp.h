@@ -33,11 +33,41 @@
 #include <cassert>
 #include <cstring>
 #include <syslog.h>
+#include <unistd.h>
+#include <sys/un.h>
 #include "md5.h"
+#include "tx_queue.h"
+#include "shm.h"
+#include "timer_wheel.h"
+#include "codec.h"
+#include "sockopt.h"
 
 namespace tcp {
     
     extern char EOL;
+
+    /* lines starting with CTL are library control messages
+     * and never reach a read handler. the next byte names
+     * the message. */
+    extern char CTL;
+
+    enum class control : char {
+        // "<CTL>SN" asks for a region nonce, "<CTL>S<name>" offers it
+        SHM = 'S',
+        // "<CTL>T<policy><topic>", policy is '0' + tx_policy
+        SUBSCRIBE = 'T',
+        UNSUBSCRIBE = 'U',
+        // binary channel frame, see channel.h
+        FRAME = 'F',
+        // reliable mode, see reliable.h
+        RELIABLE = 'R',
+        SEQUENCED = 'Q',
+        ACK = 'A',
+        // replication link from a primary, see replicator.h
+        REPLICA = 'P',
+        // time budget of a request, see deadline.h
+        BUDGET = 'B'
+    };
    
     // auth ON/OFF
     enum class auth : uint8_t {
@@ -58,7 +88,10 @@ namespace tcp {
 
         ip_point() : socket_(0),
         rx_buffer_size(4096),
-        tx_buffer_size(4096) {
+        tx_buffer_size(4096),
+        tx_batch_bytes(0),
+        tx_batch_msgs(0),
+        linger_armed(false) {
             rp = nullptr;
             results = nullptr;
             tx = nullptr;
@@ -71,6 +104,10 @@ namespace tcp {
         addrinfo hints;
         addrinfo *results, *rp;
 
+        // results for "unix:" endpoints, not from getaddrinfo()
+        sockaddr_un unix_addr;
+        addrinfo unix_info;
+
         int socket_;
         int rx_buffer_size;
         int tx_buffer_size;
@@ -78,6 +115,39 @@ namespace tcp {
         FILE *tx;
         FILE *rx;
 
+        /* bounded output queue, when set writes are
+         * collected in tx_pending and queued on send() */
+        std::shared_ptr<tx_queue> txq;
+        std::string tx_pending;
+
+        // shared memory rings, replace the streams once set
+        std::shared_ptr<shm_link> shm;
+        // handed to the peer, the only region it may offer
+        std::string shm_nonce;
+
+        // armed while a read waits on the request timeout
+        timer deadline;
+
+        // holds messages for read_view() that straddle a refill
+        std::string rx_scratch;
+
+        // written since the last flush, see set_flush_policy()
+        size_t tx_batch_bytes;
+        size_t tx_batch_msgs;
+        timer linger;
+        bool linger_armed;
+
+        /* true if the rx stream holds unread bytes.
+         * without glibc internals assume it does, so
+         * callers fall back to a blocking read. */
+        bool rx_pending(void) {
+#ifdef __GLIBC__
+            return rx != nullptr && rx->_IO_read_ptr < rx->_IO_read_end;
+#else
+            return true;
+#endif
+        }
+
         bool connected(void) {
 
             if (this->rx == nullptr) return false;
@@ -87,6 +157,8 @@ namespace tcp {
             if (feof_unlocked(this->rx)) return false;
             if (feof_unlocked(this->tx)) return false;
 
+            if (this->shm && this->shm->closed()) return false;
+
             return true;
         }
     };
@@ -95,6 +167,8 @@ namespace tcp {
     private:
         friend class server;
         friend class client;
+        friend class quorum_writer;
+        friend class replicator;
 
         // key and digested key
         std::string md5_key_;
@@ -103,8 +177,35 @@ namespace tcp {
         bool is_authed_;
         auth auth_type_;
 
+        // ring size offered to same host peers, 0 == off
+        size_t shm_size_;
+
+        // longest a read may wait for the peer, 0 == forever
+        uint32_t request_timeout_ms_;
+
+        // SO_PEERCRED in place of the MD5 token on unix sockets
+        bool peer_cred_;
+        uid_t peer_uid_;
+
         int lock_interval_;
         std::mutex write_mutex_;
+
+        // tx queue byte budget, disabled when tx_high_ == 0
+        size_t tx_low_;
+        size_t tx_high_;
+        tx_policy tx_policy_;
+        writable_handler on_writable_;
+
+        // TCP Fast Open, client on/off or server queue length
+        int fast_open_;
+
+        // applied at connect and accept, see set_profile()
+        sock_options sock_opts_;
+
+        // auto flush thresholds, 0 == off
+        size_t flush_bytes_;
+        size_t flush_msgs_;
+        uint32_t flush_linger_us_;
         
         std::shared_ptr<ip_point> ip_endpoint_;
 
@@ -127,9 +228,64 @@ namespace tcp {
         bool tx_buff_size(const size_t &);
         bool rx_buff_size(const size_t &);
 
+        /* on "unix:" endpoints trust the peer's uid in
+         * place of the MD5 token exchange. must be enabled
+         * on both ends. */
+        void set_peer_cred(bool enable, uid_t uid = geteuid());
+
+        /* after authenticating, move traffic to shared memory
+         * rings of ring_size bytes if the server runs on this
+         * host. remote peers stay on TCP. */
+        void use_shm(size_t ring_size = 1 << 20);
+        bool negotiate_shm(void);
+
+        /* a read or readline that waits longer than ms
+         * shuts the connection down, connected() then
+         * turns false and the caller can fail over */
+        void set_request_timeout(uint32_t ms) {
+            request_timeout_ms_ = ms;
+        }
+
+        /* flush without send() once 'bytes' or 'msgs' writes
+         * are pending, or linger_us after the first pending
+         * write. linger runs on the shared timer wheel and is
+         * rounded up to whole milliseconds. all 0 == manual. */
+        void set_flush_policy(size_t bytes, size_t msgs = 0,
+                uint32_t linger_us = 0);
+
+        /* option set applied at connect() and, on a server,
+         * to every accepted connection. a profile with spin_us
+         * busy polls the socket before a read blocks. */
+        void set_profile(sock_profile profile) {
+            sock_opts_ = profile_options(profile);
+        }
+
+        void set_sock_options(const sock_options &opts) {
+            sock_opts_ = opts;
+        }
+
+        /* TCP Fast Open. connect() sends the first write in
+         * the SYN when queue_len > 0, listen() accepts data
+         * in the SYN for up to queue_len pending connections.
+         * needs net.ipv4.tcp_fastopen set on the host. */
+        void set_fast_open(int queue_len) {
+            fast_open_ = queue_len;
+        }
+
+        /* bounds the output queue to 'high' bytes.
+         * callers are signalled through the writable
+         * handler once above 'high' and again once
+         * drained below 'low'. policy decides what
+         * a write past 'high' does, see tx_policy. */
+        void tx_queue_budget(size_t low, size_t high,
+                tx_policy policy = tx_policy::BLOCK);
+        void set_writable_callback(writable_handler handler);
+        bool writable(void);
+
         size_t read(void *data, const size_t size, const size_t count);
         std::string readline(void);
         uint128_t read128(void);
+        size_t read128(uint64_t (&bytes16)[2]);
         uint64_t read64(void);
         uint32_t read32(void);
         uint16_t read16(void);
@@ -147,6 +303,26 @@ namespace tcp {
         size_t write(const void *data, size_t size, size_t count);
         size_t write(std::string str);
 
+        /* size bytes straight out of the rx buffer, nullptr on
+         * a short read. valid until the next read. */
+        const uint8_t *read_view(size_t size);
+
+        /* encodes msg on the stack in network byte order and
+         * writes it under a single lock. */
+        template <typename Schema>
+        size_t write_msg(const typename Schema::type &msg) {
+            uint8_t bytes[Schema::size];
+            Schema::encode(msg, bytes);
+            return this->write(bytes, Schema::size);
+        }
+
+        /* fields are decoded on access, invalid view
+         * if the peer went away mid message. */
+        template <typename Schema>
+        view<Schema> read_msg(void) {
+            return view<Schema>(this->read_view(Schema::size));
+        }
+
         int tx_flush(void);
         int rx_flush(void);
 
@@ -171,6 +347,10 @@ namespace tcp {
 
     private:
         bool get_addr_info(const std::string host, const std::string port);
+        void free_addr_info(void);
+
+        void flush_for_read(void);
+        static void expire_linger(void *arg);
     };
 }
 #endif	/* TCP_SOCKETS_H */
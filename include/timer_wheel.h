@@ -0,0 +1,123 @@
+/*
+ * socket
+ * Copyright (C) log2 2013 - Present <aaron.hebert@log2.co>
+ *
+ * log2sockets is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * log2sockets is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TCP_TIMER_WHEEL_H
+#define	TCP_TIMER_WHEEL_H
+
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+
+namespace tcp {
+
+    typedef void (*timer_callback)(void *);
+
+    /* intrusive timer, embed it in whatever it times out.
+     * arming and cancelling never allocate. */
+    struct timer {
+
+        timer() : next(nullptr), prev(nullptr), expires(0),
+        callback(nullptr), arg(nullptr) {
+        }
+
+        timer *next;
+        timer *prev;
+        uint64_t expires;
+
+        timer_callback callback;
+        void *arg;
+
+        /* the wheel thread unlinks a timer as it fires, only
+         * read under the wheel's lock. timer_wheel::armed(t)
+         * elsewhere. */
+        bool armed(void) const {
+            return prev != nullptr;
+        }
+    };
+
+    /* hierarchical timing wheel, 4 levels of 256 slots.
+     * arm, cancel and expiry are O(1) per timer, timers
+     * further out cascade down a level every 256 ticks. */
+    class timer_wheel {
+    public:
+
+        timer_wheel(uint32_t tick_ms = 1);
+        ~timer_wheel();
+
+        // process wide wheel with its own driver thread
+        static timer_wheel &shared(void);
+
+        // (re)arm t to call callback(arg) after delay_ms
+        void arm(timer &t, uint64_t delay_ms,
+                timer_callback callback, void *arg);
+
+        /* disarm t. once cancel() returns the callback is
+         * not running and will not run. */
+        bool cancel(timer &t);
+
+        // run timers that are due, returns the number fired
+        size_t advance(void);
+
+        // drive advance() from a thread while timers are armed
+        void start(void);
+        void stop(void);
+
+        size_t armed(void);
+        bool armed(const timer &t);
+
+        uint64_t now_ms(void);
+
+    private:
+        static const int LEVELS = 4;
+        static const int SLOT_BITS = 8;
+        static const int SLOTS = 1 << SLOT_BITS;
+
+        uint32_t tick_ms_;
+        std::chrono::steady_clock::time_point start_;
+
+        // next tick to process
+        uint64_t next_;
+        size_t count_;
+
+        // circular lists, the sentinels are never fired
+        timer slots_[LEVELS][SLOTS];
+
+        // reused between ticks so firing does not allocate
+        std::vector<timer *> expired_;
+
+        std::mutex mutex_;
+        std::recursive_mutex firing_;
+
+        bool running_;
+        std::thread driver_;
+        std::condition_variable armed_cv_;
+
+        uint64_t ticks(void);
+        void link(timer &t);
+        void unlink(timer &t);
+        void cascade(int level, size_t slot);
+        size_t run_tick(void);
+        void drive(void);
+    };
+}
+
+#endif	/* TCP_TIMER_WHEEL_H */
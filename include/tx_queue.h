@@ -0,0 +1,131 @@
+/*
+ * socket
+ * Copyright (C) log2 2013 - Present <aaron.hebert@log2.co>
+ *
+ * log2sockets is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * log2sockets is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TCP_TX_QUEUE_H
+#define	TCP_TX_QUEUE_H
+
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <string>
+#include <memory>
+#include <functional>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+
+namespace tcp {
+
+    // immutable buffer, may be queued on many connections at once
+    typedef std::shared_ptr<const std::string> shared_buffer;
+
+    /* what to do when a producer pushes past
+     * the high watermark */
+    enum class tx_policy : uint8_t {
+        BLOCK, DROP_OLDEST, DISCONNECT
+    };
+
+    /* called on watermark crossings. false once the queue
+     * rises above the high watermark, true once it drains
+     * back below the low watermark. */
+    typedef std::function<void(bool) > writable_handler;
+
+    /* bounded per-connection output queue.
+     *
+     * buffers are written to the socket by a drain thread so
+     * the owner never blocks in write() on a slow peer. the
+     * byte budget is bounded by the high watermark and
+     * enforced with the configured policy.
+     *
+     * the owner close()s the queue before it closes the
+     * socket. copies held elsewhere may outlive both, the
+     * destructor never touches the socket.
+     */
+    class tx_queue {
+    public:
+
+        tx_queue(int socket, size_t low, size_t high, tx_policy policy);
+        ~tx_queue();
+
+        // false if the buffer was not queued
+        bool push(shared_buffer buf);
+        bool push(const std::string &str);
+
+        /* queues buf only if it fits under the high
+         * watermark, or the queue is empty. never waits,
+         * whatever the policy. */
+        bool try_push(shared_buffer buf);
+
+        // blocks until everything queued has been written
+        bool flush(void);
+
+        /* blocks until size more bytes fit under the high
+         * watermark, or the queue is empty. lets a producer
+         * apply backpressure whatever the policy. */
+        bool wait_space(size_t size);
+
+        /* stops the drain thread. pending data is written
+         * first when drain is true, otherwise discarded and
+         * the socket shut down for writing. once the queue
+         * failed or was drained the socket is left alone. */
+        void close(bool drain = false);
+
+        void set_writable_handler(writable_handler handler);
+        void set_policy(tx_policy policy);
+
+        bool writable(void);
+        bool closed(void);
+        size_t pending(void);
+        size_t dropped(void);
+
+    private:
+        int socket_;
+        size_t low_;
+        size_t high_;
+        tx_policy policy_;
+
+        std::deque<shared_buffer> queue_;
+        size_t bytes_;
+        size_t dropped_;
+
+        // front buffer is being written by the drain thread
+        bool sending_;
+        size_t offset_;
+
+        bool writable_;
+        bool closing_;
+        bool closed_;
+        // the drain thread has exited
+        bool stopped_;
+
+        writable_handler on_writable_;
+
+        std::mutex mutex_;
+        std::condition_variable data_cv_;
+        std::condition_variable space_cv_;
+        std::thread drain_;
+
+        bool append(std::unique_lock<std::mutex> &lock, shared_buffer buf);
+        void drain_loop(void);
+        void notify(bool writable);
+        // called with mutex_ held
+        void fail(void);
+    };
+}
+
+#endif	/* TCP_TX_QUEUE_H */
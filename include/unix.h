@@ -0,0 +1,61 @@
+/*
+ * socket
+ * Copyright (C) log2 2013 - Present <aaron.hebert@log2.co>
+ *
+ * log2sockets is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * log2sockets is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TCP_UNIX_H
+#define	TCP_UNIX_H
+
+#include <string>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+namespace tcp {
+
+    /* AF_UNIX helpers. a path starting with '@' is
+     * bound in the abstract namespace. */
+
+    // endpoints named "unix:<path>" use AF_UNIX
+    bool is_unix_host(const std::string &host);
+    std::string unix_host_path(const std::string &host);
+
+    // fill addr for path, false if path does not fit
+    bool unix_addr(const std::string &path, sockaddr_un &addr, socklen_t &len);
+
+    // true if socket is AF_UNIX
+    bool is_unix_socket(int socket);
+
+    /* true if the peer on a unix socket runs as uid,
+     * checked with SO_PEERCRED */
+    bool peer_uid_matches(int socket, uid_t uid);
+
+    // bind and listen on path, -1 on failure
+    int unix_listen(const std::string &path, int backlog);
+
+    // connect to path, -1 on failure
+    int unix_connect(const std::string &path);
+
+    /* pass fd over a unix socket with SCM_RIGHTS. the
+     * tag byte travels with it as the message body. */
+    bool send_fd(int channel, char tag, int fd);
+
+    /* receive a tag and, if one was sent, a fd.
+     * fd is -1 when the message carried none.
+     * false on EOF or error. */
+    bool recv_fd(int channel, char &tag, int &fd);
+}
+
+#endif	/* TCP_UNIX_H */
@@ -0,0 +1,119 @@
+/*
+ * socket
+ * Copyright (C) log2 2013 - Present <aaron.hebert@log2.co>
+ *
+ * log2sockets is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * log2sockets is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <pthread.h>
+#include <sched.h>
+#include <syslog.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include "affinity.h"
+
+// linux 3.19, older headers lack it
+#ifndef SO_INCOMING_CPU
+#define SO_INCOMING_CPU 49
+#endif
+
+namespace tcp {
+
+    bool parse_cpu_list(const std::string &list, cpu_list &cpus) {
+        cpus.clear();
+
+        const char *p = list.c_str();
+        while (*p != '\0') {
+            char *end;
+            long first = strtol(p, &end, 10);
+            if (end == p || first < 0) return false;
+
+            long last = first;
+            p = end;
+            if (*p == '-') {
+                last = strtol(++p, &end, 10);
+                if (end == p || last < first) return false;
+                p = end;
+            }
+
+            if (last >= CPU_SETSIZE) return false;
+            for (long cpu = first; cpu <= last; ++cpu)
+                cpus.push_back((int) cpu);
+
+            if (*p == ',') ++p;
+            else if (*p != '\0') return false;
+        }
+
+        return true;
+    }
+
+    bool pin_thread(const cpu_list &cpus) {
+        if (cpus.empty()) return true;
+
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        for (int cpu : cpus) {
+            if (cpu >= 0 && cpu < CPU_SETSIZE) CPU_SET(cpu, &set);
+        }
+
+        int rc = pthread_setaffinity_np(pthread_self(), sizeof (set), &set);
+        if (rc != 0) {
+            syslog(LOG_DEBUG, "unable to set thread affinity %d", rc);
+            return false;
+        }
+
+        return true;
+    }
+
+    bool unpin_thread(void) {
+        // the kernel narrows the full set to the cpuset
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) CPU_SET(cpu, &set);
+
+        int rc = pthread_setaffinity_np(pthread_self(), sizeof (set), &set);
+        if (rc != 0) {
+            syslog(LOG_DEBUG, "unable to reset thread affinity %d", rc);
+            return false;
+        }
+
+        return true;
+    }
+
+    int incoming_cpu(int socket) {
+        int cpu = -1;
+        socklen_t len = sizeof (cpu);
+
+        if (getsockopt(socket, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len) == -1)
+            return -1;
+
+        return cpu;
+    }
+
+    void *alloc_local(size_t size) {
+        void *buf = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (buf == MAP_FAILED) return nullptr;
+
+        memset(buf, 0, size);
+        return buf;
+    }
+
+    void free_local(void *buf, size_t size) {
+        if (buf != nullptr) munmap(buf, size);
+    }
+}
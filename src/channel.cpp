@@ -0,0 +1,56 @@
+/*
+ * socket
+ * Copyright (C) log2 2013 - Present <aaron.hebert@log2.co>
+ *
+ * log2sockets is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * log2sockets is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include "tcp.h"
+#include "channel.h"
+
+namespace tcp {
+
+    void append_frame(std::string &out, frame_kind kind, uint16_t channel,
+            uint8_t flags, const char *data, uint32_t len) {
+
+        frame_header h;
+        h.ctl = (uint8_t) CTL;
+        h.type = (uint8_t) control::FRAME;
+        h.kind = (uint8_t) kind;
+        h.flags = flags;
+        h.channel = channel;
+        h.length = len;
+
+        uint8_t bytes[frame_schema::size];
+        frame_schema::encode(h, bytes);
+
+        out.append((const char *) bytes, frame_schema::size);
+        if (kind == frame_kind::DATA) out.append(data, len);
+    }
+
+    void append_message(std::string &out, uint16_t channel,
+            const std::string &msg) {
+
+        size_t offset = 0;
+        do {
+            size_t n = std::min(FRAME_MAX, msg.size() - offset);
+            bool last = offset + n == msg.size();
+
+            append_frame(out, frame_kind::DATA, channel,
+                    last ? FRAME_FIN : 0, msg.data() + offset, (uint32_t) n);
+            offset += n;
+        } while (offset < msg.size());
+    }
+}
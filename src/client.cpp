@@ -17,20 +17,46 @@
  */
 
 #include <algorithm>
+#include <random>
+#include <poll.h>
 #include "client.h"
+#include "unix.h"
+#include "deadline.h"
 
 namespace tcp {
     //extern class ip_endpoint;
 
     client::client(std::string key, auth auth_) :
-    socket(key, auth_) {
+    socket(key, auth_),
+    backoff_initial_ms_(10),
+    backoff_max_ms_(5000),
+    last_channel_(0),
+    session_(0),
+    next_seq_(0),
+    ring_bytes_(0),
+    ring_max_(RELIABLE_RING),
+    next_attempt_ms_(0),
+    attempt_backoff_ms_(0),
+    hedge_percentile_(0.95),
+    hedge_budget_(0),
+    hedge_tokens_(0),
+    hedge_delay_us_(0),
+    latency_next_(0),
+    hedged_(0),
+    hedge_wins_(0),
+    owed_(0) {
 
     }
 
     bool client::authenticate(std::string host, std::string port) {
-        if (auth_type_ == auth::OFF) return false;
-        if (md5_key_.empty()) return false;
-        if (md5_hash_.get() == nullptr) return false;
+        // unix peers may be trusted by uid instead of a token
+        bool peer_cred = peer_cred_ && is_unix_host(host);
+
+        if (!peer_cred) {
+            if (auth_type_ == auth::OFF) return false;
+            if (md5_key_.empty()) return false;
+            if (md5_hash_.get() == nullptr) return false;
+        }
 
         if (redundent_conns.empty()) {
             add_failover(host, port);
@@ -39,14 +65,25 @@ namespace tcp {
 
         this->connect(host, port);
         if (this->connected()) {
-            this->write(md5_hash_.get(), MD5_HASH_SIZE);
-            this->send();
+            if (!peer_cred) {
+                this->write(md5_hash_.get(), MD5_HASH_SIZE);
+                this->send();
+            }
         } else {
             return false;
         }
 
         switch (this->read8()) {
             case (int) auth_status::AUTH_OK:
+                // same host, move to shared memory if asked to
+                if (shm_size_ > 0) this->negotiate_shm();
+                // resume the session, unacked lines go again
+                if (session_ != 0 && !this->open_session()) {
+                    this->disconnect();
+                    return false;
+                }
+                // what piled up during the outage goes first
+                if (journal_ && !journal_->empty()) this->drain_spill();
                 // reset to real active
                 return true;
                 break;
@@ -77,7 +114,18 @@ namespace tcp {
      */
     bool client::failover(void) {
         this->disconnect();
-        
+
+        /* the new server starts every channel with a fresh
+         * window, partly framed messages go again in full */
+        for (auto &c : channels_) {
+            c.second.window = CHANNEL_WINDOW;
+            c.second.offset = 0;
+        }
+        channel_rx_.clear();
+
+        static thread_local std::minstd_rand jitter(std::random_device{}());
+        uint32_t backoff = backoff_initial_ms_;
+
         do {
             for (auto &con : redundent_conns) {
                 this->ip_endpoint(con);
@@ -91,11 +139,549 @@ namespace tcp {
              * The benefits of this would be that 
              * the daemon will come back up once
              * a good connection is established.
-             * There needs to be a more controlled 
-             * break here */
+             * Back off between rounds, with jitter so
+             * a fleet of clients does not reconnect in
+             * lock step. */
+            if (backoff > 0) {
+                uint32_t wait = backoff / 2 + jitter() % (backoff / 2 + 1);
+                std::this_thread::sleep_for(std::chrono::milliseconds(wait));
+                backoff = std::min(backoff * 2, backoff_max_ms_);
+            }
         } while (!connected());
 
         // not reached
         return connected();
     }
-}
\ No newline at end of file
+
+    void client::set_reliable(size_t ring_bytes) {
+        static thread_local std::mt19937_64 ids(std::random_device{}());
+
+        do session_ = ids(); while (session_ == 0);
+        ring_max_ = ring_bytes;
+    }
+
+    /** Open or resume the reliable session.
+     *
+     * the server answers with the last sequence it has
+     * delivered, what follows it is sent again in one go.
+     */
+    bool client::open_session(void) {
+        this->write(reliable_line((char) control::RELIABLE, session_));
+        this->send();
+
+        if (!take_ack(this->readline())) {
+            syslog(LOG_DEBUG, "reliable session refused");
+            return false;
+        }
+
+        for (auto &line : ring_) this->write(line.second);
+        this->send();
+
+        return connected();
+    }
+
+    // drops what line acknowledges, false if it is no ack
+    bool client::take_ack(const std::string &line) {
+        uint64_t acked;
+        if (!parse_ack(line, acked)) return false;
+
+        while (!ring_.empty() && ring_.front().first <= acked) {
+            ring_bytes_ -= ring_.front().second.size();
+            ring_.pop_front();
+        }
+
+        return true;
+    }
+
+    // reads one line, keeping replies for read_reliable()
+    bool client::read_ack(void) {
+        std::string line = this->readline();
+
+        if (!connected()) {
+            this->failover();
+            return false;
+        }
+
+        if (!take_ack(line)) replies_.push_back(line);
+        return true;
+    }
+
+    bool client::send_reliable(const std::string &line) {
+        if (session_ == 0) return false;
+
+        std::string framed;
+        append_sequenced(framed, ++next_seq_, line);
+
+        // acks free the room, they come with the replies
+        while (!ring_.empty() && ring_bytes_ + framed.size() > ring_max_)
+            this->read_ack();
+
+        ring_.emplace_back(next_seq_, framed);
+        ring_bytes_ += framed.size();
+
+        bool sent = this->write(framed) == framed.size();
+        this->send();
+
+        // the new connection gets it from the ring
+        if (!sent || !connected()) this->failover();
+
+        return true;
+    }
+
+    std::string client::read_reliable(void) {
+        while (replies_.empty()) {
+            if (!this->read_ack()) return std::string(1, EOL);
+        }
+
+        std::string line;
+        line.swap(replies_.front());
+        replies_.pop_front();
+        return line;
+    }
+
+    bool client::wait_acked(void) {
+        if (session_ == 0) return false;
+
+        while (!ring_.empty()) this->read_ack();
+        return true;
+    }
+
+    bool client::set_spill(const std::string &dir, size_t max_bytes,
+            size_t segment_bytes) {
+        std::unique_ptr<spill_journal> journal(
+                new spill_journal(dir, max_bytes, segment_bytes));
+        if (!journal->open()) return false;
+
+        journal_.swap(journal);
+        return true;
+    }
+
+    bool client::post(const std::string &msg) {
+        if (!journal_) {
+            bool ok = this->write(msg) == msg.length();
+            return this->tx_flush() != EOF && ok;
+        }
+
+        if (!connected()) this->try_reconnect();
+
+        // nothing may overtake what is journaled
+        if (connected() && (journal_->empty() || this->drain_spill())) {
+            if (this->write(msg) == msg.length() && this->tx_flush() != EOF)
+                return true;
+
+            // broken pipe, the peer is gone
+            this->disconnect();
+        }
+
+        return journal_->append(msg.data(), msg.length());
+    }
+
+    /** One round over the endpoints, without waiting.
+     *
+     * rounds are spaced like failover() spaces them, so an
+     * outage costs the producer one failed connect per step.
+     */
+    bool client::try_reconnect(void) {
+        uint64_t now = std::chrono::duration_cast<std::chrono::milliseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count();
+        if (now < next_attempt_ms_) return false;
+
+        for (auto &con : redundent_conns) {
+            this->ip_endpoint(con);
+            if (authenticate(con->host, con->port) && connected()) {
+                attempt_backoff_ms_ = 0;
+                return true;
+            }
+        }
+
+        attempt_backoff_ms_ = attempt_backoff_ms_ == 0 ? backoff_initial_ms_ :
+                std::min(attempt_backoff_ms_ * 2, backoff_max_ms_);
+        next_attempt_ms_ = now + attempt_backoff_ms_;
+        return false;
+    }
+
+    /** Send the journal in order, SPILL_BATCH bytes per write.
+     *
+     * records leave the journal once their batch is flushed,
+     * false if the connection broke on the way.
+     */
+    bool client::drain_spill(void) {
+        std::string batch;
+        while (!journal_->empty()) {
+            batch.clear();
+            size_t records = journal_->peek(batch, SPILL_BATCH);
+
+            if (this->write(batch) != batch.length() ||
+                    this->tx_flush() == EOF) {
+                this->disconnect();
+                return false;
+            }
+
+            journal_->pop(records);
+        }
+
+        return true;
+    }
+
+    void client::set_hedging(double percentile, double budget_pct) {
+        hedge_percentile_ = std::min(std::max(percentile, 0.0), 1.0);
+        hedge_budget_ = budget_pct / 100;
+    }
+
+    std::string client::request(const std::string &line, bool idempotent) {
+        /* a connection that lost a race is still busy with
+         * that request, the other one takes over until it
+         * loses a race in turn */
+        if (owed_ > 0 && hedge_ && hedge_->owed_ == 0 &&
+                hedge_->connected() && session_ == 0 && channels_.empty()) {
+            std::swap(ip_endpoint_, hedge_->ip_endpoint_);
+            std::swap(owed_, hedge_->owed_);
+        }
+
+        auto start = std::chrono::steady_clock::now();
+
+        /* we give up after the request timeout, the server
+         * need not answer any later */
+        const uint64_t budget_us = (uint64_t) request_timeout_ms_ * 1000;
+        std::string msg;
+        if (budget_us > 0) {
+            append_budget(msg, budget_us, line);
+        } else {
+            msg = line;
+            if (msg.empty() || msg.back() != EOL) msg += EOL;
+        }
+
+        this->write(msg);
+        this->send();
+
+        std::string reply;
+        bool hedge = idempotent && hedge_budget_ > 0 && hedge_delay_us_ > 0 &&
+                !ip_endpoint_->shm;
+
+        if (hedge) {
+            hedge_tokens_ = std::min(hedge_tokens_ + hedge_budget_,
+                    (double) HEDGE_BURST);
+
+            if (wait_reply(nullptr, hedge_delay_us_, reply) == 0) {
+                this->time_reply(start);
+                if (expired(reply)) reply.clear();
+                return reply;
+            }
+
+            client *h = hedge_tokens_ >= 1 ? this->hedge_client() : nullptr;
+            if (h != nullptr) {
+                hedge_tokens_ -= 1;
+                ++hedged_;
+
+                if (budget_us > 0) {
+                    uint64_t spent = std::chrono::duration_cast<std::chrono::microseconds>(
+                            std::chrono::steady_clock::now() - start).count();
+                    msg.clear();
+                    append_budget(msg, budget_us > spent ? budget_us - spent : 0, line);
+                }
+
+                h->write(msg);
+                h->send();
+
+                int winner = wait_reply(h, -1, reply);
+                if (winner == 1) {
+                    ++hedge_wins_;
+                    ++owed_;
+                } else if (winner == 0 && hedge_.get() == h) {
+                    // a broken hedge was dropped while we waited
+                    ++h->owed_;
+                }
+
+                if (winner >= 0) {
+                    this->time_reply(start);
+                    if (expired(reply)) reply.clear();
+                    return reply;
+                }
+            }
+        }
+
+        // not hedged, or the hedge broke
+        while (!take_reply(reply));
+        if (connected()) this->time_reply(start);
+        if (expired(reply)) reply.clear();
+        return reply;
+    }
+
+    /** Connection for hedges.
+     *
+     * the first endpoint after ours in the failover list that
+     * answers. nullptr if there is none.
+     */
+    client *client::hedge_client(void) {
+        if (hedge_ && hedge_->connected()) return hedge_.get();
+        hedge_.reset();
+
+        for (auto &con : redundent_conns) {
+            if (con == ip_endpoint_ || (con->host == ip_endpoint_->host &&
+                    con->port == ip_endpoint_->port)) continue;
+
+            std::unique_ptr<client> h(new client(md5_key_, auth_type_));
+            h->peer_cred_ = peer_cred_;
+            h->peer_uid_ = peer_uid_;
+            h->sock_opts_ = sock_opts_;
+            h->request_timeout_ms_ = request_timeout_ms_;
+
+            if (h->authenticate(con->host, con->port)) {
+                hedge_.swap(h);
+                return hedge_.get();
+            }
+        }
+
+        return nullptr;
+    }
+
+    // keeps the last HEDGE_SAMPLES reply times, hedge delay follows
+    void client::time_reply(std::chrono::steady_clock::time_point start) {
+        uint32_t us = (uint32_t) std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now() - start).count();
+
+        if (latency_us_.size() < HEDGE_SAMPLES) latency_us_.push_back(us);
+        else latency_us_[latency_next_] = us;
+        latency_next_ = (latency_next_ + 1) % HEDGE_SAMPLES;
+
+        // the percentile moves slowly, refresh it now and then
+        if (latency_us_.size() < HEDGE_WARMUP || latency_next_ % HEDGE_WARMUP)
+            return;
+
+        std::vector<uint32_t> sorted(latency_us_);
+        size_t at = std::min((size_t) (hedge_percentile_ * sorted.size()),
+                sorted.size() - 1);
+        std::nth_element(sorted.begin(), sorted.begin() + at, sorted.end());
+        hedge_delay_us_ = std::max(sorted[at], 1u);
+    }
+
+    // one line, false if it answers a request won elsewhere
+    bool client::take_reply(std::string &line) {
+        line = this->readline();
+        if (!connected() || owed_ == 0) return true;
+
+        --owed_;
+        return false;
+    }
+
+    /** Wait for the reply on this connection or other.
+     *
+     * 0 if it came here, 1 if on other, -1 on timeout or
+     * if the connections broke. timeout_us -1 == forever.
+     * a broken other is dropped, we keep waiting here.
+     */
+    int client::wait_reply(client *other, int64_t timeout_us, std::string &line) {
+        auto until = std::chrono::steady_clock::now() +
+                std::chrono::microseconds(timeout_us);
+        client *peers[2] = {this, other};
+
+        while (connected()) {
+            // a whole reply may sit in the stdio buffer already
+            for (int i = 0; i < 2; ++i) {
+                if (peers[i] && peers[i]->ip_endpoint_->rx_pending() &&
+                        peers[i]->take_reply(line)) {
+                    if (peers[i]->connected()) return i;
+                    if (i == 0) return -1;
+                    peers[1] = nullptr;
+                    hedge_.reset();
+                }
+            }
+
+            pollfd fds[2];
+            nfds_t n = 0;
+            for (int i = 0; i < 2 && peers[i]; ++i) {
+                fds[n].fd = peers[i]->ip_endpoint_->socket_;
+                fds[n].events = POLLIN;
+                fds[n].revents = 0;
+                ++n;
+            }
+
+            timespec ts, *tsp = nullptr;
+            if (timeout_us >= 0) {
+                int64_t left = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                        until - std::chrono::steady_clock::now()).count();
+                if (left <= 0) return -1;
+                ts.tv_sec = left / 1000000000;
+                ts.tv_nsec = left % 1000000000;
+                tsp = &ts;
+            }
+
+            int rc = ppoll(fds, n, tsp, nullptr);
+            if (rc == 0) return -1;
+            if (rc < 0) {
+                if (errno == EINTR) continue;
+                return -1;
+            }
+
+            for (nfds_t i = 0; i < n; ++i) {
+                if (fds[i].revents == 0) continue;
+                if (!peers[i]->take_reply(line)) continue;
+
+                if (peers[i]->connected()) return (int) i;
+                if (i == 0) return -1;
+                peers[1] = nullptr;
+                hedge_.reset();
+                break;
+            }
+        }
+
+        return -1;
+    }
+
+    size_t client::write_with_budget(const std::string &line, uint32_t budget_ms) {
+        std::string msg;
+        append_budget(msg, (uint64_t) budget_ms * 1000, line);
+        return this->write(msg);
+    }
+
+    bool client::subscribe(const std::string &topic, tx_policy policy) {
+        if (!connected()) return false;
+
+        std::string line;
+        line += CTL;
+        line += (char) control::SUBSCRIBE;
+        line += (char) ('0' + (int) policy);
+        line += topic;
+        line += EOL;
+
+        bool ok = this->write(line) == line.length();
+        this->send();
+        return ok;
+    }
+
+    bool client::unsubscribe(const std::string &topic) {
+        if (!connected()) return false;
+
+        std::string line;
+        line += CTL;
+        line += (char) control::UNSUBSCRIBE;
+        line += topic;
+        line += EOL;
+
+        bool ok = this->write(line) == line.length();
+        this->send();
+        return ok;
+    }
+
+    void client::open_channel(uint16_t id, uint8_t priority) {
+        channel_tx &c = channels_[id];
+        c.priority = priority;
+        c.window = CHANNEL_WINDOW;
+        c.offset = 0;
+    }
+
+    bool client::channel_send(uint16_t id, const std::string &msg) {
+        auto it = channels_.find(id);
+        if (it == channels_.end()) {
+            syslog(LOG_DEBUG, "channel %u not open", id);
+            return false;
+        }
+
+        it->second.queue.push_back(msg);
+        this->channel_pump();
+
+        return connected();
+    }
+
+    /* highest priority channel with data and credit, round
+     * robin among equals starting after the last one served */
+    client::channel_tx *client::next_channel(void) {
+        channel_tx *best = nullptr;
+        uint16_t best_id = 0;
+
+        auto start = channels_.upper_bound(last_channel_);
+        for (size_t n = 0; n < channels_.size(); ++n, ++start) {
+            if (start == channels_.end()) start = channels_.begin();
+
+            channel_tx &c = start->second;
+            if (c.queue.empty() || c.window == 0) continue;
+
+            if (best == nullptr || c.priority > best->priority) {
+                best = &c;
+                best_id = start->first;
+            }
+        }
+
+        if (best != nullptr) last_channel_ = best_id;
+        return best;
+    }
+
+    bool client::channel_pump(void) {
+        if (!connected()) return false;
+
+        std::string out;
+        channel_tx *c;
+        while ((c = next_channel()) != nullptr) {
+            const std::string &msg = c->queue.front();
+
+            size_t n = std::min(std::min(FRAME_MAX, c->window),
+                    msg.size() - c->offset);
+            bool last = c->offset + n == msg.size();
+
+            append_frame(out, frame_kind::DATA, last_channel_,
+                    last ? FRAME_FIN : 0, msg.data() + c->offset, (uint32_t) n);
+
+            c->window -= n;
+            c->offset += n;
+            if (last) {
+                c->queue.pop_front();
+                c->offset = 0;
+            }
+
+            // one frame per write keeps the stdio buffer small
+            if (out.size() >= FRAME_MAX) {
+                this->write(out);
+                out.clear();
+            }
+        }
+
+        if (!out.empty()) this->write(out);
+        this->send();
+
+        for (auto &ch : channels_) {
+            if (!ch.second.queue.empty()) return false;
+        }
+        return true;
+    }
+
+    bool client::channel_read(uint16_t &id, std::string &msg) {
+        while (connected()) {
+            view<frame_schema> h = this->read_msg<frame_schema>();
+            if (!h.valid() || h.get<0>() != (uint8_t) CTL ||
+                    h.get<1>() != (uint8_t) control::FRAME) {
+                syslog(LOG_DEBUG, "channel_read: not a frame");
+                return false;
+            }
+
+            // the view dies with the next read
+            const uint8_t kind = h.get<2>();
+            const uint8_t flags = h.get<3>();
+            const uint16_t channel = h.get<4>();
+            const uint32_t length = h.get<5>();
+
+            if (kind == (uint8_t) frame_kind::WINDOW) {
+                auto it = channels_.find(channel);
+                if (it != channels_.end()) it->second.window += length;
+                this->channel_pump();
+                continue;
+            }
+
+            if (length > FRAME_MAX) return false;
+
+            std::string &partial = channel_rx_[channel];
+            size_t at = partial.size();
+            partial.resize(at + length);
+            if (length > 0 && this->read(&partial[at], 1, length) != length)
+                return false;
+
+            if (flags & FRAME_FIN) {
+                id = channel;
+                msg.swap(partial);
+                channel_rx_.erase(channel);
+                return true;
+            }
+        }
+
+        return false;
+    }
+}
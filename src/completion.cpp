@@ -0,0 +1,117 @@
+/*
+ * socket
+ * Copyright (C) log2 2013 - Present <aaron.hebert@log2.co>
+ *
+ * log2sockets is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * log2sockets is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <chrono>
+#include "completion.h"
+
+namespace tcp {
+
+    reply_order::reply_order(std::shared_ptr<tx_queue> txq,
+            conn_counters *counters) :
+    txq_(txq),
+    counters_(counters),
+    issued_(0),
+    queued_(0),
+    closed_(false) {
+    }
+
+    uint64_t reply_order::issue(void) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return issued_++;
+    }
+
+    /** Complete request seq.
+     *
+     * the reply is held until every earlier request is
+     * complete, then it and any completed ones behind it
+     * are pushed on the tx queue.
+     */
+    bool reply_order::complete(uint64_t seq, shared_buffer reply) {
+        std::lock_guard<std::mutex> lock(mutex_);
+
+        if (closed_ || seq < queued_ || seq >= issued_) return false;
+
+        ready_[seq] = reply;
+
+        auto it = ready_.begin();
+        while (it != ready_.end() && it->first == queued_) {
+            if (it->second && !it->second->empty()) {
+                // the connection is closed, keep counting
+                if (txq_->push(it->second) && counters_)
+                    counters_->tx_bytes += it->second->size();
+            }
+            it = ready_.erase(it);
+            ++queued_;
+        }
+
+        queued_cv_.notify_all();
+
+        return !txq_->closed();
+    }
+
+    size_t reply_order::outstanding(void) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return issued_ - queued_;
+    }
+
+    bool reply_order::wait_below(size_t n, uint32_t timeout_ms) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        return queued_cv_.wait_for(lock, std::chrono::milliseconds(timeout_ms),
+                [this, n] {
+                    return closed_ || issued_ - queued_ < n;
+                });
+    }
+
+    void reply_order::close(void) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        closed_ = true;
+        ready_.clear();
+        queued_cv_.notify_all();
+    }
+
+    completion::request::~request() {
+        if (!done) order->complete(seq, nullptr);
+    }
+
+    bool completion::reply(const std::string &msg) {
+        return completion::reply(std::make_shared<const std::string>(msg));
+    }
+
+    bool completion::reply(shared_buffer buf) {
+        if (!request_ || request_->done.exchange(true)) return false;
+
+        return request_->order->complete(request_->seq, buf);
+    }
+
+    void completion::cancel(void) {
+        completion::reply(shared_buffer());
+    }
+
+    bool completion::pending(void) const {
+        return request_ && !request_->done;
+    }
+
+    int64_t completion::remaining_us(void) const {
+        if (!request_ || request_->deadline_ns == 0) return -1;
+
+        int64_t left = (int64_t) request_->deadline_ns -
+                std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count();
+        return left > 0 ? left / 1000 : 0;
+    }
+}
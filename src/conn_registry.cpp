@@ -0,0 +1,194 @@
+/*
+ * socket
+ * Copyright (C) log2 2013 - Present <aaron.hebert@log2.co>
+ *
+ * log2sockets is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * log2sockets is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <chrono>
+#include <utility>
+#include <sys/socket.h>
+#include "conn_registry.h"
+
+namespace tcp {
+
+    static uint64_t steady_ms(void) {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    conn_registry::conn_registry() : live_(0) {
+    }
+
+    conn_handle conn_registry::handle_of(uint32_t index) {
+        return ((conn_handle) slots_[index].generation << 32) | index;
+    }
+
+    // caller holds mutex_
+    conn_registry::slot *conn_registry::find(conn_handle handle) {
+        uint32_t index = (uint32_t) handle;
+        uint32_t generation = (uint32_t) (handle >> 32);
+
+        if (index >= slots_.size()) return nullptr;
+
+        slot &s = slots_[index];
+        if (!s.live || s.generation != generation) return nullptr;
+
+        return &s;
+    }
+
+    conn_handle conn_registry::add(int socket) {
+        std::lock_guard<std::mutex> lock(mutex_);
+
+        uint32_t index;
+        if (!free_.empty()) {
+            index = free_.back();
+            free_.pop_back();
+        } else {
+            index = (uint32_t) slots_.size();
+            slots_.emplace_back();
+            slots_[index].generation = 0;
+        }
+
+        slot &s = slots_[index];
+        // skip 0 so no handle is ever 0
+        if (++s.generation == 0) s.generation = 1;
+        s.live = true;
+        s.socket = socket;
+        s.connected_ms = steady_ms();
+        s.txq.reset();
+        s.counters.requests = 0;
+        s.counters.rx_bytes = 0;
+        s.counters.tx_bytes = 0;
+
+        ++live_;
+        return handle_of(index);
+    }
+
+    bool conn_registry::remove(conn_handle handle) {
+        std::lock_guard<std::mutex> lock(mutex_);
+
+        slot *s = find(handle);
+        if (s == nullptr) return false;
+
+        s->live = false;
+        s->socket = -1;
+        s->txq.reset();
+        free_.push_back((uint32_t) handle);
+
+        --live_;
+        return true;
+    }
+
+    conn_counters *conn_registry::counters(conn_handle handle) {
+        std::lock_guard<std::mutex> lock(mutex_);
+
+        slot *s = find(handle);
+        return s ? &s->counters : nullptr;
+    }
+
+    bool conn_registry::set_tx_queue(conn_handle handle,
+            std::shared_ptr<tx_queue> txq) {
+        std::lock_guard<std::mutex> lock(mutex_);
+
+        slot *s = find(handle);
+        if (s == nullptr) return false;
+
+        s->txq = txq;
+        return true;
+    }
+
+    std::shared_ptr<tx_queue> conn_registry::tx_queue_of(conn_handle handle) {
+        std::lock_guard<std::mutex> lock(mutex_);
+
+        slot *s = find(handle);
+        return s ? s->txq : nullptr;
+    }
+
+    int conn_registry::socket_of(conn_handle handle) {
+        std::lock_guard<std::mutex> lock(mutex_);
+
+        slot *s = find(handle);
+        return s ? s->socket : -1;
+    }
+
+    bool conn_registry::shutdown(conn_handle handle) {
+        std::lock_guard<std::mutex> lock(mutex_);
+
+        slot *s = find(handle);
+        if (s == nullptr) return false;
+
+        return ::shutdown(s->socket, SHUT_RDWR) == 0;
+    }
+
+    void conn_registry::shutdown_all(void) {
+        std::lock_guard<std::mutex> lock(mutex_);
+
+        for (const slot &s : slots_)
+            if (s.live) ::shutdown(s.socket, SHUT_RDWR);
+    }
+
+    void conn_registry::fill(const slot &s, conn_stats &stats) {
+        stats.socket = s.socket;
+        stats.connected_ms = s.connected_ms;
+        stats.requests = s.counters.requests;
+        stats.rx_bytes = s.counters.rx_bytes;
+        stats.tx_bytes = s.counters.tx_bytes;
+        stats.tx_pending = s.txq ? s.txq->pending() : 0;
+    }
+
+    bool conn_registry::stats(conn_handle handle, conn_stats &stats) {
+        std::lock_guard<std::mutex> lock(mutex_);
+
+        slot *s = find(handle);
+        if (s == nullptr) return false;
+
+        fill(*s, stats);
+        return true;
+    }
+
+    void conn_registry::for_each(
+            std::function<void(conn_handle, const conn_stats &) > fn) {
+        std::vector<std::pair<conn_handle, conn_stats>> live;
+
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+
+            live.reserve(live_);
+            for (uint32_t i = 0; i < slots_.size(); ++i) {
+                if (!slots_[i].live) continue;
+                live.emplace_back(handle_of(i), conn_stats());
+                fill(slots_[i], live.back().second);
+            }
+        }
+
+        // unlocked, fn may call back into the registry
+        for (const auto &conn : live)
+            fn(conn.first, conn.second);
+    }
+
+    void conn_registry::tx_queues(std::vector<std::shared_ptr<tx_queue>> &queues) {
+        std::lock_guard<std::mutex> lock(mutex_);
+
+        queues.reserve(queues.size() + live_);
+        for (auto &s : slots_) {
+            if (s.live && s.txq) queues.push_back(s.txq);
+        }
+    }
+
+    size_t conn_registry::size(void) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return live_;
+    }
+}
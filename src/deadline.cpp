@@ -0,0 +1,53 @@
+/*
+ * socket
+ * Copyright (C) log2 2013 - Present <aaron.hebert@log2.co>
+ *
+ * log2sockets is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * log2sockets is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "tcp.h"
+#include "reliable.h"
+#include "deadline.h"
+
+namespace tcp {
+
+    void append_budget(std::string &out, uint64_t budget_us,
+            const std::string &line) {
+        out += CTL;
+        out += (char) control::BUDGET;
+        append_hex64(out, budget_us);
+        out += line;
+        if (line.empty() || line.back() != EOL) out += EOL;
+    }
+
+    bool take_budget(std::string &line, uint64_t &budget_us) {
+        if (line.size() < 2 || line[0] != CTL ||
+                line[1] != (char) control::BUDGET ||
+                !parse_hex64(line, 2, budget_us)) return false;
+
+        line.erase(0, 2 + SEQ_DIGITS);
+        return true;
+    }
+
+    void append_expired(std::string &out) {
+        out += CTL;
+        out += (char) control::BUDGET;
+        out += EOL;
+    }
+
+    bool expired(const std::string &line) {
+        return line.size() == 3 && line[0] == CTL &&
+                line[1] == (char) control::BUDGET && line[2] == EOL;
+    }
+}
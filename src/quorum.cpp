@@ -0,0 +1,278 @@
+/*
+ * socket
+ * Copyright (C) log2 2013 - Present <aaron.hebert@log2.co>
+ *
+ * log2sockets is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * log2sockets is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <syslog.h>
+#include <sys/socket.h>
+#include "quorum.h"
+
+namespace tcp {
+
+    static uint64_t steady_ms(void) {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    quorum_writer::quorum_writer(std::string key, auth auth_) :
+    key_(key),
+    auth_(auth_),
+    max_lag_(0),
+    stop_(false) {
+    }
+
+    /** Stop the replica threads.
+     *
+     * a thread waiting on a reply is woken by shutting its
+     * socket down, under conn_mutex so the descriptor can not
+     * be closed and reused meanwhile.
+     */
+    quorum_writer::~quorum_writer() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
+        }
+        work_cv_.notify_all();
+
+        for (auto &r : replicas_) {
+            std::lock_guard<std::mutex> lock(r->conn_mutex);
+            if (r->conn && r->conn->ip_endpoint_ &&
+                    r->conn->ip_endpoint_->tx != nullptr)
+                ::shutdown(r->conn->ip_endpoint_->socket_, SHUT_RDWR);
+        }
+
+        for (auto &r : replicas_) {
+            if (r->worker.joinable()) r->worker.join();
+        }
+    }
+
+    void quorum_writer::add_replica(const std::string &host,
+            const std::string &port) {
+        std::unique_ptr<replica> r(new replica());
+        r->host = host;
+        r->port = port;
+        r->sent = 0;
+        r->bytes = 0;
+        r->acked = 0;
+        r->stale = false;
+        r->missed = 0;
+        r->up = false;
+
+        replicas_.push_back(std::move(r));
+    }
+
+    bool quorum_writer::start(void) {
+        bool all = true;
+
+        for (auto &r : replicas_) {
+            r->conn.reset(new client(key_, auth_));
+            {
+                std::lock_guard<std::mutex> lock(r->conn_mutex);
+                r->up = r->conn->authenticate(r->host, r->port);
+                if (!r->up) {
+                    syslog(LOG_DEBUG, "replica %s:%s not reachable",
+                            r->host.c_str(), r->port.c_str());
+                    all = false;
+                }
+            }
+
+            r->worker = std::thread(&quorum_writer::run, this, r.get());
+        }
+
+        return all;
+    }
+
+    bool quorum_writer::write(const std::string &line, size_t k,
+            uint32_t timeout_ms) {
+        return quorum_writer::write(std::make_shared<const std::string>(line),
+                k, timeout_ms);
+    }
+
+    /** Queue buf on every replica and wait for k replies.
+     *
+     * a replica pushed past max_lag keeps what is already on
+     * the wire and is skipped until readmit(). the writes it
+     * drops can no longer count it, their writers give up
+     * once k replies are out of reach.
+     */
+    bool quorum_writer::write(shared_buffer buf, size_t k, uint32_t timeout_ms) {
+        if (!buf || k > replicas_.size()) return false;
+
+        std::shared_ptr<write_op> op = std::make_shared<write_op>();
+        op->buf = buf;
+        op->queued_ms = steady_ms();
+        op->acks = 0;
+        op->owed = 0;
+
+        std::unique_lock<std::mutex> lock(mutex_);
+
+        for (auto &r : replicas_) {
+            if (r->stale) {
+                ++r->missed;
+                continue;
+            }
+
+            r->queue.push_back(op);
+            r->bytes += buf->size();
+            ++op->owed;
+
+            if (max_lag_ > 0 && r->bytes > max_lag_) {
+                syslog(LOG_DEBUG, "replica %s:%s is %zu bytes behind, dropped",
+                        r->host.c_str(), r->port.c_str(), r->bytes);
+
+                while (r->queue.size() > r->sent) {
+                    r->bytes -= r->queue.back()->buf->size();
+                    --r->queue.back()->owed;
+                    r->queue.pop_back();
+                    ++r->missed;
+                }
+                r->stale = true;
+                ack_cv_.notify_all();
+            }
+        }
+
+        work_cv_.notify_all();
+
+        auto done = [&op, k] {
+            return op->acks >= k || op->acks + op->owed < k;
+        };
+
+        if (timeout_ms == 0) ack_cv_.wait(lock, done);
+        else ack_cv_.wait_for(lock, std::chrono::milliseconds(timeout_ms), done);
+
+        return op->acks >= k;
+    }
+
+    bool quorum_writer::readmit(const std::string &host, const std::string &port) {
+        std::lock_guard<std::mutex> lock(mutex_);
+
+        for (auto &r : replicas_) {
+            if (!r->stale || r->host != host || r->port != port) continue;
+
+            syslog(LOG_DEBUG, "replica %s:%s readmitted, %llu writes missed",
+                    host.c_str(), port.c_str(), (unsigned long long) r->missed);
+            r->stale = false;
+            r->missed = 0;
+            return true;
+        }
+
+        return false;
+    }
+
+    /** Replica thread.
+     *
+     * puts up to QUORUM_BATCH queued writes on the wire in one
+     * send, then takes the replies in order. a write leaves
+     * the queue with its reply, so after a broken connection
+     * the queue is sent again from the front.
+     */
+    void quorum_writer::run(replica *r) {
+        std::vector<shared_buffer> batch;
+
+        while (!stop_) {
+            if (!r->conn->connected() && !quorum_writer::reconnect(r)) break;
+
+            batch.clear();
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                work_cv_.wait(lock, [this, r] {
+                    return stop_ || r->queue.size() > r->sent;
+                });
+                if (stop_) break;
+
+                for (size_t i = r->sent; i < r->queue.size() &&
+                        batch.size() < QUORUM_BATCH; ++i)
+                    batch.push_back(r->queue[i]->buf);
+                r->sent += batch.size();
+            }
+
+            for (auto &buf : batch)
+                r->conn->write((const uint8_t *) buf->data(), buf->size());
+            r->conn->send();
+
+            for (size_t i = 0; i < batch.size(); ++i) {
+                r->conn->readline();
+                if (!r->conn->connected()) break;
+
+                std::lock_guard<std::mutex> lock(mutex_);
+                std::shared_ptr<write_op> op = r->queue.front();
+                r->queue.pop_front();
+                --r->sent;
+                r->bytes -= op->buf->size();
+                ++r->acked;
+                ++op->acks;
+                --op->owed;
+                ack_cv_.notify_all();
+            }
+
+            if (!r->conn->connected()) {
+                std::lock_guard<std::mutex> lock(mutex_);
+                r->sent = 0;
+                r->up = false;
+            }
+        }
+    }
+
+    /** Reconnect a replica, backing off up to a second.
+     *
+     * false once the writer stops.
+     */
+    bool quorum_writer::reconnect(replica *r) {
+        uint32_t backoff = 10;
+
+        while (!stop_) {
+            {
+                std::lock_guard<std::mutex> lock(r->conn_mutex);
+                if (stop_) return false;
+
+                if (r->conn->ip_endpoint_ && r->conn->ip_endpoint_->tx != nullptr)
+                    r->conn->disconnect();
+                if (r->conn->authenticate(r->host, r->port))
+                    return r->up = true;
+            }
+
+            for (uint32_t slept = 0; slept < backoff && !stop_; slept += 10)
+                std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            backoff = std::min(backoff * 2, (uint32_t) 1000);
+        }
+
+        return false;
+    }
+
+    std::vector<replica_stats> quorum_writer::stats(void) {
+        std::vector<replica_stats> out;
+        uint64_t now = steady_ms();
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (auto &r : replicas_) {
+            replica_stats s;
+            s.host = r->host;
+            s.port = r->port;
+            s.connected = r->up;
+            s.pending = r->queue.size();
+            s.pending_bytes = r->bytes;
+            s.lag_ms = r->queue.empty() ? 0 : now - r->queue.front()->queued_ms;
+            s.acked = r->acked;
+            s.stale = r->stale;
+            s.missed = r->missed;
+            out.push_back(s);
+        }
+
+        return out;
+    }
+}
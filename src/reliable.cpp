@@ -0,0 +1,70 @@
+/*
+ * socket
+ * Copyright (C) log2 2013 - Present <aaron.hebert@log2.co>
+ *
+ * log2sockets is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * log2sockets is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "tcp.h"
+#include "reliable.h"
+
+namespace tcp {
+
+    static const char HEX[] = "0123456789abcdef";
+
+    void append_hex64(std::string &out, uint64_t value) {
+        for (int shift = 60; shift >= 0; shift -= 4)
+            out += HEX[(value >> shift) & 0xf];
+    }
+
+    bool parse_hex64(const std::string &str, size_t pos, uint64_t &value) {
+        if (str.size() < pos + SEQ_DIGITS) return false;
+
+        value = 0;
+        for (size_t i = pos; i < pos + SEQ_DIGITS; ++i) {
+            char c = str[i];
+            int digit;
+            if (c >= '0' && c <= '9') digit = c - '0';
+            else if (c >= 'a' && c <= 'f') digit = c - 'a' + 10;
+            else return false;
+
+            value = (value << 4) | digit;
+        }
+
+        return true;
+    }
+
+    std::string reliable_line(char type, uint64_t value) {
+        std::string line;
+        line += CTL;
+        line += type;
+        append_hex64(line, value);
+        line += EOL;
+        return line;
+    }
+
+    void append_sequenced(std::string &out, uint64_t seq,
+            const std::string &line) {
+        out += CTL;
+        out += (char) control::SEQUENCED;
+        append_hex64(out, seq);
+        out += line;
+        if (line.empty() || line.back() != EOL) out += EOL;
+    }
+
+    bool parse_ack(const std::string &line, uint64_t &seq) {
+        return line.size() >= 2 && line[0] == CTL &&
+                line[1] == (char) control::ACK && parse_hex64(line, 2, seq);
+    }
+}
@@ -0,0 +1,316 @@
+/*
+ * socket
+ * Copyright (C) log2 2013 - Present <aaron.hebert@log2.co>
+ *
+ * log2sockets is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * log2sockets is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <cerrno>
+#include <poll.h>
+#include <sys/socket.h>
+#include <syslog.h>
+#include "replicator.h"
+
+namespace tcp {
+
+    static uint64_t steady_ms(void) {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    replicator::replicator(std::string key, auth auth_, size_t max_lag) :
+    key_(key),
+    auth_(auth_),
+    max_lag_(max_lag),
+    stop_(false) {
+    }
+
+    /** Stop the link threads.
+     *
+     * a thread stuck writing to a standby that stopped reading
+     * is woken by shutting its socket down, under conn_mutex
+     * so the descriptor can not be closed and reused meanwhile.
+     */
+    replicator::~replicator() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
+        }
+        work_cv_.notify_all();
+
+        for (auto &l : links_) {
+            std::lock_guard<std::mutex> lock(l->conn_mutex);
+            if (l->conn->ip_endpoint_ && l->conn->ip_endpoint_->tx != nullptr)
+                ::shutdown(l->conn->ip_endpoint_->socket_, SHUT_RDWR);
+        }
+
+        for (auto &l : links_) {
+            if (l->worker.joinable()) l->worker.join();
+        }
+    }
+
+    /** Add a standby and start its link.
+     *
+     * the session is fixed for the life of the link, a
+     * reconnecting link resumes it and the standby skips
+     * what it has applied.
+     */
+    void replicator::add_standby(const std::string &host,
+            const std::string &port) {
+        static thread_local std::mt19937_64 ids(std::random_device{}());
+
+        std::unique_ptr<link> l(new link());
+        l->host = host;
+        l->port = port;
+        l->conn.reset(new client(key_, auth_));
+        // a hung standby must not hold the link forever
+        l->conn->set_request_timeout(5000);
+        do l->session = ids(); while (l->session == 0);
+        l->pending_bytes = 0;
+        l->ring_bytes = 0;
+        l->next_seq = 0;
+        l->acked = 0;
+        l->stale = false;
+        l->missed = 0;
+        l->up = false;
+
+        link *p = l.get();
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            links_.push_back(std::move(l));
+        }
+        p->worker = std::thread(&replicator::run, this, p);
+    }
+
+    /** Queue line on every standby link.
+     *
+     * a standby more than max_lag behind can no longer be
+     * caught up from memory, it is dropped until readmit().
+     */
+    void replicator::append(const std::string &line) {
+        const uint64_t now = steady_ms();
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (auto &l : links_) {
+            if (l->stale) {
+                ++l->missed;
+                continue;
+            }
+
+            if (l->pending_bytes + l->ring_bytes + line.size() > max_lag_) {
+                syslog(LOG_DEBUG, "standby %s:%s fell behind, dropped",
+                        l->host.c_str(), l->port.c_str());
+                l->missed += l->pending.size() + 1;
+                l->pending.clear();
+                l->pending_bytes = 0;
+                l->stale = true;
+                continue;
+            }
+
+            l->pending.push_back(std::make_pair(now, line));
+            l->pending_bytes += line.size();
+        }
+
+        work_cv_.notify_all();
+    }
+
+    bool replicator::readmit(const std::string &host, const std::string &port) {
+        std::lock_guard<std::mutex> lock(mutex_);
+
+        for (auto &l : links_) {
+            if (!l->stale || l->host != host || l->port != port) continue;
+
+            syslog(LOG_DEBUG, "standby %s:%s readmitted, %llu lines missed",
+                    host.c_str(), port.c_str(), (unsigned long long) l->missed);
+            l->stale = false;
+            l->missed = 0;
+            return true;
+        }
+
+        return false;
+    }
+
+    /** Link thread.
+     *
+     * sends what was appended since the last round in one
+     * write, then takes the acks that have arrived. wakes
+     * every ACK_POLL_MS to look for acks while idle.
+     */
+    void replicator::run(link *l) {
+        std::deque<std::pair<uint64_t, std::string>> batch;
+        std::string out;
+
+        while (!stop_) {
+            if (!l->up && !replicator::connect(l)) break;
+
+            batch.clear();
+            out.clear();
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                work_cv_.wait_for(lock, std::chrono::milliseconds(ACK_POLL_MS),
+                        [this, l] {
+                            return stop_ || !l->pending.empty();
+                        });
+                if (stop_) break;
+
+                batch.swap(l->pending);
+                l->pending_bytes = 0;
+
+                for (auto &p : batch) {
+                    link::sent_line s;
+                    s.seq = ++l->next_seq;
+                    s.at_ms = p.first;
+                    append_sequenced(s.framed, s.seq, p.second);
+                    out += s.framed;
+                    l->ring_bytes += s.framed.size();
+                    l->ring.push_back(std::move(s));
+                }
+            }
+
+            if (!out.empty()) {
+                l->conn->write(out);
+                l->conn->send();
+            }
+
+            if (!l->conn->connected() || !replicator::read_acks(l, 0)) {
+                syslog(LOG_DEBUG, "standby %s:%s link lost",
+                        l->host.c_str(), l->port.c_str());
+                l->up = false;
+            }
+        }
+    }
+
+    /** Open the link, backing off up to a second.
+     *
+     * marks it a replica link, resumes the session and sends
+     * everything the standby has not acked. false once the
+     * replicator stops.
+     */
+    bool replicator::connect(link *l) {
+        uint32_t backoff = 10;
+
+        while (!stop_) {
+            bool authed;
+            {
+                std::lock_guard<std::mutex> lock(l->conn_mutex);
+                if (stop_) return false;
+
+                if (l->conn->ip_endpoint_ && l->conn->ip_endpoint_->tx != nullptr)
+                    l->conn->disconnect();
+                authed = l->conn->authenticate(l->host, l->port);
+            }
+
+            if (authed) {
+                std::string hello;
+                hello += CTL;
+                hello += (char) control::REPLICA;
+                hello += EOL;
+                hello += reliable_line((char) control::RELIABLE, l->session);
+                l->conn->write(hello);
+                l->conn->send();
+
+                /* a standby answers the session with an ack, a
+                 * silent one is tried again after the backoff */
+                bool answered = false;
+                if (replicator::read_acks(l, 5000, &answered) && answered &&
+                        l->conn->connected()) {
+                    std::string out;
+                    {
+                        std::lock_guard<std::mutex> lock(mutex_);
+                        for (auto &s : l->ring) out += s.framed;
+                    }
+                    l->conn->write(out);
+                    l->conn->send();
+
+                    l->up = l->conn->connected();
+                    if (l->up) return true;
+                }
+            }
+
+            for (uint32_t slept = 0; slept < backoff && !stop_; slept += 10)
+                std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            backoff = std::min(backoff * 2, (uint32_t) 1000);
+        }
+
+        return false;
+    }
+
+    /** Take the acks that arrived.
+     *
+     * waits up to timeout_ms for the first. false if the
+     * link broke, got_ack tells whether any ack came.
+     */
+    bool replicator::read_acks(link *l, int timeout_ms, bool *got_ack) {
+        if (got_ack) *got_ack = false;
+
+        for (;;) {
+            if (!l->conn->ip_endpoint_->rx_pending()) {
+                pollfd p;
+                p.fd = l->conn->ip_endpoint_->socket_;
+                p.events = POLLIN;
+                p.revents = 0;
+
+                int rc = poll(&p, 1, timeout_ms);
+                if (rc == 0) return true;
+                if (rc < 0) return errno == EINTR;
+            }
+
+            std::string line = l->conn->readline();
+            if (!l->conn->connected()) return false;
+
+            uint64_t acked;
+            if (parse_ack(line, acked)) {
+                if (got_ack) *got_ack = true;
+                std::lock_guard<std::mutex> lock(mutex_);
+                while (!l->ring.empty() && l->ring.front().seq <= acked) {
+                    l->ring_bytes -= l->ring.front().framed.size();
+                    l->ring.pop_front();
+                }
+                l->acked = std::max(l->acked, acked);
+            }
+
+            // only the first read may wait
+            timeout_ms = 0;
+        }
+    }
+
+    std::vector<standby_stats> replicator::stats(void) {
+        std::vector<standby_stats> out;
+        const uint64_t now = steady_ms();
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (auto &l : links_) {
+            standby_stats s;
+            s.host = l->host;
+            s.port = l->port;
+            s.connected = l->up;
+            s.lag_bytes = l->ring_bytes + l->pending_bytes;
+
+            uint64_t oldest = now;
+            if (!l->ring.empty()) oldest = l->ring.front().at_ms;
+            else if (!l->pending.empty()) oldest = l->pending.front().first;
+            s.lag_ms = now - oldest;
+
+            s.acked = l->acked;
+            s.stale = l->stale;
+            s.missed = l->missed;
+            out.push_back(s);
+        }
+
+        return out;
+    }
+}
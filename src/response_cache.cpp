@@ -0,0 +1,144 @@
+/*
+ * socket
+ * Copyright (C) log2 2013 - Present <aaron.hebert@log2.co>
+ *
+ * log2sockets is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * log2sockets is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <chrono>
+#include <functional>
+#include <iterator>
+#include "response_cache.h"
+
+namespace tcp {
+
+    response_cache::response_cache(size_t max_bytes, uint32_t ttl_ms,
+            size_t shards) :
+    ttl_ms_(ttl_ms) {
+
+        if (shards == 0) shards = 1;
+        shard_bytes_ = max_bytes / shards;
+
+        for (size_t i = 0; i < shards; ++i) {
+            shards_.push_back(std::unique_ptr<shard>(new shard()));
+            shards_.back()->bytes = 0;
+            shards_.back()->counts = cache_stats();
+        }
+    }
+
+    uint64_t response_cache::now_ms(void) {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    // both copies of the key, the reply and list/map nodes
+    size_t response_cache::cost(const entry &e) {
+        return 2 * e.request.size() + e.reply->size() + 128;
+    }
+
+    response_cache::shard &response_cache::shard_for(const std::string &request) {
+        return *shards_[std::hash<std::string>()(request) % shards_.size()];
+    }
+
+    void response_cache::erase(shard &s, lru_list::iterator it) {
+        s.bytes -= cost(*it);
+        s.index.erase(it->request);
+        s.lru.erase(it);
+    }
+
+    /** Find the reply to request.
+     *
+     * on a hit the entry moves to the front of its
+     * shard's LRU list.
+     */
+    bool response_cache::lookup(const std::string &request,
+            shared_buffer &reply) {
+
+        shard &s = shard_for(request);
+        std::lock_guard<std::mutex> lock(s.mutex);
+
+        auto it = s.index.find(request);
+        if (it == s.index.end()) {
+            ++s.counts.misses;
+            return false;
+        }
+
+        if (ttl_ms_ > 0 && it->second->expires <= now_ms()) {
+            erase(s, it->second);
+            ++s.counts.expired;
+            ++s.counts.misses;
+            return false;
+        }
+
+        s.lru.splice(s.lru.begin(), s.lru, it->second);
+        reply = it->second->reply;
+        ++s.counts.hits;
+
+        return true;
+    }
+
+    void response_cache::insert(const std::string &request,
+            const std::string &reply) {
+
+        entry e;
+        e.request = request;
+        e.reply = std::make_shared<const std::string>(reply);
+        e.expires = ttl_ms_ > 0 ? now_ms() + ttl_ms_ : 0;
+
+        const size_t size = cost(e);
+        if (size > shard_bytes_) return;
+
+        shard &s = shard_for(request);
+        std::lock_guard<std::mutex> lock(s.mutex);
+
+        auto it = s.index.find(request);
+        if (it != s.index.end()) erase(s, it->second);
+
+        while (!s.lru.empty() && s.bytes + size > shard_bytes_) {
+            erase(s, std::prev(s.lru.end()));
+            ++s.counts.evictions;
+        }
+
+        s.lru.push_front(std::move(e));
+        s.index[request] = s.lru.begin();
+        s.bytes += size;
+        ++s.counts.inserts;
+    }
+
+    void response_cache::clear(void) {
+        for (auto &s : shards_) {
+            std::lock_guard<std::mutex> lock(s->mutex);
+            s->index.clear();
+            s->lru.clear();
+            s->bytes = 0;
+        }
+    }
+
+    cache_stats response_cache::stats(void) {
+        cache_stats total = cache_stats();
+
+        for (auto &s : shards_) {
+            std::lock_guard<std::mutex> lock(s->mutex);
+            total.hits += s->counts.hits;
+            total.misses += s->counts.misses;
+            total.inserts += s->counts.inserts;
+            total.evictions += s->counts.evictions;
+            total.expired += s->counts.expired;
+            total.entries += s->lru.size();
+            total.bytes += s->bytes;
+        }
+
+        return total;
+    }
+}
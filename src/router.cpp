@@ -0,0 +1,273 @@
+/*
+ * socket
+ * Copyright (C) log2 2013 - Present <aaron.hebert@log2.co>
+ *
+ * log2sockets is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * log2sockets is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <syslog.h>
+#include "router.h"
+
+namespace tcp {
+
+    static uint64_t steady_ms(void) {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    hash_router::hash_router(std::string key, auth auth_, size_t vnodes,
+            double load_factor) :
+    key_(key),
+    auth_(auth_),
+    vnodes_(std::max(vnodes, (size_t) 1)),
+    load_factor_(std::max(load_factor, 1.0)),
+    pool_idle_(4),
+    pool_max_(4),
+    request_timeout_ms_(5000),
+    in_flight_(0) {
+    }
+
+    // FNV-1a, then a murmur3 finalizer to spread nearby keys
+    uint64_t hash_router::hash(const std::string &str) {
+        uint64_t h = 14695981039346656037ULL;
+        for (unsigned char c : str) {
+            h ^= c;
+            h *= 1099511628211ULL;
+        }
+
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 33;
+        h *= 0xc4ceb9fe1a85ec53ULL;
+        h ^= h >> 33;
+        return h;
+    }
+
+    void hash_router::add_endpoint(const std::string &host,
+            const std::string &port) {
+        std::lock_guard<std::mutex> lock(mutex_);
+
+        std::unique_ptr<endpoint> ep(new endpoint());
+        ep->host = host;
+        ep->port = port;
+        ep->open = 0;
+        ep->in_flight = 0;
+        ep->down_until_ms = 0;
+        ep->backoff_ms = 0;
+
+        const size_t index = endpoints_.size();
+        endpoints_.push_back(std::move(ep));
+
+        for (size_t v = 0; v < vnodes_; ++v)
+            ring_.push_back(std::make_pair(
+                hash(host + ":" + port + "#" + std::to_string(v)), index));
+
+        std::sort(ring_.begin(), ring_.end());
+    }
+
+    /** First endpoint clockwise from h that is up and untried.
+     *
+     * bounded, an endpoint at its share of the requests in
+     * flight is passed over as well. -1 if none is left.
+     * called under mutex_.
+     */
+    int hash_router::pick(uint64_t h, const std::vector<bool> &tried,
+            bool bounded) {
+        if (ring_.empty()) return -1;
+
+        const uint64_t now = steady_ms();
+        size_t up = 0;
+        for (auto &ep : endpoints_) {
+            if (ep->down_until_ms <= now) ++up;
+        }
+        if (up == 0) return -1;
+
+        // the request being placed counts as in flight
+        const size_t cap = (size_t) std::ceil(load_factor_ *
+                (double) (in_flight_ + 1) / (double) up);
+
+        auto start = std::lower_bound(ring_.begin(), ring_.end(),
+                std::make_pair(h, (size_t) 0));
+
+        int fallback = -1;
+        for (size_t n = 0; n < ring_.size(); ++n, ++start) {
+            if (start == ring_.end()) start = ring_.begin();
+
+            const size_t i = start->second;
+            const endpoint &ep = *endpoints_[i];
+            if (tried[i] || ep.down_until_ms > now) continue;
+
+            if (!bounded || ep.in_flight < cap) return (int) i;
+            if (fallback == -1) fallback = (int) i;
+        }
+
+        return fallback;
+    }
+
+    std::string hash_router::route(const std::string &key) {
+        std::lock_guard<std::mutex> lock(mutex_);
+
+        std::vector<bool> tried(endpoints_.size(), false);
+        int i = pick(hash(key), tried, false);
+        if (i < 0) return std::string();
+
+        return endpoints_[i]->host + ":" + endpoints_[i]->port;
+    }
+
+    size_t hash_router::endpoints_up(void) {
+        std::lock_guard<std::mutex> lock(mutex_);
+
+        const uint64_t now = steady_ms();
+        size_t up = 0;
+        for (auto &ep : endpoints_) {
+            if (ep->down_until_ms <= now) ++up;
+        }
+        return up;
+    }
+
+    std::string hash_router::request(const std::string &key,
+            const std::string &line) {
+        std::string msg(line);
+        if (msg.empty() || msg.back() != EOL) msg += EOL;
+
+        const uint64_t h = hash(key);
+        std::unique_lock<std::mutex> lock(mutex_);
+        std::vector<bool> tried(endpoints_.size(), false);
+
+        int i;
+        bool retry = false;
+        while (retry || (i = pick(h, tried, true)) >= 0) {
+            tried[i] = true;
+            endpoint &ep = *endpoints_[i];
+            ++ep.in_flight;
+            ++in_flight_;
+            lock.unlock();
+
+            std::string reply;
+            bool pooled = false;
+            std::unique_ptr<client> conn = checkout(ep, pooled);
+            bool ok = false, timed_out = false;
+            if (conn) {
+                uint64_t sent_ms = steady_ms();
+                conn->write(msg);
+                conn->send();
+                reply = conn->readline();
+                ok = conn->connected();
+                // the request timeout shut it down, not a stale socket
+                timed_out = !ok && request_timeout_ms_ > 0 &&
+                        steady_ms() - sent_ms >= request_timeout_ms_;
+            }
+
+            lock.lock();
+            --ep.in_flight;
+            --in_flight_;
+
+            // endpoints may have been added meanwhile
+            tried.resize(endpoints_.size(), false);
+
+            if (ok) {
+                ep.backoff_ms = 0;
+                checkin(ep, std::move(conn));
+                return reply;
+            }
+
+            if (conn) {
+                conn->disconnect();
+                --ep.open;
+                pool_cv_.notify_all();
+            }
+
+            /* an idle connection may have gone stale, say the
+             * server restarted. a fresh one decides, unless
+             * the endpoint let the request time out. */
+            retry = pooled && !timed_out;
+            if (retry) continue;
+
+            // its keys go to the next endpoint meanwhile
+            mark_down(ep);
+        }
+
+        return std::string(1, EOL);
+    }
+
+    /** An authenticated connection to ep.
+     *
+     * an idle one if there is, a new one while fewer than
+     * pool_max are open, else waits for one to come back.
+     * nullptr if ep does not answer.
+     */
+    std::unique_ptr<client> hash_router::checkout(endpoint &ep, bool &pooled) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        pool_cv_.wait(lock, [this, &ep] {
+            return !ep.idle.empty() || ep.open < pool_max_;
+        });
+
+        std::unique_ptr<client> conn;
+        if (!ep.idle.empty()) {
+            conn = std::move(ep.idle.back());
+            ep.idle.pop_back();
+            pooled = true;
+            return conn;
+        }
+
+        ++ep.open;
+        lock.unlock();
+
+        conn.reset(new client(key_, auth_));
+        // a hung endpoint must not hold the request forever
+        conn->set_request_timeout(request_timeout_ms_);
+        if (conn->authenticate(ep.host, ep.port)) return conn;
+
+        syslog(LOG_DEBUG, "router: %s:%s not reachable",
+                ep.host.c_str(), ep.port.c_str());
+
+        lock.lock();
+        --ep.open;
+        pool_cv_.notify_all();
+        return nullptr;
+    }
+
+    // called under mutex_
+    void hash_router::checkin(endpoint &ep, std::unique_ptr<client> conn) {
+        if (ep.idle.size() < pool_idle_) {
+            ep.idle.push_back(std::move(conn));
+        } else {
+            conn->disconnect();
+            --ep.open;
+        }
+        pool_cv_.notify_all();
+    }
+
+    /** Skip ep for a while, doubling up to DOWN_MAX_MS.
+     *
+     * its idle connections are stale, they are dropped.
+     * called under mutex_.
+     */
+    void hash_router::mark_down(endpoint &ep) {
+        ep.backoff_ms = ep.backoff_ms == 0 ? DOWN_MIN_MS :
+                std::min(ep.backoff_ms * 2, DOWN_MAX_MS);
+        ep.down_until_ms = steady_ms() + ep.backoff_ms;
+
+        ep.open -= ep.idle.size();
+        for (auto &conn : ep.idle) conn->disconnect();
+        ep.idle.clear();
+        pool_cv_.notify_all();
+
+        syslog(LOG_DEBUG, "router: %s:%s down for %u ms",
+                ep.host.c_str(), ep.port.c_str(), ep.backoff_ms);
+    }
+}
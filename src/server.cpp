@@ -17,39 +17,113 @@
  */
 
 #include <vector>
+#include <algorithm>
 #include <syslog.h>
 #include <unistd.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <sys/eventfd.h>
 #include <sys/socket.h>
+#include <sys/ioctl.h>
 #include <sys/un.h>
 #include <netinet/tcp.h>
 #include <system_error>
 #include "server.h"
+#include "unix.h"
 
 namespace tcp {
-    bool server::kill_ = false;
-    read_handler server::my_reader = nullptr;
-    int server::max_conn_buffered = 5;
-    connection_threads server::connections;
-    unsigned char server::md5_auth_hash_[MD5_HASH_SIZE];
-    auth server::srv_auth_type_ = auth::OFF;
 
-    server::server(std::string key, auth auth_) :
-    socket(key, auth_) {
+    // set while a read handler runs
+    static thread_local conn_handle current_connection_ = 0;
 
-        if (auth_ == tcp::auth::MD5) {
-            memcpy(&server::md5_auth_hash_,
-                    this->md5_hash_.get(),
-                    MD5_HASH_SIZE);
-        }
+    // budget of the request being handled, steady clock, 0 == none
+    static thread_local uint64_t request_deadline_ns_ = 0;
+
+    static uint64_t steady_ns(void) {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    server::server(std::string key, auth auth_) :
+    socket(key, auth_),
+    kill_(false),
+    my_connection(nullptr),
+    my_reader(nullptr),
+    my_streamer(nullptr),
+    my_async(nullptr),
+    my_standby(nullptr),
+    reader_cacheable_(false),
+    session_clock_(0),
+    max_conn_buffered(SOMAXCONN),
+    defer_accept_s_(0),
+    follow_irq_(true),
+    conn_tx_low_(0),
+    conn_tx_high_(0),
+    conn_tx_policy_(tx_policy::DISCONNECT),
+    idle_timeout_ms_(0),
+    handshake_timeout_ms_(0),
+    threads_(0),
+    active_conns_(0),
+    expired_(0),
+    handing_off_(false),
+    handoff_conns_(false),
+    handoff_channel_(-1) {
 
-        server::srv_auth_type_ = this->auth_type_;
-        server::my_connection = &server::connection_loop;
         server_ = nullptr;
+        wake_fd_ = eventfd(0, EFD_CLOEXEC);
     }
 
+    /** Stop the server and wait for its threads.
+     *
+     * idle connections wake on kill(), the rest are
+     * shut down so blocked reads return.
+     */
     server::~server() {
+        this->kill();
+
+        // under the registry lock, see conn_registry::shutdown()
+        registry_.shutdown_all();
+
+        while (threads_ > 0)
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+        close(wake_fd_);
+
+        // a handed off listener still owns the path
+        if (!unix_path_.empty() && unix_path_[0] != '@' && !handing_off_)
+            unlink(unix_path_.c_str());
+    }
+
+    void server::kill(void) {
         server::kill_ = true;
-        server::connections.clear();
+        server::wake();
+    }
+
+    /* the eventfd is never read back, once signalled it
+     * stays readable and wakes every poller */
+    void server::wake(void) {
+        uint64_t one = 1;
+        if (::write(server::wake_fd_, &one, sizeof (one)) == -1)
+            syslog(LOG_DEBUG, "unable to signal wake fd %d", errno);
+    }
+
+    /** Wait for socket to become readable.
+     *
+     * returns false if woken by kill() or handoff() first.
+     */
+    bool server::wait_readable(const int socket) {
+        pollfd fds[2];
+        fds[0].fd = socket;
+        fds[0].events = POLLIN;
+        fds[1].fd = server::wake_fd_;
+        fds[1].events = POLLIN;
+
+        while (poll(fds, 2, -1) == -1) {
+            if (errno != EINTR) return false;
+        }
+
+        if (fds[0].revents) return true;
+        return false;
     }
 
     /** Create TCP socket listener.
@@ -65,15 +139,34 @@ namespace tcp {
 
         if (ip_endpoint_->rp == nullptr) return false;
 
+        // accepted sockets inherit the buffer sizes
+        apply_sock_options(ip_endpoint_->socket_, this->sock_opts_);
+
+        if (is_unix_host(host)) {
+            unix_path_ = unix_host_path(host);
+        } else {
+            int option = server::defer_accept_s_;
+            if (option > 0 && setsockopt(ip_endpoint_->socket_,
+                    IPPROTO_TCP, TCP_DEFER_ACCEPT,
+                    (char *) &option, sizeof (option)) == -1)
+                syslog(LOG_DEBUG, "unable to set TCP_DEFER_ACCEPT %d", errno);
+
+            option = this->fast_open_;
+            if (option > 0 && setsockopt(ip_endpoint_->socket_,
+                    IPPROTO_TCP, TCP_FASTOPEN,
+                    (char *) &option, sizeof (option)) == -1)
+                syslog(LOG_DEBUG, "unable to set TCP_FASTOPEN %d", errno);
+        }
+
+        ++threads_;
         this->server_.reset(new std::thread(
-                &server::listen_loop,
+                &server::listen_loop, this,
                 ip_endpoint_->socket_,
-                *ip_endpoint_->rp,
                 this->my_connection));
 
         this->server_->detach();
 
-        freeaddrinfo(ip_endpoint_->results);
+        free_addr_info();
 
         return true;
     }
@@ -93,6 +186,11 @@ namespace tcp {
             if (ip_endpoint_->socket_ == -1)
                 continue;
 
+            // stale socket file left by a previous run
+            if (ip_endpoint_->rp->ai_family == AF_UNIX &&
+                    ip_endpoint_->unix_addr.sun_path[0] != '\0')
+                unlink(ip_endpoint_->unix_addr.sun_path);
+
             int option = 1;
             setsockopt(ip_endpoint_->socket_,
                     SOL_SOCKET, SO_REUSEADDR,
@@ -115,55 +213,126 @@ namespace tcp {
     /** Listen for TCP connections.
      *
      * if successful bind, listen for new connections.
-     * each new connection is a new thread.
+     * each wake up drains up to ACCEPT_BATCH connections
+     * from the backlog, each new connection is a new thread.
      */
-    void server::listen_loop(const int &socket,
-            addrinfo client_addrinfo, connection conn) {
-
-        // client socket
-        int client_socket = 0;
-
-        // listen until parent BGP thread exits
-        while (!server::kill_) {
-            // listen for connection
-            if (::listen(socket, server::max_conn_buffered) == -1) {
-                syslog(LOG_DEBUG, "unable to listen for connections");
-                // failed, throw errno
-                throw std::system_error(errno, std::system_category());
-            }
+    void server::listen_loop(const int socket, connection conn) {
 
-            // accept the new connection
-            client_socket = accept(socket, client_addrinfo.ai_addr,
-                    &client_addrinfo.ai_addrlen);
+        pin_thread(server::accept_cpus_);
 
-            // set options, no_delay, reuseaddr
-            int option = 1;
-            setsockopt(client_socket, SOL_SOCKET, TCP_NODELAY,
-                    (char *) &option, sizeof (option));
-            setsockopt(client_socket, SOL_SOCKET, SO_REUSEADDR,
-                    (char *) &option, sizeof (option));
+        // a received listener is listening already, this only sets the backlog
+        if (::listen(socket, server::max_conn_buffered) == -1) {
+            syslog(LOG_DEBUG, "unable to listen for connections");
+            // failed, throw errno
+            throw std::system_error(errno, std::system_category());
+        }
 
-            if (client_socket == -1) {
-                syslog(LOG_DEBUG, "unable to accept connection %d", errno);
-                close(socket);
-                close(client_socket);
-                // failed, throw errno
-                throw std::system_error(errno, std::system_category());
-            } else {
+        // accept until EAGAIN, then wait on poll()
+        int flags = fcntl(socket, F_GETFL);
+        if (flags != -1) fcntl(socket, F_SETFL, flags | O_NONBLOCK);
 
-                // success, create new thread to manage connection
-                server::connections.push_back(
-                        std::shared_ptr<std::thread>(new std::thread(
-                        conn,
-                        nullptr, client_socket)));
+        // listen until killed or handed off
+        while (!server::kill_ && !server::handing_off_) {
+
+            // block until a connection or a wake up
+            if (!server::wait_readable(socket)) continue;
 
-                server::connections.back()->detach();
+            for (int n = 0; n < ACCEPT_BATCH; ++n) {
+                if (server::kill_ || server::handing_off_) break;
 
+                /* accepted sockets stay blocking, connections are
+                 * served with blocking stdio on their own thread */
+                sockaddr_storage client_addr;
+                socklen_t client_addrlen = sizeof (client_addr);
+                int client_socket = accept4(socket,
+                        (sockaddr *) &client_addr, &client_addrlen,
+                        SOCK_CLOEXEC);
+
+                if (client_socket == -1) {
+                    // backlog drained
+                    if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+
+                    // peer gave up while queued
+                    if (errno == EINTR || errno == ECONNABORTED) continue;
+
+                    // listener was closed by disconnect()
+                    if (errno == EBADF) {
+                        --threads_;
+                        return;
+                    }
+
+                    // out of descriptors, back off rather than spin
+                    if (errno == EMFILE || errno == ENFILE ||
+                            errno == ENOBUFS || errno == ENOMEM) {
+                        syslog(LOG_DEBUG, "unable to accept connection %d", errno);
+                        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+                        break;
+                    }
+
+                    syslog(LOG_DEBUG, "unable to accept connection %d", errno);
+                    close(socket);
+                    // failed, throw errno
+                    throw std::system_error(errno, std::system_category());
+                }
+
+                // set options, no_delay and the profile
+                if (client_addr.ss_family != AF_UNIX)
+                    apply_sock_options(client_socket, this->sock_opts_);
+
+                // success, create new thread to manage connection
+                if (conn != nullptr) {
+                    ++threads_;
+                    server::spawn(new std::thread([this, conn, client_socket] {
+                        server::place_connection(client_socket);
+                        conn(nullptr, client_socket);
+                        --threads_;
+                    }));
+                } else {
+                    ++threads_;
+                    server::spawn(new std::thread(
+                            &server::connection_loop, this,
+                            nullptr, client_socket));
+                }
             }
         }
 
         close(socket);
-        memset(&client_addrinfo, 0, sizeof (addrinfo));
+
+        // the listener is gone, keep reset() from closing it twice
+        if (ip_endpoint_->socket_ == socket) ip_endpoint_->socket_ = 0;
+        --threads_;
+    }
+
+    /* connection threads run detached and count themselves
+     * in threads_, live connections are in registry_ */
+    void server::spawn(std::thread *connection_thread) {
+        connection_thread->detach();
+        delete connection_thread;
+    }
+
+    /** Pin the calling connection thread.
+     *
+     * to the io CPU the connection's packets arrive on
+     * when following interrupts, else to any io CPU.
+     * without io CPUs it floats, even when the accept
+     * thread it was started from is pinned.
+     */
+    void server::place_connection(const int client_socket) {
+        if (server::io_cpus_.empty()) {
+            if (!server::accept_cpus_.empty()) unpin_thread();
+            return;
+        }
+
+        if (server::follow_irq_) {
+            int cpu = incoming_cpu(client_socket);
+            if (std::find(server::io_cpus_.begin(), server::io_cpus_.end(),
+                    cpu) != server::io_cpus_.end()) {
+                pin_thread(cpu_list(1, cpu));
+                return;
+            }
+        }
+
+        pin_thread(server::io_cpus_);
     }
 
     /** Handle client connection.
@@ -173,8 +342,28 @@ namespace tcp {
      */
     void server::connection_loop(std::thread *connection_thread, int client_socket) {
 
+        server::place_connection(client_socket);
+        server::serve(client_socket, true);
+
+        if (connection_thread != nullptr) {
+            delete connection_thread;
+            connection_thread = nullptr;
+        }
+
+        --threads_;
+    }
+
+    /** Serve requests on a connected socket.
+     *
+     * authenticate is false for connections adopted
+     * through takeover(), they were authorized by the
+     * process that handed them off.
+     */
+    void server::serve(const int client_socket, bool authenticate) {
+
         // socket file streams
         ip_point ipend;
+        ipend.socket_ = client_socket;
 
         // open stream for write
         if (nullptr == (ipend.tx = fdopen(client_socket, "w"))) {
@@ -190,68 +379,1028 @@ namespace tcp {
             throw std::system_error(errno, std::system_category());
         }
 
-        if (server::authorized(ipend)) {
+        // pinned, give the streams node local buffers
+        void *rx_local = nullptr;
+        void *tx_local = nullptr;
+        if (!server::io_cpus_.empty()) {
+            rx_local = alloc_local(ipend.rx_buffer_size);
+            tx_local = alloc_local(ipend.tx_buffer_size);
+            if (rx_local) setvbuf(ipend.rx, (char *) rx_local, _IOFBF, ipend.rx_buffer_size);
+            if (tx_local) setvbuf(ipend.tx, (char *) tx_local, _IOFBF, ipend.tx_buffer_size);
+        }
+
+        ++server::active_conns_;
+        bool handed_off = false;
+
+        const conn_handle handle = registry_.add(client_socket);
+        conn_counters *counters = registry_.counters(handle);
+
+        timer_wheel &wheel = timer_wheel::shared();
+        conn_timer ct;
+        ct.socket = client_socket;
+        ct.idle_ms = server::idle_timeout_ms_;
+        ct.busy = false;
+        ct.last_active = wheel.now_ms();
+
+        if (authenticate && server::handshake_timeout_ms_ > 0) {
+            wheel.arm(ct.t, server::handshake_timeout_ms_,
+                    &server::expire_handshake, &ct);
+        }
+
+        bool authed = !authenticate || server::authorized(ipend);
+        wheel.cancel(ct.t);
+
+        // set with an async handler, outlives the loop
+        std::shared_ptr<reply_order> order;
+
+        if (authed) {
+
+            if (ct.idle_ms > 0)
+                wheel.arm(ct.t, ct.idle_ms, &server::expire_idle, &ct);
+
+            if (server::conn_tx_high_ > 0) {
+                ipend.txq = std::make_shared<tx_queue>(client_socket,
+                        server::conn_tx_low_,
+                        server::conn_tx_high_,
+                        server::conn_tx_policy_);
+
+                registry_.set_tx_queue(handle, ipend.txq);
+            }
 
             std::string _cmd_return;
             std::string stream;
+            channel_map channels;
+            reliable_rx reliable;
+            // lines from a primary, applied without a reply
+            bool replica_link = false;
 
-            // while connected and BGP still running.
-            // feof() should be safe for local socket.
-            while (!feof(ipend.rx) && !server::kill_) {
+            /* once the peer sends budgets, input seen waiting at
+             * waiting_ns. the requests in its first waiting_bytes
+             * had their budgets running no later than that. */
+            bool budgets = false;
+            uint64_t waiting_ns = 0;
+            size_t waiting_bytes = 0;
 
-                // get chars from stream
-                do {
-                    stream += fgetc(ipend.rx);
-                } while (stream.back() != tcp::EOL);
+            // async replies are queued from other threads
+            if (server::my_async != nullptr) {
+                order = std::make_shared<reply_order>(
+                        server::own_tx_queue(ipend, handle,
+                        tx_policy::DISCONNECT), counters);
+            }
 
-                // EOF == disconnect
-                if (stream.back() == EOF) break;
+            // while connected and the server is running.
+            while (!server::kill_) {
 
-                if (stream.size() > 0) {
+                /* nothing buffered, this connection is idle.
+                 * wait for the peer or a wake up. */
+                if (!ipend.shm && !ipend.rx_pending()) {
+                    // what the burst delivered, in one ack
+                    if (reliable.unacked > 0 &&
+                            !server::send_ack(ipend, reliable)) break;
 
-                    // call read handler.
-                    if (server::my_reader != nullptr) {
-                        _cmd_return = server::my_reader(stream);
-                    } else {
-                        syslog(LOG_DEBUG,
-                                "my_reader == nullptr, set_read_handler first");
+                    if (server::handing_off_) {
+                        // the socket moves once every reply is out
+                        if (order && !server::drain_replies(*order)) break;
+
+                        /* what this process keeps for the peer does
+                         * not move, such a peer reconnects instead */
+                        if (channels.empty() && !reliable.state &&
+                                !replica_link && !server::subscribed(handle))
+                            handed_off = server::hand_off_connection(ipend,
+                                    handle, client_socket);
+                        break;
                     }
 
+                    if (!spin_readable(client_socket, sock_opts_.spin_us) &&
+                            !server::wait_readable(client_socket)) continue;
+                }
+
+                // owing too many replies, read on once some are out
+                if (order && !order->wait_below(ASYNC_OUTSTANDING_MAX, 100)) {
+                    if (server::handing_off_) break;
+                    continue;
+                }
+
+                // EOF == disconnect
+                if (!server::read_request(ipend, stream)) break;
+                rearm_quickack(client_socket, sock_opts_);
+
+                uint64_t arrived_ns = 0;
+                if (waiting_bytes > 0) {
+                    arrived_ns = waiting_ns;
+                    waiting_bytes -= std::min(waiting_bytes, stream.length());
+                }
+
+                if (budgets && waiting_bytes == 0 &&
+                        (waiting_bytes = server::input_pending(ipend)) > 0)
+                    waiting_ns = steady_ns();
+
+                ct.busy = true;
+                ++counters->requests;
+                counters->rx_bytes += stream.length();
+
+                /* a sequenced line is handled as any other, once.
+                 * duplicates replayed after a failover are dropped. */
+                if (stream[0] == tcp::CTL &&
+                        stream[1] == (char) control::SEQUENCED &&
+                        !server::sequenced(ipend, reliable, stream)) {
                     stream.clear();
+                    ct.busy = false;
+                    if (!ipend.connected()) break;
+                    continue;
+                }
+
+                /* a request past its deadline has been given up
+                 * on, it is answered before any handler runs */
+                request_deadline_ns_ = 0;
+                if (stream[0] == tcp::CTL &&
+                        stream[1] == (char) control::BUDGET) {
+                    const uint64_t now = steady_ns();
+                    if (!budgets) {
+                        budgets = true;
+                        if ((waiting_bytes = server::input_pending(ipend)) > 0)
+                            waiting_ns = now;
+                    }
+
+                    uint64_t budget_us = 0;
+                    bool ok = take_budget(stream, budget_us);
+                    if (!ok) syslog(LOG_DEBUG, "bad budget on %d", client_socket);
+                    if (arrived_ns == 0) arrived_ns = now;
+
+                    if (!ok || arrived_ns + budget_us * 1000 <= now) {
+                        if (ok) ++server::expired_;
+                        stream.clear();
+                        ct.busy = false;
 
-                    /* write the length of ret_val first.
-                     * CLI is expected [len,data].
-                     * increased to 32bit value for larger outputs */
-                    if (_cmd_return.length() > 0) {
-                        // write data
-                        fwrite(_cmd_return.c_str(), 1,
-                                _cmd_return.length(),
-                                ipend.tx);
-                        // send
-                        fflush(ipend.tx);
-                        _cmd_return.clear();
+                        // one reply per request, in its turn
+                        std::string reply;
+                        append_expired(reply);
+                        if (order) {
+                            completion(order, order->issue()).reply(reply);
+                        } else if (!server::write_reply(ipend, reply)) {
+                            break;
+                        }
+                        continue;
                     }
+
+                    request_deadline_ns_ = arrived_ns + budget_us * 1000;
+                }
+
+                if (stream[0] == tcp::CTL &&
+                        stream[1] == (char) control::RELIABLE) {
+                    bool ok = server::open_session(ipend, reliable, stream);
+                    stream.clear();
+                    ct.busy = false;
+                    if (!ok) break;
+                    continue;
                 }
+
+                if (stream[0] == tcp::CTL &&
+                        stream[1] == (char) control::REPLICA) {
+                    replica_link = true;
+                    stream.clear();
+                    ct.busy = false;
+                    continue;
+                }
+
+                // in the order accepted, standbys chain
+                if (server::replicator_ && stream[0] != tcp::CTL)
+                    server::replicator_->append(stream);
+
+                if (replica_link && stream[0] != tcp::CTL) {
+                    read_handler apply = server::my_standby != nullptr ?
+                            server::my_standby : server::my_reader;
+                    if (apply != nullptr) apply(stream);
+
+                    stream.clear();
+                    ct.last_active = wheel.now_ms();
+                    ct.busy = false;
+                    continue;
+                }
+
+                // library control messages
+                if (stream[0] == tcp::CTL) {
+                    bool ok = stream[1] == (char) control::FRAME ?
+                            server::channel_frame(ipend, channels, stream) :
+                            server::control(ipend, handle, stream);
+                    stream.clear();
+                    ct.busy = false;
+                    if (!ok) break;
+                    continue;
+                }
+
+                // replied to later, maybe from another thread
+                if (order) {
+                    completion done(order, order->issue(),
+                            request_deadline_ns_);
+                    current_connection_ = handle;
+                    server::my_async(stream, done);
+                    current_connection_ = 0;
+
+                    stream.clear();
+                    ct.last_active = wheel.now_ms();
+                    ct.busy = false;
+                    continue;
+                }
+
+                // the handler writes its reply as it goes
+                if (server::my_streamer != nullptr) {
+                    reply_sink sink(ipend);
+                    current_connection_ = handle;
+                    server::my_streamer(stream, sink);
+                    current_connection_ = 0;
+
+                    stream.clear();
+                    counters->tx_bytes += sink.written();
+                    if (!sink.ok()) break;
+
+                    ct.last_active = wheel.now_ms();
+                    ct.busy = false;
+                    continue;
+                }
+
+                // answered before, the handler is not called
+                shared_buffer cached;
+                if (server::reader_cacheable_ && server::cache_ &&
+                        server::cache_->lookup(stream, cached)) {
+                    stream.clear();
+                    if (!server::write_reply(ipend, cached)) break;
+                    counters->tx_bytes += cached->length();
+
+                    ct.last_active = wheel.now_ms();
+                    ct.busy = false;
+                    continue;
+                }
+
+                // call read handler.
+                if (server::my_reader != nullptr) {
+                    current_connection_ = handle;
+                    _cmd_return = server::my_reader(stream);
+                    current_connection_ = 0;
+
+                    if (server::reader_cacheable_ && server::cache_ &&
+                            _cmd_return.length() > 0)
+                        server::cache_->insert(stream, _cmd_return);
+                } else {
+                    syslog(LOG_DEBUG,
+                            "my_reader == nullptr, set_read_handler first");
+                }
+
+                stream.clear();
+
+                if (_cmd_return.length() > 0) {
+                    if (!server::write_reply(ipend, _cmd_return)) break;
+                    counters->tx_bytes += _cmd_return.length();
+                    _cmd_return.clear();
+                }
+
+                ct.last_active = wheel.now_ms();
+                ct.busy = false;
             }
         }
 
+        // the timer must not fire once the socket is closed
+        wheel.cancel(ct.t);
+
+        /* handlers may still hold completions, their replies
+         * must not outlive the registry slot */
+        if (order) order->close();
+
+        // no more pushes or kicks once the socket is closed
+        server::drop_subscriber(handle);
+        registry_.remove(handle);
+
+        if (ipend.shm) ipend.shm->close();
+
+        /* a handed off socket lives on in the new process,
+         * closing our descriptor does not end the session.
+         * its queue was drained, it must not shut it down. */
+        if (handed_off)
+            syslog(LOG_DEBUG, "connection %d handed off", client_socket);
+        else if (ipend.txq)
+            ipend.txq->close();
+
         fclose(ipend.tx);
         fclose(ipend.rx);
         close(client_socket);
 
-        if (connection_thread != nullptr) {
-            delete connection_thread;
-            connection_thread = nullptr;
+        free_local(rx_local, ipend.rx_buffer_size);
+        free_local(tx_local, ipend.tx_buffer_size);
+
+        --server::active_conns_;
+    }
+
+    // peer did not finish the auth exchange in time
+    void server::expire_handshake(void *arg) {
+        conn_timer *ct = (conn_timer *) arg;
+        syslog(LOG_DEBUG, "handshake timeout on %d", ct->socket);
+        ::shutdown(ct->socket, SHUT_RDWR);
+    }
+
+    /* the timer is armed once, activity only moves
+     * last_active and the timer re-arms for the rest */
+    void server::expire_idle(void *arg) {
+        conn_timer *ct = (conn_timer *) arg;
+        timer_wheel &wheel = timer_wheel::shared();
+        uint64_t idle_for = wheel.now_ms() - ct->last_active;
+
+        if (ct->busy || idle_for < ct->idle_ms) {
+            uint64_t rest = ct->busy ? ct->idle_ms : ct->idle_ms - idle_for;
+            wheel.arm(ct->t, rest, &server::expire_idle, ct);
+            return;
+        }
+
+        syslog(LOG_DEBUG, "idle timeout on %d", ct->socket);
+        ::shutdown(ct->socket, SHUT_RDWR);
+    }
+
+    /** Read one EOL terminated request.
+     *
+     * from the shared memory ring when one was negotiated,
+     * otherwise from the rx stream. false on EOF.
+     */
+    int server::read_byte(ip_point &ipend) {
+        if (ipend.shm) {
+            char ch;
+            if (ipend.shm->read(&ch, 1, [this] {
+                    return server::kill_ || server::handing_off_;
+                }) != 1) return EOF;
+            return (unsigned char) ch;
+        }
+
+        return fgetc(ipend.rx);
+    }
+
+    // appends exactly len bytes
+    bool server::read_exact(ip_point &ipend, std::string &stream, size_t len) {
+        size_t at = stream.size();
+        stream.resize(at + len);
+        if (len == 0) return true;
+
+        if (ipend.shm) {
+            return ipend.shm->read(&stream[at], len, [this] {
+                return server::kill_ || server::handing_off_;
+            }) == len;
+        }
+
+        return fread(&stream[at], 1, len, ipend.rx) == len;
+    }
+
+    /** Read one request.
+     *
+     * a line up to and including EOL, or a whole channel
+     * frame, whose binary payload is read by length.
+     */
+    bool server::read_request(ip_point &ipend, std::string &stream) {
+        int ch = server::read_byte(ipend);
+        if (ch == EOF) return false;
+        stream += (char) ch;
+        if (ch == tcp::EOL) return true;
+
+        if (ch == tcp::CTL) {
+            if ((ch = server::read_byte(ipend)) == EOF) return false;
+            stream += (char) ch;
+            if (ch == tcp::EOL) return true;
+
+            if (ch == (char) control::FRAME) {
+                if (!server::read_exact(ipend, stream, frame_schema::size - 2))
+                    return false;
+
+                view<frame_schema> h((const uint8_t *) stream.data());
+                if (h.get<5>() > FRAME_MAX) {
+                    syslog(LOG_DEBUG, "oversized frame %u", h.get<5>());
+                    return false;
+                }
+
+                if (h.get<2>() != (uint8_t) frame_kind::DATA) return true;
+                return server::read_exact(ipend, stream, h.get<5>());
+            }
+        }
+
+        if (ipend.shm) {
+            return ipend.shm->readline(stream, tcp::EOL, [this] {
+                return server::kill_ || server::handing_off_;
+            });
         }
+
+        // get chars from stream
+        do {
+            ch = fgetc(ipend.rx);
+            if (ch == EOF) return false;
+            stream += (char) ch;
+        } while (ch != tcp::EOL);
+
+        return true;
     }
 
+    /** Handle a channel frame.
+     *
+     * collects DATA until FRAME_FIN, then calls the channel's
+     * handler and frames the reply on the same channel. credit
+     * is granted back once half a window has arrived. a
+     * message past CHANNEL_MESSAGE_MAX closes the connection.
+     */
+    bool server::channel_frame(ip_point &ipend, channel_map &channels,
+            const std::string &frame) {
+
+        view<frame_schema> h((const uint8_t *) frame.data());
+
+        // flow control of our replies is left to TCP
+        if (h.get<2>() != (uint8_t) frame_kind::DATA) return true;
+
+        const uint16_t id = h.get<4>();
+        channel_rx &chan = channels[id];
+        if (chan.message.size() + h.get<5>() > CHANNEL_MESSAGE_MAX) {
+            syslog(LOG_DEBUG, "channel %u: message over %zu bytes",
+                    (unsigned) id, CHANNEL_MESSAGE_MAX);
+            return false;
+        }
+        chan.message.append(frame, frame_schema::size, std::string::npos);
+        chan.ungranted += h.get<5>();
+
+        std::string out;
+        if (chan.ungranted >= CHANNEL_WINDOW / 2) {
+            append_frame(out, frame_kind::WINDOW, id, 0, nullptr,
+                    (uint32_t) chan.ungranted);
+            chan.ungranted = 0;
+        }
+
+        if (h.get<3>() & FRAME_FIN) {
+            auto it = server::channel_handlers_.find(id);
+            read_handler handler = it != server::channel_handlers_.end() ?
+                    it->second : server::my_reader;
+
+            std::string reply;
+            if (handler != nullptr) reply = handler(chan.message);
+            chan.message.clear();
+
+            if (reply.length() > 0) append_message(out, id, reply);
+        }
+
+        if (out.empty()) return true;
+        return server::write_reply(ipend, out);
+    }
+
+    /** Open or resume a reliable session.
+     *
+     * answers at once with the last sequence delivered, the
+     * client sends everything after it again.
+     */
+    bool server::open_session(ip_point &ipend, reliable_rx &reliable,
+            const std::string &line) {
+        uint64_t session;
+        if (!parse_hex64(line, 2, session)) {
+            syslog(LOG_DEBUG, "bad reliable session on %d", ipend.socket_);
+            return false;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(server::sessions_mutex_);
+
+            std::shared_ptr<session_state> &state = server::sessions_[session];
+            if (!state) state = std::make_shared<session_state>();
+            state->touched = ++server::session_clock_;
+            reliable.state = state;
+
+            // forget the least recently opened idle session
+            if (server::sessions_.size() > RELIABLE_SESSIONS) {
+                auto oldest = server::sessions_.end();
+                for (auto it = server::sessions_.begin();
+                        it != server::sessions_.end(); ++it) {
+                    if (it->second.use_count() > 1) continue;
+                    if (oldest == server::sessions_.end() ||
+                            it->second->touched < oldest->second->touched)
+                        oldest = it;
+                }
+                if (oldest != server::sessions_.end())
+                    server::sessions_.erase(oldest);
+            }
+        }
+
+        reliable.unacked = 0;
+        reliable.acked = reliable.state->delivered;
+
+        return server::write_reply(ipend,
+                reliable_line((char) control::ACK, reliable.acked));
+    }
+
+    /** Strip the header off a sequenced line.
+     *
+     * false if it was delivered before, by this connection or
+     * one the session was resumed from. acks are sent every
+     * ACK_EVERY messages, the rest once the burst is read.
+     */
+    bool server::sequenced(ip_point &ipend, reliable_rx &reliable,
+            std::string &line) {
+        uint64_t seq;
+        if (!reliable.state || !parse_hex64(line, 2, seq)) {
+            syslog(LOG_DEBUG, "sequenced line outside a session on %d",
+                    ipend.socket_);
+            return false;
+        }
+
+        bool fresh = false;
+        uint64_t delivered = reliable.state->delivered;
+        while (seq > delivered && !(fresh =
+                reliable.state->delivered.compare_exchange_weak(delivered, seq)));
+
+        /* shared memory has no cheap way to see the burst
+         * end, every message is acked. writes there are
+         * not packets. */
+        if (++reliable.unacked >= ACK_EVERY || ipend.shm)
+            server::send_ack(ipend, reliable);
+
+        if (fresh) line.erase(0, 2 + SEQ_DIGITS);
+        return fresh;
+    }
+
+    bool server::send_ack(ip_point &ipend, reliable_rx &reliable) {
+        reliable.unacked = 0;
+
+        uint64_t delivered = reliable.state->delivered;
+        if (delivered == reliable.acked) return true;
+        reliable.acked = delivered;
+
+        return server::write_reply(ipend,
+                reliable_line((char) control::ACK, delivered));
+    }
+
+    /** Write a reply back to the peer.
+     *
+     * false if the connection should be closed.
+     */
+    bool server::write_reply(ip_point &ipend, const std::string &reply) {
+        if (ipend.shm) {
+            size_t n = ipend.shm->write(reply.data(), reply.length());
+            ipend.shm->flush();
+            return n == reply.length();
+        }
+
+        // queue full under DISCONNECT policy
+        if (ipend.txq) return ipend.txq->push(reply);
+
+        // write data
+        fwrite(reply.c_str(), 1, reply.length(), ipend.tx);
+        // send
+        return fflush(ipend.tx) == 0;
+    }
+
+    // same as above, queued without copying the buffer
+    bool server::write_reply(ip_point &ipend, const shared_buffer &reply) {
+        if (ipend.txq) return ipend.txq->push(reply);
+        return server::write_reply(ipend, *reply);
+    }
+
+    bool reply_sink::write(const std::string &chunk) {
+        return this->write(std::make_shared<const std::string>(chunk));
+    }
+
+    bool reply_sink::write(const void *data, size_t len) {
+        if (!ok_) return false;
+        if (len == 0) return true;
+
+        if (ipend_.txq) {
+            return this->write(std::make_shared<const std::string>(
+                    (const char *) data, len));
+        }
+
+        if (ipend_.shm) {
+            // blocks while the ring is full
+            ok_ = ipend_.shm->write(data, len) == len;
+            ipend_.shm->flush();
+        } else {
+            // blocks while the socket buffer is full
+            ok_ = fwrite(data, 1, len, ipend_.tx) == len &&
+                    fflush(ipend_.tx) == 0;
+        }
+
+        if (ok_) written_ += len;
+        return ok_;
+    }
+
+    /* queued without copying. waits for room first so a
+     * stream never trips a DROP_OLDEST or DISCONNECT policy */
+    bool reply_sink::write(shared_buffer chunk) {
+        if (!ok_) return false;
+        if (!chunk || chunk->empty()) return true;
+
+        if (!ipend_.txq) return this->write(chunk->data(), chunk->size());
+
+        ok_ = ipend_.txq->wait_space(chunk->size()) &&
+                ipend_.txq->push(chunk);
+
+        if (ok_) written_ += chunk->size();
+        return ok_;
+    }
+
+    /** Handle a control line.
+     *
+     * false if the connection should be closed.
+     */
+    bool server::control(ip_point &ipend, conn_handle handle,
+            const std::string &line) {
+        if (line.size() < 3) return true;
+
+        switch ((tcp::control) line[1]) {
+            case control::SHM:
+            {
+                /* "<CTL>SN<EOL>" gets a fresh nonce, "<CTL>S<name><EOL>"
+                 * maps the region created for it. peers on another
+                 * host, or async replies queued from other threads,
+                 * stay on TCP */
+                bool usable = !ipend.shm && server::my_async == nullptr &&
+                        same_host(ipend.socket_);
+
+                std::string answer;
+                answer += tcp::CTL;
+                answer += (char) control::SHM;
+
+                if (line[2] == 'N') {
+                    ipend.shm_nonce = usable ? shm_nonce() : "";
+                    answer += usable ? 'N' + ipend.shm_nonce : "0";
+                    answer += tcp::EOL;
+                    return server::write_reply(ipend, answer);
+                }
+
+                // a region under any other name is not this peer's
+                std::shared_ptr<shm_link> link;
+                if (usable && !ipend.shm_nonce.empty() &&
+                        line.compare(2, line.size() - 3,
+                        shm_link::region(ipend.shm_nonce)) == 0)
+                    link = shm_link::open(ipend.shm_nonce);
+                ipend.shm_nonce.clear();
+
+                answer += link ? '1' : '0';
+                answer += tcp::EOL;
+
+                if (!server::write_reply(ipend, answer)) return false;
+
+                if (link) {
+                    // pushes would land on the abandoned socket
+                    server::drop_subscriber(handle);
+                    registry_.set_tx_queue(handle, nullptr);
+                    if (ipend.txq) ipend.txq->flush();
+                    link->set_socket(ipend.socket_);
+                    ipend.shm = link;
+                }
+                break;
+            }
+            case control::SUBSCRIBE:
+            {
+                if (line.size() < 4) break;
+
+                /* pushes go out one subscriber after another, one
+                 * that blocks would hold up the publisher and the
+                 * rest. it loses the oldest messages instead. */
+                tx_policy policy = tx_policy::DROP_OLDEST;
+                if (line[2] == '0' + (int) tx_policy::DISCONNECT)
+                    policy = tx_policy::DISCONNECT;
+                else if (line[2] < '0' || line[2] > '0' + (int) tx_policy::DISCONNECT)
+                    syslog(LOG_DEBUG, "bad subscribe policy on %d", ipend.socket_);
+
+                std::string topic(line, 3, line.size() - 4);
+                if (!server::subscribe(ipend, handle, topic, policy))
+                    syslog(LOG_DEBUG, "subscribe refused on %d", ipend.socket_);
+                break;
+            }
+            case control::UNSUBSCRIBE:
+                server::unsubscribe(handle, line.substr(2, line.size() - 3));
+                break;
+            default:
+                syslog(LOG_DEBUG, "unknown control message %d", line[1]);
+                break;
+        }
+
+        return true;
+    }
+
+    /** Subscribe connection to topic.
+     *
+     * pushes need a tx queue; a connection without one gets
+     * its own, replies then go through it as well so they
+     * never interleave with a push. shared memory connections
+     * can not be pushed to.
+     */
+    bool server::subscribe(ip_point &ipend, conn_handle handle,
+            const std::string &topic, tx_policy policy) {
+
+        if (ipend.shm) return false;
+
+        // one queue per connection, the latest policy wins
+        if (ipend.txq) ipend.txq->set_policy(policy);
+        else server::own_tx_queue(ipend, handle, policy);
+
+        std::lock_guard<std::mutex> lock(server::publish_mutex_);
+        server::topics_[topic].insert(handle);
+
+        return true;
+    }
+
+    /** Give a connection its own tx queue.
+     *
+     * writes from other threads, pushes and async replies,
+     * need one. the budget is set_tx_budget()'s if set.
+     */
+    std::shared_ptr<tx_queue> server::own_tx_queue(ip_point &ipend,
+            conn_handle handle, tx_policy policy) {
+        if (ipend.txq) return ipend.txq;
+
+        size_t low = server::conn_tx_high_ ? server::conn_tx_low_ : PUSH_TX_LOW;
+        size_t high = server::conn_tx_high_ ? server::conn_tx_high_ : PUSH_TX_HIGH;
+        ipend.txq = std::make_shared<tx_queue>(ipend.socket_, low, high, policy);
+
+        registry_.set_tx_queue(handle, ipend.txq);
+
+        return ipend.txq;
+    }
+
+    void server::unsubscribe(conn_handle handle, const std::string &topic) {
+        std::lock_guard<std::mutex> lock(server::publish_mutex_);
+
+        auto it = server::topics_.find(topic);
+        if (it == server::topics_.end()) return;
+
+        it->second.erase(handle);
+        if (it->second.empty()) server::topics_.erase(it);
+    }
+
+    bool server::subscribed(conn_handle handle) {
+        std::lock_guard<std::mutex> lock(server::publish_mutex_);
+
+        for (const auto &topic : server::topics_)
+            if (topic.second.count(handle)) return true;
+
+        return false;
+    }
+
+    void server::drop_subscriber(conn_handle handle) {
+        std::lock_guard<std::mutex> lock(server::publish_mutex_);
+
+        for (auto it = server::topics_.begin(); it != server::topics_.end();) {
+            it->second.erase(handle);
+            if (it->second.empty()) it = server::topics_.erase(it);
+            else ++it;
+        }
+    }
+
+    /* push outside publish_mutex_, a BLOCK queue set
+     * with set_tx_budget() must not hold up subscribing
+     * and disconnecting */
+    size_t server::push(const std::vector<std::shared_ptr<tx_queue>> &queues,
+            shared_buffer buf) {
+
+        size_t queued = 0;
+        for (auto &q : queues) {
+            if (q->push(buf)) ++queued;
+        }
+
+        return queued;
+    }
+
+    size_t server::publish(const std::string &topic, shared_buffer buf) {
+        std::vector<std::shared_ptr<tx_queue>> queues;
+        {
+            std::lock_guard<std::mutex> lock(server::publish_mutex_);
+
+            auto it = server::topics_.find(topic);
+            if (it == server::topics_.end()) return 0;
+
+            queues.reserve(it->second.size());
+            for (conn_handle h : it->second) {
+                std::shared_ptr<tx_queue> q = registry_.tx_queue_of(h);
+                if (q) queues.push_back(q);
+            }
+        }
+
+        return server::push(queues, buf);
+    }
+
+    size_t server::publish(const std::string &topic, const std::string &msg) {
+        return server::publish(topic, std::make_shared<const std::string>(msg));
+    }
+
+    size_t server::broadcast(shared_buffer buf) {
+        std::vector<std::shared_ptr<tx_queue>> queues;
+        registry_.tx_queues(queues);
+
+        return server::push(queues, buf);
+    }
+
+    size_t server::broadcast(const std::string &msg) {
+        return server::broadcast(std::make_shared<const std::string>(msg));
+    }
+
+    conn_handle server::current_connection(void) {
+        return current_connection_;
+    }
+
+    int64_t server::remaining_us(void) {
+        if (request_deadline_ns_ == 0) return -1;
+
+        int64_t left = (int64_t) (request_deadline_ns_ - steady_ns());
+        return left > 0 ? left / 1000 : 0;
+    }
+
+    /* unread input bytes, in the stream buffer and the socket.
+     * shared memory rings are not looked at, they report none */
+    size_t server::input_pending(ip_point &ipend) {
+        if (ipend.shm) return 0;
+
+        size_t pending = 0;
+#ifdef __GLIBC__
+        if (ipend.rx_pending())
+            pending = ipend.rx->_IO_read_end - ipend.rx->_IO_read_ptr;
+#endif
+
+        int n = 0;
+        if (ioctl(ipend.socket_, FIONREAD, &n) == 0 && n > 0) pending += n;
+        return pending;
+    }
+
+    bool server::kick(conn_handle handle) {
+        return registry_.shutdown(handle);
+    }
+
+    bool server::send_to(conn_handle handle, shared_buffer buf) {
+        std::shared_ptr<tx_queue> q = registry_.tx_queue_of(handle);
+        if (!q) return false;
+
+        return q->push(buf);
+    }
+
+    bool server::send_to(conn_handle handle, const std::string &msg) {
+        return server::send_to(handle, std::make_shared<const std::string>(msg));
+    }
+
+    bool server::hand_off_connection(ip_point &ipend, conn_handle handle,
+            const int client_socket) {
+        // replies still queued go out before the socket moves
+        if (ipend.txq) ipend.txq->close(true);
+        if (!server::handoff_conns_) return false;
+
+        /* once passed the socket is out of the registry, a
+         * handoff() running out of time must not cut it */
+        std::lock_guard<std::mutex> lock(server::handoff_mutex_);
+        if (!send_fd(server::handoff_channel_, 'C', client_socket)) return false;
+
+        registry_.remove(handle);
+        return true;
+    }
+
+    /* waits for the replies owed before a handoff, false
+     * once handoff() stops draining and some are still out */
+    bool server::drain_replies(reply_order &order) {
+        while (!order.wait_below(1, 10)) {
+            std::lock_guard<std::mutex> lock(server::handoff_mutex_);
+            if (server::handoff_channel_ == -1 || server::kill_) return false;
+        }
+
+        return true;
+    }
+
+    /** Hand the listener over to a new process.
+     *
+     * waits on path for takeover(), passes the listening
+     * socket with SCM_RIGHTS, stops accepting and lets
+     * each connection finish what it has in flight, for
+     * drain_ms at most.
+     */
+    bool server::handoff(const std::string &path, bool idle_conns,
+            uint32_t drain_ms) {
+        if (ip_endpoint_.get() == nullptr || ip_endpoint_->socket_ <= 0)
+            return false;
+
+        int listener = unix_listen(path, 1);
+        if (listener == -1) return false;
+
+        /* adopted connections skip authentication, only a
+         * process running as our own user may take them */
+        int channel;
+        while ((channel = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC)) != -1 &&
+                !peer_uid_matches(channel, geteuid())) {
+            syslog(LOG_DEBUG, "handoff: refused peer of another user");
+            close(channel);
+        }
+
+        close(listener);
+        if (path[0] != '@') unlink(path.c_str());
+
+        if (channel == -1) {
+            syslog(LOG_DEBUG, "handoff: accept failed %d", errno);
+            return false;
+        }
+
+        if (!send_fd(channel, 'L', ip_endpoint_->socket_)) {
+            syslog(LOG_DEBUG, "handoff: unable to pass listener");
+            close(channel);
+            return false;
+        }
+
+        server::handoff_channel_ = channel;
+        server::handoff_conns_ = idle_conns;
+        server::handing_off_ = true;
+        server::wake();
+
+        // drain in-flight requests
+        auto until = std::chrono::steady_clock::now() +
+                std::chrono::milliseconds(drain_ms);
+        while (server::active_conns_ > 0 &&
+                std::chrono::steady_clock::now() < until)
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+
+        {
+            std::lock_guard<std::mutex> lock(server::handoff_mutex_);
+            send_fd(channel, 'E', -1);
+            close(channel);
+            server::handoff_channel_ = -1;
+
+            // still busy, cut off rather than hold the switchover
+            if (server::active_conns_ > 0) {
+                syslog(LOG_DEBUG, "handoff: cutting %d busy connections",
+                        (int) server::active_conns_);
+                registry_.shutdown_all();
+            }
+        }
+
+        return true;
+    }
+
+    /** Take over a listener from handoff().
+     *
+     * starts accepting on the received socket and
+     * serves connections as they arrive on path.
+     */
+    bool server::takeover(const std::string &path) {
+        int channel = unix_connect(path);
+        if (channel == -1) return false;
+
+        char tag = 0;
+        int listener = -1;
+        if (!recv_fd(channel, tag, listener) || tag != 'L' || listener == -1) {
+            syslog(LOG_DEBUG, "takeover: no listener received");
+            close(channel);
+            return false;
+        }
+
+        ip_endpoint_ = std::make_shared<ip_point>();
+        ip_endpoint_->socket_ = listener;
+
+        threads_ += 2;
+        this->server_.reset(new std::thread(
+                &server::listen_loop, this,
+                listener,
+                this->my_connection));
+
+        this->server_->detach();
+
+        std::thread(&server::handoff_loop, this, channel).detach();
+
+        return true;
+    }
+
+    /* receive connections from the old process until it
+     * signals the end of the handoff */
+    void server::handoff_loop(const int channel) {
+        char tag = 0;
+        int client_socket = -1;
+
+        while (recv_fd(channel, tag, client_socket) && tag != 'E') {
+            if (tag != 'C' || client_socket == -1) continue;
+
+            ++threads_;
+            server::spawn(new std::thread([this, client_socket] {
+                server::place_connection(client_socket);
+                server::serve(client_socket, false);
+                --threads_;
+            }));
+        }
+
+        close(channel);
+        --threads_;
+    }
+
+
     bool server::authorized(ip_point &f_dup) {
-        if (server::srv_auth_type_ == auth::OFF) return true;
+
+        /* same host peer, the kernel vouches for its uid
+         * and no token is exchanged */
+        if (this->peer_cred_ && is_unix_socket(f_dup.socket_)) {
+            bool is_valid = peer_uid_matches(f_dup.socket_, this->peer_uid_);
+
+            uint8_t authd = (uint8_t) (is_valid ?
+                    auth_status::AUTH_OK : auth_status::AUTH_FAILED);
+            fwrite(&authd, sizeof (uint8_t), 1, f_dup.tx);
+            fflush(f_dup.tx);
+
+            return is_valid;
+        }
+
+        if (this->auth_type_ == auth::OFF) return true;
 
         unsigned char token[MD5_HASH_SIZE];
         fread(&token, sizeof (unsigned char), MD5_HASH_SIZE, f_dup.rx);
 
-        bool is_valid = (!memcmp(&server::md5_auth_hash_, &token, MD5_HASH_SIZE));
+        bool is_valid = (!memcmp(this->md5_hash_.get(), &token, MD5_HASH_SIZE));
 
         if (is_valid) {
             // notify client AUTH_OK
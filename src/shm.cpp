@@ -0,0 +1,436 @@
+/*
+ * socket
+ * Copyright (C) log2 2013 - Present <aaron.hebert@log2.co>
+ *
+ * log2sockets is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * log2sockets is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <new>
+#include <algorithm>
+#include <random>
+#include <cerrno>
+#include <climits>
+#include <cstring>
+#include <syslog.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <netinet/in.h>
+#include "shm.h"
+
+namespace tcp {
+
+    static const char *shm_prefix = "/socket2me.";
+
+    // spinning only helps if the peer can run meanwhile
+    static const int shm_spin =
+            sysconf(_SC_NPROCESSORS_ONLN) > 1 ? 2000 : 0;
+
+    /* each index is written by one side only and sits on
+     * its own cache line. the *_seq words are futexes. */
+    struct shm_ring_header {
+        alignas(64) std::atomic<uint64_t> head;
+        std::atomic<uint32_t> data_seq;
+        std::atomic<uint32_t> consumer_waiting;
+
+        alignas(64) std::atomic<uint64_t> tail;
+        std::atomic<uint32_t> space_seq;
+        std::atomic<uint32_t> producer_waiting;
+
+        alignas(64) uint64_t size;
+        std::atomic<uint32_t> closed;
+    };
+
+    static inline void cpu_relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+#endif
+    }
+
+    // shared (not private) futexes, the word lives in shm
+    static void futex_wait(std::atomic<uint32_t> *word, uint32_t val,
+            int timeout_ms) {
+        timespec ts;
+        ts.tv_sec = timeout_ms / 1000;
+        ts.tv_nsec = (timeout_ms % 1000) * 1000000L;
+        syscall(SYS_futex, word, FUTEX_WAIT, val, &ts, nullptr, 0);
+    }
+
+    static void futex_wake(std::atomic<uint32_t> *word) {
+        syscall(SYS_futex, word, FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+    }
+
+    size_t shm_ring::footprint(size_t size) {
+        return sizeof (shm_ring_header) + size;
+    }
+
+    void shm_ring::attach(void *mem, size_t size, bool init) {
+        hdr_ = (shm_ring_header *) mem;
+        data_ = (char *) mem + sizeof (shm_ring_header);
+
+        if (init) {
+            new (hdr_) shm_ring_header();
+            hdr_->head = 0;
+            hdr_->tail = 0;
+            hdr_->data_seq = 0;
+            hdr_->space_seq = 0;
+            hdr_->consumer_waiting = 0;
+            hdr_->producer_waiting = 0;
+            hdr_->closed = 0;
+            hdr_->size = size;
+        }
+
+        size_ = hdr_->size;
+        head_ = hdr_->head.load();
+        tail_ = hdr_->tail.load();
+    }
+
+    size_t shm_ring::try_write(const void *data, size_t len) {
+        uint64_t tail = hdr_->tail.load(std::memory_order_acquire);
+        size_t n = std::min(len, (size_t) (size_ - (head_ - tail)));
+        if (n == 0) return 0;
+
+        size_t off = head_ & (size_ - 1);
+        size_t first = std::min(n, size_ - off);
+        memcpy(data_ + off, data, first);
+        memcpy(data_, (const char *) data + first, n - first);
+
+        head_ += n;
+        return n;
+    }
+
+    /* make written bytes visible, wake the consumer only
+     * if it went to sleep */
+    void shm_ring::publish(void) {
+        hdr_->head.store(head_);
+        if (hdr_->consumer_waiting.load()) {
+            hdr_->data_seq.fetch_add(1);
+            futex_wake(&hdr_->data_seq);
+        }
+    }
+
+    bool shm_ring::wait_writable(int timeout_ms) {
+        for (int i = 0; i < shm_spin; ++i) {
+            if (head_ - hdr_->tail.load(std::memory_order_acquire) < size_)
+                return true;
+            cpu_relax();
+        }
+
+        uint32_t seq = hdr_->space_seq.load();
+        hdr_->producer_waiting.store(1);
+
+        if (head_ - hdr_->tail.load() == size_ && !hdr_->closed.load())
+            futex_wait(&hdr_->space_seq, seq, timeout_ms);
+
+        hdr_->producer_waiting.store(0);
+        return head_ - hdr_->tail.load() < size_;
+    }
+
+    size_t shm_ring::try_read(void *data, size_t len) {
+        uint64_t head = hdr_->head.load(std::memory_order_acquire);
+        size_t n = std::min(len, (size_t) (head - tail_));
+        if (n == 0) return 0;
+
+        size_t off = tail_ & (size_ - 1);
+        size_t first = std::min(n, size_ - off);
+        memcpy(data, data_ + off, first);
+        memcpy((char *) data + first, data_, n - first);
+
+        tail_ += n;
+        hdr_->tail.store(tail_);
+
+        if (hdr_->producer_waiting.load()) {
+            hdr_->space_seq.fetch_add(1);
+            futex_wake(&hdr_->space_seq);
+        }
+
+        return n;
+    }
+
+    bool shm_ring::wait_readable(int timeout_ms) {
+        for (int i = 0; i < shm_spin; ++i) {
+            if (hdr_->head.load(std::memory_order_acquire) != tail_)
+                return true;
+            cpu_relax();
+        }
+
+        uint32_t seq = hdr_->data_seq.load();
+        hdr_->consumer_waiting.store(1);
+
+        if (hdr_->head.load() == tail_ && !hdr_->closed.load())
+            futex_wait(&hdr_->data_seq, seq, timeout_ms);
+
+        hdr_->consumer_waiting.store(0);
+        return hdr_->head.load() != tail_;
+    }
+
+    void shm_ring::close(void) {
+        if (hdr_ == nullptr) return;
+
+        hdr_->closed.store(1);
+        hdr_->data_seq.fetch_add(1);
+        hdr_->space_seq.fetch_add(1);
+        futex_wake(&hdr_->data_seq);
+        futex_wake(&hdr_->space_seq);
+    }
+
+    bool shm_ring::closed(void) {
+        return hdr_ == nullptr || hdr_->closed.load();
+    }
+
+    shm_link::~shm_link() {
+        close();
+
+        if (mem_ != nullptr) munmap(mem_, mem_size_);
+        if (creator_) shm_unlink(name_.c_str());
+    }
+
+    /** Create a shared memory region for two rings.
+     *
+     * ring_size is rounded up to a power of two.
+     */
+    std::shared_ptr<shm_link> shm_link::create(size_t ring_size,
+            const std::string &nonce) {
+        if (nonce.empty() || nonce.find('/') != std::string::npos)
+            return nullptr;
+
+        size_t size = 4096;
+        while (size < ring_size) size <<= 1;
+
+        std::shared_ptr<shm_link> link(new shm_link());
+        link->name_ = shm_link::region(nonce);
+
+        int fd = shm_open(link->name_.c_str(),
+                O_CREAT | O_EXCL | O_RDWR | O_CLOEXEC, 0600);
+        if (fd == -1) {
+            syslog(LOG_DEBUG, "shm_open %s failed %d",
+                    link->name_.c_str(), errno);
+            return nullptr;
+        }
+
+        link->creator_ = true;
+
+        bool ok = ftruncate(fd, 2 * shm_ring::footprint(size)) == 0 &&
+                link->map(fd, size, true);
+        ::close(fd);
+
+        if (!ok) return nullptr;
+        return link;
+    }
+
+    /** Map a region created by the peer.
+     *
+     * the name is unlinked once mapped, both ends hold it.
+     */
+    std::shared_ptr<shm_link> shm_link::open(const std::string &nonce) {
+        // only ever map regions created by this library
+        if (nonce.empty() || nonce.find('/') != std::string::npos)
+            return nullptr;
+
+        const std::string name = shm_link::region(nonce);
+        int fd = shm_open(name.c_str(), O_RDWR | O_CLOEXEC, 0600);
+        if (fd == -1) {
+            syslog(LOG_DEBUG, "shm_open %s failed %d", name.c_str(), errno);
+            return nullptr;
+        }
+
+        std::shared_ptr<shm_link> link(new shm_link());
+        link->name_ = name;
+
+        bool ok = link->map(fd, 0, false);
+        ::close(fd);
+        shm_unlink(name.c_str());
+
+        if (!ok) return nullptr;
+        return link;
+    }
+
+    std::string shm_link::region(const std::string &nonce) {
+        return shm_prefix + nonce;
+    }
+
+    /* ring 0 carries client to server, ring 1 server to
+     * client. the creator initializes both headers. */
+    bool shm_link::map(int fd, size_t ring_size, bool init) {
+        struct stat st;
+        if (fstat(fd, &st) == -1) return false;
+
+        mem_size_ = st.st_size;
+        mem_ = mmap(nullptr, mem_size_, PROT_READ | PROT_WRITE,
+                MAP_SHARED, fd, 0);
+        if (mem_ == MAP_FAILED) {
+            mem_ = nullptr;
+            return false;
+        }
+
+        if (!init) {
+            ring_size = ((shm_ring_header *) mem_)->size;
+            if (ring_size == 0 || (ring_size & (ring_size - 1)) ||
+                    2 * shm_ring::footprint(ring_size) != mem_size_)
+                return false;
+        }
+
+        char *ring0 = (char *) mem_;
+        char *ring1 = ring0 + shm_ring::footprint(ring_size);
+
+        if (init) {
+            tx_.attach(ring0, ring_size, true);
+            rx_.attach(ring1, ring_size, true);
+        } else {
+            rx_.attach(ring0, ring_size, false);
+            tx_.attach(ring1, ring_size, false);
+        }
+
+        return true;
+    }
+
+    /* a crashed peer never sets the closed flag, the
+     * connection it came in on tells us instead */
+    bool shm_link::peer_alive(void) {
+        if (socket_ < 0) return true;
+
+        pollfd pfd;
+        pfd.fd = socket_;
+        pfd.events = POLLRDHUP;
+        pfd.revents = 0;
+
+        if (poll(&pfd, 1, 0) <= 0) return true;
+        return !(pfd.revents & (POLLRDHUP | POLLHUP | POLLERR | POLLNVAL));
+    }
+
+    size_t shm_link::write(const void *data, size_t len) {
+        size_t written = 0;
+
+        while (written < len) {
+            written += tx_.try_write((const char *) data + written,
+                    len - written);
+            if (written == len) break;
+
+            // ring full, let the consumer see what we have
+            tx_.publish();
+            if (tx_.closed() || rx_.closed()) break;
+            if (!tx_.wait_writable(100) && !peer_alive()) break;
+        }
+
+        return written;
+    }
+
+    void shm_link::flush(void) {
+        tx_.publish();
+    }
+
+    bool shm_link::fill(std::function<bool(void) > &stop) {
+        while (true) {
+            rx_len_ = rx_.try_read(rx_buf_, sizeof (rx_buf_));
+            rx_pos_ = 0;
+            if (rx_len_ > 0) return true;
+
+            if (rx_.closed()) return false;
+            if (!rx_.wait_readable(100)) {
+                if (stop && stop()) return false;
+                if (!peer_alive()) return false;
+            }
+        }
+    }
+
+    size_t shm_link::read(void *data, size_t len,
+            std::function<bool(void) > stop) {
+        size_t done = 0;
+
+        while (done < len) {
+            if (rx_pos_ == rx_len_ && !fill(stop)) break;
+
+            size_t n = std::min(len - done, rx_len_ - rx_pos_);
+            memcpy((char *) data + done, rx_buf_ + rx_pos_, n);
+            rx_pos_ += n;
+            done += n;
+        }
+
+        return done;
+    }
+
+    bool shm_link::readline(std::string &line, char eol,
+            std::function<bool(void) > stop) {
+
+        while (true) {
+            if (rx_pos_ == rx_len_ && !fill(stop)) return false;
+
+            const char *start = rx_buf_ + rx_pos_;
+            const char *end = (const char *) memchr(start, eol,
+                    rx_len_ - rx_pos_);
+
+            size_t n = end ? end - start + 1 : rx_len_ - rx_pos_;
+            line.append(start, n);
+            rx_pos_ += n;
+
+            if (end) return true;
+        }
+    }
+
+    void shm_link::close(void) {
+        tx_.close();
+        rx_.close();
+    }
+
+    bool shm_link::closed(void) {
+        return tx_.closed() || rx_.closed();
+    }
+
+    bool same_host(int socket) {
+        sockaddr_storage local, peer;
+        socklen_t llen = sizeof (local), plen = sizeof (peer);
+
+        if (getsockname(socket, (sockaddr *) &local, &llen) == -1 ||
+                getpeername(socket, (sockaddr *) &peer, &plen) == -1)
+            return false;
+
+        if (local.ss_family == AF_UNIX) return true;
+        if (local.ss_family != peer.ss_family) return false;
+
+        if (peer.ss_family == AF_INET) {
+            in_addr_t l = ((sockaddr_in *) &local)->sin_addr.s_addr;
+            in_addr_t p = ((sockaddr_in *) &peer)->sin_addr.s_addr;
+            return l == p || (ntohl(p) >> 24) == 127;
+        }
+
+        if (peer.ss_family == AF_INET6) {
+            const in6_addr &l = ((sockaddr_in6 *) &local)->sin6_addr;
+            const in6_addr &p = ((sockaddr_in6 *) &peer)->sin6_addr;
+            return IN6_ARE_ADDR_EQUAL(&l, &p) || IN6_IS_ADDR_LOOPBACK(&p);
+        }
+
+        return false;
+    }
+
+    std::string shm_nonce(void) {
+        // random_device reads the kernel's generator, not a seeded one
+        std::random_device rd;
+        static const char hex[] = "0123456789abcdef";
+
+        std::string nonce;
+        for (int i = 0; i < 4; ++i) {
+            uint32_t bits = rd();
+            for (int j = 0; j < 8; ++j, bits >>= 4) nonce += hex[bits & 0xf];
+        }
+
+        return nonce;
+    }
+}
@@ -0,0 +1,144 @@
+/*
+ * socket
+ * Copyright (C) log2 2013 - Present <aaron.hebert@log2.co>
+ *
+ * log2sockets is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * log2sockets is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <chrono>
+#include <cerrno>
+#include <syslog.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/tcp.h>
+#include "sockopt.h"
+
+namespace tcp {
+
+    // spinning only helps if the peer can run meanwhile
+    static const bool can_spin = sysconf(_SC_NPROCESSORS_ONLN) > 1;
+
+    sock_options profile_options(sock_profile profile) {
+        sock_options opts;
+        opts.nodelay = -1;
+        opts.quickack = -1;
+        opts.busy_poll_us = -1;
+        opts.priority = -1;
+        opts.tos = -1;
+        opts.notsent_lowat = -1;
+        opts.sndbuf = -1;
+        opts.rcvbuf = -1;
+        opts.spin_us = 0;
+
+        switch (profile) {
+            case sock_profile::DEFAULT:
+                // request/reply lines, never wait on Nagle
+                opts.nodelay = 1;
+                break;
+            case sock_profile::LOW_LATENCY:
+                opts.nodelay = 1;
+                opts.quickack = 1;
+                opts.busy_poll_us = 50;
+                // highest priority without CAP_NET_ADMIN
+                opts.priority = 6;
+                opts.tos = IPTOS_LOWDELAY;
+                // keep the send queue short, data waits in our buffers
+                opts.notsent_lowat = 16 * 1024;
+                opts.spin_us = 50;
+                break;
+            case sock_profile::BULK:
+                opts.nodelay = 0;
+                opts.tos = IPTOS_THROUGHPUT;
+                opts.sndbuf = 4 * 1024 * 1024;
+                opts.rcvbuf = 4 * 1024 * 1024;
+                break;
+        }
+
+        return opts;
+    }
+
+    static bool set_option(int socket, int level, int name, int value,
+            const char *what) {
+        if (value < 0) return true;
+
+        if (setsockopt(socket, level, name,
+                (char *) &value, sizeof (value)) == -1) {
+            syslog(LOG_DEBUG, "unable to set %s on %d: %d", what, socket, errno);
+            return false;
+        }
+
+        return true;
+    }
+
+    bool apply_sock_options(int socket, const sock_options &opts) {
+        sockaddr_storage addr;
+        socklen_t len = sizeof (addr);
+        if (getsockname(socket, (sockaddr *) &addr, &len) == -1)
+            return false;
+
+        bool ok = true;
+        ok &= set_option(socket, SOL_SOCKET, SO_SNDBUF, opts.sndbuf, "SO_SNDBUF");
+        ok &= set_option(socket, SOL_SOCKET, SO_RCVBUF, opts.rcvbuf, "SO_RCVBUF");
+        ok &= set_option(socket, SOL_SOCKET, SO_PRIORITY, opts.priority, "SO_PRIORITY");
+
+        if (addr.ss_family != AF_INET && addr.ss_family != AF_INET6)
+            return ok;
+
+#ifdef SO_BUSY_POLL
+        ok &= set_option(socket, SOL_SOCKET, SO_BUSY_POLL,
+                opts.busy_poll_us, "SO_BUSY_POLL");
+#endif
+        ok &= set_option(socket, IPPROTO_TCP, TCP_NODELAY, opts.nodelay, "TCP_NODELAY");
+        ok &= set_option(socket, IPPROTO_TCP, TCP_QUICKACK, opts.quickack, "TCP_QUICKACK");
+#ifdef TCP_NOTSENT_LOWAT
+        ok &= set_option(socket, IPPROTO_TCP, TCP_NOTSENT_LOWAT,
+                opts.notsent_lowat, "TCP_NOTSENT_LOWAT");
+#endif
+
+        if (addr.ss_family == AF_INET6)
+            ok &= set_option(socket, IPPROTO_IPV6, IPV6_TCLASS, opts.tos, "IPV6_TCLASS");
+        else
+            ok &= set_option(socket, IPPROTO_IP, IP_TOS, opts.tos, "IP_TOS");
+
+        return ok;
+    }
+
+    void rearm_quickack(int socket, const sock_options &opts) {
+        if (opts.quickack <= 0) return;
+
+        int option = 1;
+        setsockopt(socket, IPPROTO_TCP, TCP_QUICKACK,
+                (char *) &option, sizeof (option));
+    }
+
+    bool spin_readable(int socket, uint32_t spin_us) {
+        if (spin_us == 0 || !can_spin) return false;
+
+        const std::chrono::steady_clock::time_point end =
+                std::chrono::steady_clock::now() +
+                std::chrono::microseconds(spin_us);
+
+        char byte;
+        do {
+            ssize_t n = recv(socket, &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+            if (n >= 0) return true;
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                return true;
+        } while (std::chrono::steady_clock::now() < end);
+
+        return false;
+    }
+}
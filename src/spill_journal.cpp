@@ -0,0 +1,231 @@
+/*
+ * socket
+ * Copyright (C) log2 2013 - Present <aaron.hebert@log2.co>
+ *
+ * log2sockets is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * log2sockets is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <vector>
+#include <cstring>
+#include <cstdlib>
+#include <syslog.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "spill_journal.h"
+
+namespace tcp {
+
+    static const uint64_t SPILL_MAGIC = 0x6c6f67327370696cULL;
+    static const char SPILL_PREFIX[] = "spill.";
+
+    spill_journal::spill_journal(const std::string &dir, size_t max_bytes,
+            size_t segment_bytes) :
+    dir_(dir),
+    max_bytes_(max_bytes),
+    segment_bytes_(segment_bytes),
+    next_id_(0),
+    bytes_(0),
+    records_(0) {
+    }
+
+    spill_journal::~spill_journal() {
+        for (auto &s : segments_) munmap(s.mem, segment_bytes_);
+    }
+
+    std::string spill_journal::path(uint64_t id) const {
+        return dir_ + "/" + SPILL_PREFIX + std::to_string(id);
+    }
+
+    /** Map the journal's segments.
+     *
+     * segments of an earlier process, same segment size,
+     * are resumed oldest first.
+     */
+    bool spill_journal::open(void) {
+        if (segment_bytes_ <= sizeof (head) + sizeof (uint32_t)) return false;
+
+        mkdir(dir_.c_str(), 0700);
+
+        DIR *d = opendir(dir_.c_str());
+        if (d == nullptr) {
+            syslog(LOG_DEBUG, "spill journal: can not open %s", dir_.c_str());
+            return false;
+        }
+
+        std::vector<uint64_t> ids;
+        while (dirent *e = readdir(d)) {
+            if (strncmp(e->d_name, SPILL_PREFIX, sizeof (SPILL_PREFIX) - 1))
+                continue;
+
+            char *end;
+            uint64_t id = strtoull(e->d_name + sizeof (SPILL_PREFIX) - 1, &end, 10);
+            if (*end == '\0') ids.push_back(id);
+        }
+        closedir(d);
+
+        std::sort(ids.begin(), ids.end());
+        for (uint64_t id : ids) {
+            if (!spill_journal::map(id, false)) {
+                syslog(LOG_DEBUG, "spill journal: skipping segment %lu",
+                        (unsigned long) id);
+                continue;
+            }
+
+            // count what is left to send
+            const segment &s = segments_.back();
+            for (uint64_t at = s.h->start; at < s.h->end;) {
+                uint32_t len;
+                memcpy(&len, s.mem + at, sizeof (len));
+                at += sizeof (len) + len;
+                bytes_ += len;
+                ++records_;
+            }
+        }
+
+        if (!ids.empty()) next_id_ = ids.back() + 1;
+        return true;
+    }
+
+    bool spill_journal::map(uint64_t id, bool create) {
+        std::string file = spill_journal::path(id);
+
+        int fd = ::open(file.c_str(), O_RDWR | O_CLOEXEC |
+                (create ? O_CREAT | O_EXCL : 0), 0600);
+        if (fd == -1) return false;
+
+        struct stat st;
+        if (create ? ftruncate(fd, segment_bytes_) != 0 :
+                fstat(fd, &st) != 0 || (size_t) st.st_size != segment_bytes_) {
+            close(fd);
+            if (create) unlink(file.c_str());
+            return false;
+        }
+
+        void *mem = mmap(nullptr, segment_bytes_, PROT_READ | PROT_WRITE,
+                MAP_SHARED, fd, 0);
+        close(fd);
+        if (mem == MAP_FAILED) {
+            if (create) unlink(file.c_str());
+            return false;
+        }
+
+        segment s;
+        s.id = id;
+        s.mem = (char *) mem;
+        s.h = (head *) mem;
+
+        if (create) {
+            s.h->end = sizeof (head);
+            s.h->start = sizeof (head);
+            s.h->magic = SPILL_MAGIC;
+        } else if (s.h->magic != SPILL_MAGIC || s.h->start > s.h->end ||
+                s.h->end > segment_bytes_) {
+            munmap(mem, segment_bytes_);
+            return false;
+        }
+
+        segments_.push_back(s);
+        return true;
+    }
+
+    /** Append a record.
+     *
+     * the payload is copied before the end moves past it,
+     * a crash never leaves a torn record behind the end.
+     */
+    bool spill_journal::append(const void *data, size_t len) {
+        const size_t need = sizeof (uint32_t) + len;
+        if (need > segment_bytes_ - sizeof (head)) return false;
+
+        if (segments_.empty() ||
+                segments_.back().h->end + need > segment_bytes_) {
+            if ((segments_.size() + 1) * segment_bytes_ > max_bytes_)
+                return false;
+            if (!spill_journal::map(next_id_++, true)) {
+                syslog(LOG_DEBUG, "spill journal: no new segment in %s",
+                        dir_.c_str());
+                return false;
+            }
+        }
+
+        segment &s = segments_.back();
+        uint32_t len32 = (uint32_t) len;
+        memcpy(s.mem + s.h->end, &len32, sizeof (len32));
+        memcpy(s.mem + s.h->end + sizeof (len32), data, len);
+        __atomic_store_n(&s.h->end, s.h->end + need, __ATOMIC_RELEASE);
+
+        bytes_ += len;
+        ++records_;
+        return true;
+    }
+
+    size_t spill_journal::peek(std::string &out, size_t max_bytes) {
+        size_t n = 0;
+        size_t taken = 0;
+
+        for (const segment &s : segments_) {
+            for (uint64_t at = s.h->start; at < s.h->end;) {
+                uint32_t len;
+                memcpy(&len, s.mem + at, sizeof (len));
+
+                // at least one record, however large
+                if (n > 0 && taken + len > max_bytes) return n;
+
+                out.append(s.mem + at + sizeof (len), len);
+                taken += len;
+                at += sizeof (len) + len;
+                ++n;
+            }
+        }
+
+        return n;
+    }
+
+    void spill_journal::pop(size_t records) {
+        while (records > 0 && !segments_.empty()) {
+            segment &s = segments_.front();
+
+            while (records > 0 && s.h->start < s.h->end) {
+                uint32_t len;
+                memcpy(&len, s.mem + s.h->start, sizeof (len));
+                s.h->start += sizeof (len) + len;
+                bytes_ -= len;
+                --records_;
+                --records;
+            }
+
+            // drained, the last segment is kept for appends
+            if (s.h->start == s.h->end && segments_.size() > 1)
+                spill_journal::unlink_front();
+            else break;
+        }
+
+        // all sent, start over in the same segment
+        if (records_ == 0 && !segments_.empty()) {
+            head *h = segments_.front().h;
+            h->start = h->end = sizeof (head);
+        }
+    }
+
+    void spill_journal::unlink_front(void) {
+        segment &s = segments_.front();
+        munmap(s.mem, segment_bytes_);
+        unlink(spill_journal::path(s.id).c_str());
+        segments_.pop_front();
+    }
+}
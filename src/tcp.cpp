@@ -22,26 +22,142 @@
 #include <cstring>
 #include <unistd.h>
 #include <memory>
+#include <mutex>
+#include <signal.h>
 #include <netinet/tcp.h>
 #include <sys/ioctl.h>
+
+// linux 4.11, older headers lack it
+#ifndef TCP_FASTOPEN_CONNECT
+#define TCP_FASTOPEN_CONNECT 30
+#endif
 #include "tcp.h"
+#include "unix.h"
 #include "server.h"
 
 namespace tcp {
 
     char EOL = '\n';
+    char CTL = '\x01';
+
+    // request timeout hit, unblock the reader
+    static void expire_read(void *arg) {
+        ip_point *ep = (ip_point *) arg;
+        syslog(LOG_DEBUG, "request timeout on %d", ep->socket_);
+        ::shutdown(ep->socket_, SHUT_RDWR);
+        if (ep->shm) ep->shm->close();
+    }
+
+    /* linger expired, flush what the batch holds. never waits
+     * on the socket lock or a full tx queue from the wheel
+     * thread, tries again on the next tick instead. */
+    void socket::expire_linger(void *arg) {
+        socket *s = (socket *) arg;
+        ip_point &ep = *s->ip_endpoint_;
+
+        if (!s->write_mutex_.try_lock()) {
+            timer_wheel::shared().arm(ep.linger, 1, expire_linger, arg);
+            return;
+        }
+
+        // flushed or disconnected while this fire was pending
+        if (!ep.linger_armed) {
+            s->unlock();
+            return;
+        }
+
+        if (ep.txq && !ep.txq->writable()) {
+            s->unlock();
+            timer_wheel::shared().arm(ep.linger, 1, expire_linger, arg);
+            return;
+        }
+
+        /* writable() leaves room below the high watermark, not
+         * for the whole batch. a push that would wait stalls
+         * every timer, the batch stays until there is room. */
+        if (ep.txq && !ep.tx_pending.empty()) {
+            auto pending = std::make_shared<std::string>();
+            pending->swap(ep.tx_pending);
+
+            if (!ep.txq->try_push(pending) && !ep.txq->closed()) {
+                ep.tx_pending.swap(*pending);
+                s->unlock();
+                timer_wheel::shared().arm(ep.linger, 1, expire_linger, arg);
+                return;
+            }
+        }
+
+        ep.linger_armed = false;
+        ep.tx_batch_bytes = 0;
+        ep.tx_batch_msgs = 0;
+
+        if (ep.shm) {
+            ep.shm->flush();
+        } else if (ep.tx && !ep.txq) {
+            fflush(ep.tx);
+        }
+        s->unlock();
+    }
+
+    /* arms the request timeout for the scope of a blocking
+     * read. nested reads (readline -> read8 -> read) share
+     * the outermost deadline. */
+    class read_deadline {
+    public:
+
+        read_deadline(ip_point &ep, uint32_t ms) : ep_(ep), owner_(false) {
+            if (ms == 0 || timer_wheel::shared().armed(ep_.deadline)) return;
+            owner_ = true;
+            timer_wheel::shared().arm(ep_.deadline, ms, expire_read, &ep_);
+        }
+
+        ~read_deadline() {
+            if (owner_) timer_wheel::shared().cancel(ep_.deadline);
+        }
+
+    private:
+        ip_point &ep_;
+        bool owner_;
+    };
 
     socket::socket(const socket& orig) {
     }
 
     socket::~socket() {
+        if (ip_endpoint_) timer_wheel::shared().cancel(ip_endpoint_->linger);
         reset();
     }
 
+    /* a stdio write to a peer that went away raises SIGPIPE,
+     * which ends the process by default. the library sees
+     * such writes fail instead; a handler the application
+     * installed is left in place. */
+    static void ignore_sigpipe(void) {
+        static std::once_flag once;
+        std::call_once(once, [] {
+            struct sigaction sa;
+            if (sigaction(SIGPIPE, nullptr, &sa) == 0 && sa.sa_handler == SIG_DFL)
+                signal(SIGPIPE, SIG_IGN);
+        });
+    }
+
     socket::socket(std::string key, auth auth_) :
-    lock_interval_(10) {
+    lock_interval_(10),
+    tx_low_(0),
+    tx_high_(0),
+    tx_policy_(tx_policy::BLOCK),
+    fast_open_(0),
+    sock_opts_(profile_options(sock_profile::DEFAULT)),
+    flush_bytes_(0),
+    flush_msgs_(0),
+    flush_linger_us_(0) {
+        shm_size_ = 0;
+        request_timeout_ms_ = 0;
+        peer_cred_ = false;
+        peer_uid_ = geteuid();
         reset();
         auth_type_ = auth_;
+        ignore_sigpipe();
 
         switch (auth_) {
             case auth::MD5:
@@ -63,6 +179,8 @@ namespace tcp {
     void socket::reset(void) {
         if (ip_endpoint_.get() == nullptr) return;
 
+        // the queue stops writing while the socket is still ours
+        if (ip_endpoint_->txq) ip_endpoint_->txq->close();
         if (ip_endpoint_->socket_ > 0)
             close(ip_endpoint_->socket_);
         memset(&ip_endpoint_->hints, 0, sizeof (addrinfo));
@@ -75,6 +193,23 @@ namespace tcp {
      */
     bool socket::get_addr_info(const std::string host, const std::string port) {
 
+        // same host IPC, skip the loopback TCP stack
+        if (is_unix_host(host)) {
+            socklen_t len;
+            if (!unix_addr(unix_host_path(host), ip_endpoint_->unix_addr, len))
+                return false;
+
+            memset(&ip_endpoint_->unix_info, 0, sizeof (addrinfo));
+            ip_endpoint_->unix_info.ai_family = AF_UNIX;
+            ip_endpoint_->unix_info.ai_socktype = SOCK_STREAM;
+            ip_endpoint_->unix_info.ai_addr = \
+                    (sockaddr *) &ip_endpoint_->unix_addr;
+            ip_endpoint_->unix_info.ai_addrlen = len;
+            ip_endpoint_->results = &ip_endpoint_->unix_info;
+
+            return true;
+        }
+
         ip_endpoint_->hints.ai_family = AF_UNSPEC; // ipv4 or ipv6
         ip_endpoint_->hints.ai_socktype = SOCK_STREAM; // tcp
         ip_endpoint_->hints.ai_flags = AI_PASSIVE;
@@ -97,6 +232,13 @@ namespace tcp {
         return true;
     }
 
+    void socket::free_addr_info(void) {
+        if (ip_endpoint_->results != &ip_endpoint_->unix_info)
+            freeaddrinfo(ip_endpoint_->results);
+
+        ip_endpoint_->results = nullptr;
+    }
+
     /** Creates socket and connects.
      *
      * creates socket and initiates tcp connection.
@@ -120,6 +262,18 @@ namespace tcp {
             if (ip_endpoint_->socket_ == -1)
                 continue;
 
+            // before connect(), buffer sizes set the window scale
+            apply_sock_options(ip_endpoint_->socket_, sock_opts_);
+
+            /* connect() returns at once and the handshake
+             * rides on the first flush, the auth token */
+            if (fast_open_ > 0 && ip_endpoint_->rp->ai_family != AF_UNIX) {
+                int option = 1;
+                setsockopt(ip_endpoint_->socket_,
+                        IPPROTO_TCP, TCP_FASTOPEN_CONNECT,
+                        (char *) &option, sizeof (option));
+            }
+
             // attempt to connect
             if (::connect(ip_endpoint_->socket_,
                     ip_endpoint_->rp->ai_addr,
@@ -144,11 +298,18 @@ namespace tcp {
 
         if (ip_endpoint_->rp == nullptr) {
             syslog(LOG_DEBUG, "unable to allocate interface to destination host");
+            free_addr_info();
             return false;
         }
 
         // free results
-        freeaddrinfo(ip_endpoint_->results);
+        free_addr_info();
+
+        if (tx_high_ > 0) {
+            ip_endpoint_->txq = std::make_shared<tx_queue>(
+                    ip_endpoint_->socket_, tx_low_, tx_high_, tx_policy_);
+            ip_endpoint_->txq->set_writable_handler(on_writable_);
+        }
 
         // open stream for write
         if (nullptr == (ip_endpoint_->tx = \
@@ -170,14 +331,38 @@ namespace tcp {
     }
 
     void socket::disconnect(void) {
+        /* the write side is taken apart under the write lock,
+         * a linger firing late finds it disarmed and no
+         * stream to flush */
+        this->lock();
+        // safe under the lock, expire_linger() never waits on it
+        timer_wheel::shared().cancel(ip_endpoint_->linger);
+        ip_endpoint_->linger_armed = false;
+        ip_endpoint_->tx_batch_bytes = 0;
+        ip_endpoint_->tx_batch_msgs = 0;
+
+        std::shared_ptr<shm_link> shm;
+        shm.swap(ip_endpoint_->shm);
+        std::shared_ptr<tx_queue> txq;
+        txq.swap(ip_endpoint_->txq);
+        ip_endpoint_->tx_pending.clear();
+        FILE *tx = ip_endpoint_->tx;
+        ip_endpoint_->tx = nullptr;
+        this->unlock();
+
+        // the drain may call back into write(), not under the lock
+        if (shm) shm->close();
+        if (txq) txq->close(true);
+
         close(ip_endpoint_->socket_);
-        if (ip_endpoint_->tx)
-            fclose(ip_endpoint_->tx);
+        if (tx)
+            fclose(tx);
         if (ip_endpoint_->rx)
             fclose(ip_endpoint_->rx);
 
         ip_endpoint_->rx = nullptr;
-        ip_endpoint_->tx = nullptr;
+        // the number may be reused, reset() must not close it again
+        ip_endpoint_->socket_ = 0;
     }
 
     /** Resize tx socket buffer size.
@@ -210,6 +395,107 @@ namespace tcp {
         return ret_val;
     }
 
+    void socket::use_shm(size_t ring_size) {
+        shm_size_ = ring_size;
+    }
+
+    /** Offer shared memory rings to the server.
+     *
+     * the region is named in a control line, the server
+     * answers with '1' once it has mapped it.
+     */
+    bool socket::negotiate_shm(void) {
+        if (shm_size_ == 0 || !connected()) return false;
+        if (ip_endpoint_->shm) return true;
+        if (!same_host(ip_endpoint_->socket_)) return false;
+
+        // the server names the region, it maps no other
+        std::string ask;
+        ask += CTL;
+        ask += (char) control::SHM;
+        ask += 'N';
+        ask += EOL;
+
+        this->write(ask);
+        this->send();
+
+        std::string answer = this->readline();
+        if (answer.size() < 4 || answer[0] != CTL ||
+                answer[1] != (char) control::SHM || answer[2] != 'N')
+            return false;
+
+        std::shared_ptr<shm_link> link = shm_link::create(shm_size_,
+                answer.substr(3, answer.size() - 4));
+        if (!link) return false;
+
+        std::string offer;
+        offer += CTL;
+        offer += (char) control::SHM;
+        offer += link->name();
+        offer += EOL;
+
+        this->write(offer);
+        this->send();
+
+        answer = this->readline();
+        if (answer.size() < 3 || answer[0] != CTL ||
+                answer[1] != (char) control::SHM || answer[2] != '1')
+            return false;
+
+        link->set_socket(ip_endpoint_->socket_);
+        ip_endpoint_->shm = link;
+
+        return true;
+    }
+
+    void socket::set_peer_cred(bool enable, uid_t uid) {
+        peer_cred_ = enable;
+        peer_uid_ = uid;
+    }
+
+    /* a blocking read holds the socket lock, so a batch left
+     * pending could never go out while we wait for its reply.
+     */
+    void socket::flush_for_read(void) {
+        if (!flush_bytes_ && !flush_msgs_ && !flush_linger_us_) return;
+
+        this->lock();
+        bool pending = ip_endpoint_->tx_batch_msgs > 0 &&
+                !ip_endpoint_->rx_pending();
+        this->unlock();
+
+        if (pending) this->tx_flush();
+    }
+
+    void socket::set_flush_policy(size_t bytes, size_t msgs,
+            uint32_t linger_us) {
+        flush_bytes_ = bytes;
+        flush_msgs_ = msgs;
+        flush_linger_us_ = linger_us;
+    }
+
+    void socket::tx_queue_budget(size_t low, size_t high, tx_policy policy) {
+        tx_low_ = low;
+        tx_high_ = high;
+        tx_policy_ = policy;
+    }
+
+    void socket::set_writable_callback(writable_handler handler) {
+        on_writable_ = handler;
+
+        if (ip_endpoint_ && ip_endpoint_->txq)
+            ip_endpoint_->txq->set_writable_handler(handler);
+    }
+
+    /** Check tx queue is below its high watermark.
+     *
+     * always true without a tx queue budget.
+     */
+    bool socket::writable(void) {
+        if (!ip_endpoint_ || !ip_endpoint_->txq) return true;
+        return ip_endpoint_->txq->writable();
+    }
+
     /** Check for stream == 'nullptr' and socket fd == 0.
      *
      * if either FILE stream == nullptr return false.
@@ -239,8 +525,21 @@ namespace tcp {
 
         if (!connected()) return tcp::EOL;
 
+        this->flush_for_read();
+        read_deadline deadline(*ip_endpoint_, request_timeout_ms_);
+
         this->lock();
-        std::size_t size_ = fread(data, size, count, ip_endpoint_->rx);
+        std::size_t size_;
+        if (ip_endpoint_->shm) {
+            size_ = ip_endpoint_->shm->read(data, size * count) / size;
+        } else {
+            // spin before fread() would sleep in recv()
+            if (sock_opts_.spin_us > 0 && !ip_endpoint_->rx_pending()) {
+                spin_readable(ip_endpoint_->socket_, sock_opts_.spin_us);
+                rearm_quickack(ip_endpoint_->socket_, sock_opts_);
+            }
+            size_ = fread(data, size, count, ip_endpoint_->rx);
+        }
         this->unlock();
 
         return size_;
@@ -250,6 +549,18 @@ namespace tcp {
         if (!connected()) return std::string((const char *) &tcp::EOL);
 
         std::string read_string;
+        read_deadline deadline(*ip_endpoint_, request_timeout_ms_);
+
+        if (ip_endpoint_->shm) {
+            this->flush_for_read();
+            this->lock();
+            // peer gone, connected() turns false
+            if (!ip_endpoint_->shm->readline(read_string, tcp::EOL))
+                ip_endpoint_->shm->close();
+            this->unlock();
+
+            return read_string;
+        }
 
         do {
             read_string += this->read8();
@@ -288,7 +599,8 @@ namespace tcp {
         return u64;
     }
 
-    /* must delete[] returned array
+    /* must delete[] returned array,
+     * see read128(uint64_t (&)[2])
      */
     uint128_t socket::read128(void) {
         if (!connected()) return nullptr;
@@ -297,6 +609,47 @@ namespace tcp {
         return u128;
     }
 
+    size_t socket::read128(uint64_t (&bytes16)[2]) {
+        if (!connected()) return 0;
+        return this->read(bytes16, sizeof (bytes16), 1);
+    }
+
+    /** Borrow size bytes of the rx stream.
+     *
+     * when the stdio buffer already holds the whole message
+     * the pointer is into it and nothing is copied. otherwise
+     * the message is read into the endpoint's scratch buffer,
+     * which only grows, so steady state never allocates.
+     */
+    const uint8_t *socket::read_view(size_t size) {
+        if (!connected()) return nullptr;
+
+        this->flush_for_read();
+        read_deadline deadline(*ip_endpoint_, request_timeout_ms_);
+        std::string &scratch = ip_endpoint_->rx_scratch;
+        const uint8_t *view_ = nullptr;
+
+        this->lock();
+        if (ip_endpoint_->shm) {
+            if (scratch.size() < size) scratch.resize(size);
+            if (ip_endpoint_->shm->read(&scratch[0], size) == size)
+                view_ = (const uint8_t *) scratch.data();
+#ifdef __GLIBC__
+        } else if (ip_endpoint_->rx->_IO_read_end -
+                ip_endpoint_->rx->_IO_read_ptr >= (ssize_t) size) {
+            view_ = (const uint8_t *) ip_endpoint_->rx->_IO_read_ptr;
+            ip_endpoint_->rx->_IO_read_ptr += size;
+#endif
+        } else {
+            if (scratch.size() < size) scratch.resize(size);
+            if (fread(&scratch[0], 1, size, ip_endpoint_->rx) == size)
+                view_ = (const uint8_t *) scratch.data();
+        }
+        this->unlock();
+
+        return view_;
+    }
+
     size_t socket::write(const uint8_t *bytes, size_t length) {
         if (!connected()) return tcp::EOL;
         size_t write_ = this->write(bytes, sizeof (uint8_t), length);
@@ -310,10 +663,42 @@ namespace tcp {
     size_t socket::write(const void *data, size_t size, size_t count) {
         if (!connected()) return tcp::EOL;
         this->lock();
-        size_t write_ = fwrite(data, size, count,
-                ip_endpoint_->tx);
+        // disconnect() may have run since connected()
+        if (ip_endpoint_->tx == nullptr) {
+            this->unlock();
+            return tcp::EOL;
+        }
+        size_t write_ = count;
+        if (ip_endpoint_->shm) {
+            write_ = ip_endpoint_->shm->write(data, size * count) / size;
+        } else if (ip_endpoint_->txq) {
+            ip_endpoint_->tx_pending.append((const char *) data,
+                    size * count);
+        } else {
+            write_ = fwrite(data, size, count,
+                    ip_endpoint_->tx);
+        }
+
+        // each write() call is one message of the batch
+        bool flush_now = false;
+        if (flush_bytes_ || flush_msgs_ || flush_linger_us_) {
+            ip_point &ep = *ip_endpoint_;
+            ep.tx_batch_bytes += size * count;
+            ++ep.tx_batch_msgs;
+
+            flush_now = (flush_bytes_ && ep.tx_batch_bytes >= flush_bytes_) ||
+                    (flush_msgs_ && ep.tx_batch_msgs >= flush_msgs_);
+
+            if (!flush_now && flush_linger_us_ && !ep.linger_armed) {
+                ep.linger_armed = true;
+                timer_wheel::shared().arm(ep.linger,
+                        (flush_linger_us_ + 999) / 1000, expire_linger, this);
+            }
+        }
         this->unlock();
 
+        if (flush_now) this->tx_flush();
+
         return write_;
     }
 
@@ -333,10 +718,8 @@ namespace tcp {
             uint8_t byte4) {
         if (!connected()) return tcp::EOL;
 
-        this->lock();
-        size_t write_ = fprintf(ip_endpoint_->tx,
-                "%c%c%c%c", byte1, byte2, byte3, byte4);
-        this->unlock();
+        const uint8_t bytes[] = {byte1, byte2, byte3, byte4};
+        size_t write_ = this->write(bytes, sizeof (bytes));
 
         return write_;
     }
@@ -369,23 +752,17 @@ namespace tcp {
 
     size_t socket::write24(uint8_t byte1, uint8_t byte2, uint8_t byte3) {
         if (!connected()) return tcp::EOL;
-        this->lock();
-        size_t write_ = fprintf(ip_endpoint_->tx,
-                "%c%c%c", byte1, byte2, byte3);
-        this->unlock();
+        const uint8_t bytes[] = {byte1, byte2, byte3};
+        size_t write_ = this->write(bytes, sizeof (bytes));
         return write_;
     }
 
-    /** Format data to tx stream.
-     *
-     * calls fprintf() on tx stream.
+    /** Write raw bytes to tx stream.
      */
     size_t socket::write16(uint8_t byte1, uint8_t byte2) {
         if (!connected()) return tcp::EOL;
-        this->lock();
-        size_t write_ = fprintf(ip_endpoint_->tx,
-                "%c%c", byte1, byte2);
-        this->unlock();
+        const uint8_t bytes[] = {byte1, byte2};
+        size_t write_ = this->write(bytes, sizeof (bytes));
         return write_;
     }
 
@@ -404,7 +781,35 @@ namespace tcp {
         if (!connected()) return EOF;
 
         this->lock();
-        int rc = fflush(ip_endpoint_->tx);
+        if (ip_endpoint_->tx == nullptr) {
+            this->unlock();
+            return EOF;
+        }
+        int rc = 0;
+        ip_endpoint_->tx_batch_bytes = 0;
+        ip_endpoint_->tx_batch_msgs = 0;
+        if (ip_endpoint_->linger_armed) {
+            // safe under the lock, expire_linger() never waits on it
+            timer_wheel::shared().cancel(ip_endpoint_->linger);
+            ip_endpoint_->linger_armed = false;
+        }
+        if (ip_endpoint_->shm) {
+            ip_endpoint_->shm->flush();
+            this->unlock();
+            return rc;
+        }
+        if (ip_endpoint_->txq) {
+            /* queue collected writes as one message, pushed under
+             * the lock so concurrent flushes keep their order */
+            std::string pending;
+            pending.swap(ip_endpoint_->tx_pending);
+            rc = fflush(ip_endpoint_->tx);
+
+            if (!ip_endpoint_->txq->push(pending)) rc = EOF;
+            this->unlock();
+            return rc;
+        }
+        rc = fflush(ip_endpoint_->tx);
         this->unlock();
 
         return rc;
@@ -0,0 +1,245 @@
+/*
+ * socket
+ * Copyright (C) log2 2013 - Present <aaron.hebert@log2.co>
+ *
+ * log2sockets is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * log2sockets is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "timer_wheel.h"
+
+namespace tcp {
+
+    timer_wheel::timer_wheel(uint32_t tick_ms) :
+    tick_ms_(tick_ms ? tick_ms : 1),
+    start_(std::chrono::steady_clock::now()),
+    next_(0),
+    count_(0),
+    running_(false) {
+
+        for (int l = 0; l < LEVELS; ++l) {
+            for (int s = 0; s < SLOTS; ++s) {
+                slots_[l][s].next = &slots_[l][s];
+                slots_[l][s].prev = &slots_[l][s];
+            }
+        }
+
+        expired_.reserve(SLOTS);
+    }
+
+    timer_wheel::~timer_wheel() {
+        stop();
+    }
+
+    timer_wheel &timer_wheel::shared(void) {
+        static timer_wheel wheel;
+        static std::once_flag started;
+        std::call_once(started, [] {
+            wheel.start();
+        });
+
+        return wheel;
+    }
+
+    uint64_t timer_wheel::now_ms(void) {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(
+                std::chrono::steady_clock::now() - start_).count();
+    }
+
+    uint64_t timer_wheel::ticks(void) {
+        return now_ms() / tick_ms_;
+    }
+
+    void timer_wheel::arm(timer &t, uint64_t delay_ms,
+            timer_callback callback, void *arg) {
+
+        bool was_idle;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+
+            if (t.armed()) unlink(t);
+
+            t.callback = callback;
+            t.arg = arg;
+            t.expires = ticks() + (delay_ms + tick_ms_ - 1) / tick_ms_;
+            if (t.expires < next_) t.expires = next_;
+
+            link(t);
+            was_idle = count_++ == 0;
+        }
+
+        if (was_idle) armed_cv_.notify_one();
+    }
+
+    bool timer_wheel::cancel(timer &t) {
+        std::lock_guard<std::recursive_mutex> firing(firing_);
+        std::lock_guard<std::mutex> lock(mutex_);
+
+        if (!t.armed()) return false;
+
+        unlink(t);
+        --count_;
+        return true;
+    }
+
+    size_t timer_wheel::armed(void) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return count_;
+    }
+
+    bool timer_wheel::armed(const timer &t) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return t.armed();
+    }
+
+    /* pick the level from how far out the timer is,
+     * relative to the next tick to be processed */
+    void timer_wheel::link(timer &t) {
+        uint64_t delta = t.expires - next_;
+        int level;
+
+        if (delta < (1ULL << SLOT_BITS)) level = 0;
+        else if (delta < (1ULL << (2 * SLOT_BITS))) level = 1;
+        else if (delta < (1ULL << (3 * SLOT_BITS))) level = 2;
+        else {
+            // clamp to the wheel's horizon
+            if (delta >= (1ULL << (4 * SLOT_BITS)))
+                t.expires = next_ + (1ULL << (4 * SLOT_BITS)) - 1;
+            level = 3;
+        }
+
+        timer &head = slots_[level][(t.expires >> (level * SLOT_BITS)) &
+                (SLOTS - 1)];
+
+        t.next = &head;
+        t.prev = head.prev;
+        head.prev->next = &t;
+        head.prev = &t;
+    }
+
+    void timer_wheel::unlink(timer &t) {
+        t.prev->next = t.next;
+        t.next->prev = t.prev;
+        t.next = nullptr;
+        t.prev = nullptr;
+    }
+
+    // move a slot's timers down to the levels below
+    void timer_wheel::cascade(int level, size_t slot) {
+        timer &head = slots_[level][slot];
+
+        while (head.next != &head) {
+            timer *t = head.next;
+            unlink(*t);
+            link(*t);
+        }
+    }
+
+    /* process tick next_. called with firing_ held,
+     * callbacks run without mutex_ so they can re-arm. */
+    size_t timer_wheel::run_tick(void) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+
+            size_t index = next_ & (SLOTS - 1);
+
+            if (index == 0) {
+                for (int l = 1; l < LEVELS; ++l) {
+                    size_t slot = (next_ >> (l * SLOT_BITS)) & (SLOTS - 1);
+                    cascade(l, slot);
+                    if (slot != 0) break;
+                }
+            }
+
+            timer &head = slots_[0][index];
+            while (head.next != &head) {
+                timer *t = head.next;
+                unlink(*t);
+                --count_;
+                expired_.push_back(t);
+            }
+
+            ++next_;
+        }
+
+        size_t fired = 0;
+        for (timer *t : expired_) {
+            // re-armed by an earlier callback this tick
+            if (t->armed()) continue;
+            if (t->callback != nullptr) t->callback(t->arg);
+            ++fired;
+        }
+
+        expired_.clear();
+        return fired;
+    }
+
+    size_t timer_wheel::advance(void) {
+        std::lock_guard<std::recursive_mutex> firing(firing_);
+
+        uint64_t target = ticks();
+        size_t fired = 0;
+
+        while (next_ <= target) {
+            {
+                // nothing armed, skip straight to now
+                std::lock_guard<std::mutex> lock(mutex_);
+                if (count_ == 0) {
+                    next_ = target + 1;
+                    break;
+                }
+            }
+
+            fired += run_tick();
+        }
+
+        return fired;
+    }
+
+    void timer_wheel::start(void) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (running_) return;
+
+        running_ = true;
+        driver_ = std::thread(&timer_wheel::drive, this);
+    }
+
+    void timer_wheel::stop(void) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (!running_) return;
+            running_ = false;
+        }
+
+        armed_cv_.notify_all();
+        if (driver_.joinable()) driver_.join();
+    }
+
+    // tick while timers are armed, sleep otherwise
+    void timer_wheel::drive(void) {
+        std::unique_lock<std::mutex> lock(mutex_);
+
+        while (running_) {
+            if (count_ == 0) {
+                armed_cv_.wait(lock);
+                continue;
+            }
+
+            lock.unlock();
+            std::this_thread::sleep_for(std::chrono::milliseconds(tick_ms_));
+            advance();
+            lock.lock();
+        }
+    }
+}
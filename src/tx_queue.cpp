@@ -0,0 +1,282 @@
+/*
+ * socket
+ * Copyright (C) log2 2013 - Present <aaron.hebert@log2.co>
+ *
+ * log2sockets is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * log2sockets is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <cerrno>
+#include <syslog.h>
+#include <sys/socket.h>
+#include "tx_queue.h"
+
+namespace tcp {
+
+    tx_queue::tx_queue(int socket, size_t low, size_t high,
+            tx_policy policy) :
+    socket_(socket),
+    low_(low),
+    high_(high),
+    policy_(policy),
+    bytes_(0),
+    dropped_(0),
+    sending_(false),
+    offset_(0),
+    writable_(true),
+    closing_(false),
+    closed_(false),
+    stopped_(false) {
+
+        if (low_ > high_) low_ = high_;
+        drain_ = std::thread(&tx_queue::drain_loop, this);
+    }
+
+    /* the owner may have closed the socket, its number may
+     * belong to another connection by now. it is not touched
+     * here, the owner close()s the queue while it is live. */
+    tx_queue::~tx_queue() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            closed_ = true;
+        }
+
+        data_cv_.notify_all();
+        space_cv_.notify_all();
+
+        if (drain_.joinable() && drain_.get_id() != std::this_thread::get_id())
+            drain_.join();
+    }
+
+    bool tx_queue::push(const std::string &str) {
+        return push(std::make_shared<const std::string>(str));
+    }
+
+    /** Queue buffer for the drain thread.
+     *
+     * applies the overflow policy when the buffer would
+     * take the queue above the high watermark.
+     */
+    bool tx_queue::push(shared_buffer buf) {
+        if (!buf || buf->empty()) return true;
+
+        std::unique_lock<std::mutex> lock(mutex_);
+        if (closed_ || closing_) return false;
+
+        const size_t size = buf->size();
+
+        if (bytes_ + size > high_) {
+            switch (policy_) {
+                case tx_policy::BLOCK:
+                    space_cv_.wait(lock, [this] {
+                        return closed_ || bytes_ <= low_;
+                    });
+                    if (closed_) return false;
+                    break;
+                case tx_policy::DROP_OLDEST:
+                {
+                    // never drop a buffer that is partly on the wire
+                    size_t keep = (sending_ || offset_ > 0) ? 1 : 0;
+                    while (bytes_ + size > high_ && queue_.size() > keep) {
+                        bytes_ -= queue_[keep]->size();
+                        queue_.erase(queue_.begin() + keep);
+                        ++dropped_;
+                    }
+                    break;
+                }
+                case tx_policy::DISCONNECT:
+                    syslog(LOG_DEBUG, "tx_queue: slow consumer, disconnecting");
+                    fail();
+                    return false;
+            }
+        }
+
+        return append(lock, buf);
+    }
+
+    /* never drops, disconnects or waits. the handler is
+     * only called for a buffer alone above the high mark */
+    bool tx_queue::try_push(shared_buffer buf) {
+        if (!buf || buf->empty()) return true;
+
+        std::unique_lock<std::mutex> lock(mutex_);
+        if (closed_ || closing_) return false;
+        if (bytes_ > 0 && bytes_ + buf->size() > high_) return false;
+
+        return append(lock, buf);
+    }
+
+    // queue buf and wake the drain thread, releases lock
+    bool tx_queue::append(std::unique_lock<std::mutex> &lock, shared_buffer buf) {
+        queue_.push_back(buf);
+        bytes_ += buf->size();
+
+        bool crossed = writable_ && bytes_ > high_;
+        if (crossed) writable_ = false;
+
+        data_cv_.notify_one();
+        lock.unlock();
+
+        if (crossed) notify(false);
+        return true;
+    }
+
+    bool tx_queue::flush(void) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        space_cv_.wait(lock, [this] {
+            return closed_ || queue_.empty();
+        });
+
+        return !closed_;
+    }
+
+    bool tx_queue::wait_space(size_t size) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        space_cv_.wait(lock, [this, size] {
+            return closed_ || closing_ || bytes_ == 0 || bytes_ + size <= high_;
+        });
+
+        return !closed_ && !closing_;
+    }
+
+    void tx_queue::close(bool drain) {
+        bool stuck;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            // a failed or drained queue no longer writes the socket
+            stuck = !closed_ && !stopped_;
+            if (drain) closing_ = true;
+            else closed_ = true;
+        }
+
+        data_cv_.notify_all();
+        space_cv_.notify_all();
+
+        // unblock a drain thread stuck on a slow peer
+        if (!drain && stuck) ::shutdown(socket_, SHUT_WR);
+
+        if (drain_.joinable() && drain_.get_id() != std::this_thread::get_id())
+            drain_.join();
+    }
+
+    void tx_queue::set_writable_handler(writable_handler handler) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        on_writable_ = handler;
+    }
+
+    void tx_queue::set_policy(tx_policy policy) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        policy_ = policy;
+    }
+
+    bool tx_queue::writable(void) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return writable_;
+    }
+
+    bool tx_queue::closed(void) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return closed_;
+    }
+
+    size_t tx_queue::pending(void) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return bytes_;
+    }
+
+    size_t tx_queue::dropped(void) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return dropped_;
+    }
+
+    void tx_queue::notify(bool writable) {
+        writable_handler handler;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            handler = on_writable_;
+        }
+
+        if (handler) handler(writable);
+    }
+
+    /* mark the queue dead and shut the socket down so the
+     * reader side of the connection sees EOF. */
+    void tx_queue::fail(void) {
+        closed_ = true;
+        ::shutdown(socket_, SHUT_RDWR);
+        data_cv_.notify_all();
+        space_cv_.notify_all();
+    }
+
+    /** Write queued buffers to the socket.
+     *
+     * the lock is released while a buffer is on the wire,
+     * producers keep queuing behind it.
+     */
+    void tx_queue::drain_loop(void) {
+        std::unique_lock<std::mutex> lock(mutex_);
+
+        while (true) {
+            data_cv_.wait(lock, [this] {
+                return closed_ || closing_ || !queue_.empty();
+            });
+
+            if (closed_) break;
+            if (queue_.empty()) {
+                if (closing_) break;
+                continue;
+            }
+
+            shared_buffer buf = queue_.front();
+            size_t offset = offset_;
+            sending_ = true;
+            lock.unlock();
+
+            ssize_t n = ::send(socket_, buf->data() + offset,
+                    buf->size() - offset, MSG_NOSIGNAL);
+
+            lock.lock();
+            sending_ = false;
+
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) {
+                syslog(LOG_DEBUG, "tx_queue: send failed %d", errno);
+                fail();
+                break;
+            }
+
+            offset_ += n;
+            bytes_ -= n;
+
+            if (offset_ == buf->size()) {
+                queue_.pop_front();
+                offset_ = 0;
+            }
+
+            bool crossed = !writable_ && bytes_ <= low_;
+            if (crossed) writable_ = true;
+
+            space_cv_.notify_all();
+
+            if (crossed) {
+                lock.unlock();
+                notify(true);
+                lock.lock();
+            }
+        }
+
+        stopped_ = true;
+        space_cv_.notify_all();
+    }
+}
@@ -0,0 +1,185 @@
+/*
+ * socket
+ * Copyright (C) log2 2013 - Present <aaron.hebert@log2.co>
+ *
+ * log2sockets is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * log2sockets is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <cerrno>
+#include <cstring>
+#include <cstddef>
+#include <syslog.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "unix.h"
+
+namespace tcp {
+
+    static const std::string unix_prefix("unix:");
+
+    bool is_unix_host(const std::string &host) {
+        return host.compare(0, unix_prefix.size(), unix_prefix) == 0;
+    }
+
+    std::string unix_host_path(const std::string &host) {
+        return host.substr(unix_prefix.size());
+    }
+
+    bool is_unix_socket(int socket) {
+        sockaddr_storage addr;
+        socklen_t len = sizeof (addr);
+
+        if (getsockname(socket, (sockaddr *) &addr, &len) == -1)
+            return false;
+
+        return addr.ss_family == AF_UNIX;
+    }
+
+    bool peer_uid_matches(int socket, uid_t uid) {
+        ucred cred;
+        socklen_t len = sizeof (cred);
+
+        if (getsockopt(socket, SOL_SOCKET, SO_PEERCRED, &cred, &len) == -1) {
+            syslog(LOG_DEBUG, "SO_PEERCRED failed %d", errno);
+            return false;
+        }
+
+        return cred.uid == uid;
+    }
+
+    /* fill sockaddr_un for path, '@' maps to the
+     * abstract namespace (leading NUL byte) */
+    bool unix_addr(const std::string &path, sockaddr_un &addr,
+            socklen_t &len) {
+
+        memset(&addr, 0, sizeof (sockaddr_un));
+        addr.sun_family = AF_UNIX;
+
+        if (path.empty() || path.size() >= sizeof (addr.sun_path)) {
+            syslog(LOG_DEBUG, "unix_addr: invalid path '%s'", path.c_str());
+            return false;
+        }
+
+        memcpy(addr.sun_path, path.data(), path.size());
+        if (path[0] == '@') addr.sun_path[0] = '\0';
+
+        len = offsetof(sockaddr_un, sun_path) + path.size();
+        if (path[0] != '@') len += 1;
+
+        return true;
+    }
+
+    int unix_listen(const std::string &path, int backlog) {
+        sockaddr_un addr;
+        socklen_t len;
+        if (!unix_addr(path, addr, len)) return -1;
+
+        int fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd == -1) return -1;
+
+        // stale socket file from a previous run
+        if (path[0] != '@') unlink(path.c_str());
+
+        if (::bind(fd, (sockaddr *) &addr, len) == -1 ||
+                ::listen(fd, backlog) == -1) {
+            syslog(LOG_DEBUG, "unix_listen: %s %d", path.c_str(), errno);
+            close(fd);
+            return -1;
+        }
+
+        return fd;
+    }
+
+    int unix_connect(const std::string &path) {
+        sockaddr_un addr;
+        socklen_t len;
+        if (!unix_addr(path, addr, len)) return -1;
+
+        int fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd == -1) return -1;
+
+        if (::connect(fd, (sockaddr *) &addr, len) == -1) {
+            syslog(LOG_DEBUG, "unix_connect: %s %d", path.c_str(), errno);
+            close(fd);
+            return -1;
+        }
+
+        return fd;
+    }
+
+    bool send_fd(int channel, char tag, int fd) {
+        msghdr msg;
+        iovec iov;
+        char control[CMSG_SPACE(sizeof (int))];
+
+        memset(&msg, 0, sizeof (msghdr));
+        memset(control, 0, sizeof (control));
+
+        iov.iov_base = &tag;
+        iov.iov_len = 1;
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+
+        if (fd >= 0) {
+            msg.msg_control = control;
+            msg.msg_controllen = sizeof (control);
+
+            cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+            cmsg->cmsg_level = SOL_SOCKET;
+            cmsg->cmsg_type = SCM_RIGHTS;
+            cmsg->cmsg_len = CMSG_LEN(sizeof (int));
+            memcpy(CMSG_DATA(cmsg), &fd, sizeof (int));
+        }
+
+        ssize_t n;
+        do {
+            n = sendmsg(channel, &msg, MSG_NOSIGNAL);
+        } while (n == -1 && errno == EINTR);
+
+        return n == 1;
+    }
+
+    bool recv_fd(int channel, char &tag, int &fd) {
+        msghdr msg;
+        iovec iov;
+        char control[CMSG_SPACE(sizeof (int))];
+
+        memset(&msg, 0, sizeof (msghdr));
+
+        iov.iov_base = &tag;
+        iov.iov_len = 1;
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof (control);
+
+        fd = -1;
+
+        ssize_t n;
+        do {
+            n = recvmsg(channel, &msg, MSG_CMSG_CLOEXEC);
+        } while (n == -1 && errno == EINTR);
+
+        if (n != 1) return false;
+
+        cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        if (cmsg != nullptr && cmsg->cmsg_level == SOL_SOCKET &&
+                cmsg->cmsg_type == SCM_RIGHTS)
+            memcpy(&fd, CMSG_DATA(cmsg), sizeof (int));
+
+        return true;
+    }
+}
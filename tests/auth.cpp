@@ -10,8 +10,25 @@
 #include <string>
 #include <thread>
 #include <unistd.h>
+#include <algorithm>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <cstring>
+#include <cstdio>
+#include <cmath>
+#include <limits>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <poll.h>
+#include <netinet/ip.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <sched.h>
 #include "server.h"
 #include "client.h"
+#include "quorum.h"
+#include "router.h"
 
 /*
  * Simple C++ Test Suite
@@ -80,6 +97,1736 @@ void test_auth_pass() {
 
 #endif
 
+#ifdef MULTI_TEST
+
+std::string control_read(std::string str) {
+    return "control: OK\n";
+}
+
+std::string data_read(std::string str) {
+    return "data: OK\n";
+}
+
+std::string multi_request(std::string key, std::string port) {
+    tcp::client c(key, tcp::auth::MD5);
+
+    if (!c.authenticate("127.0.0.1", port)) return "AUTH_FAILED\n";
+
+    c.write("multi_request\n");
+    c.send();
+    std::string reply = c.readline();
+    c.disconnect();
+
+    return reply;
+}
+
+/* two servers in one process, each with its own key,
+ * handler and kill flag */
+void test_multi_server(void) {
+    std::cout << "test_multi_server" << std::endl;
+
+    tcp::server control("control key", tcp::auth::MD5);
+    tcp::server data("data key", tcp::auth::MD5);
+
+    control.set_read_callback(control_read);
+    data.set_read_callback(data_read);
+    control.listen("127.0.0.1", "669");
+    data.listen("127.0.0.1", "670");
+
+    sleep(1);
+
+    std::cout << multi_request("control key", "669");
+    std::cout << multi_request("data key", "670");
+    std::cout << multi_request("control key", "670");
+
+    control.kill();
+
+    std::cout << multi_request("data key", "670");
+}
+
+#endif
+
+#ifdef UNIX_TEST
+
+std::string unix_read(std::string str) {
+    return "unix_read: OK\n";
+}
+
+std::string tcp_read(std::string str) {
+    return "tcp_read: OK\n";
+}
+
+void unix_request(tcp::client &c) {
+    c.write("unix_request\n");
+    c.send();
+    std::cout << c.readline();
+}
+
+/* md5 and SO_PEERCRED over AF_UNIX, then failover
+ * from the unix socket to a TCP endpoint */
+void test_unix(void) {
+    std::cout << "test_unix" << std::endl;
+
+    tcp::server *u = new tcp::server("unix key", tcp::auth::MD5);
+    tcp::server t("unix key", tcp::auth::MD5);
+
+    u->set_read_callback(unix_read);
+    t.set_read_callback(tcp_read);
+    u->listen("unix:/tmp/socket2me.sock", "");
+    t.listen("127.0.0.1", "671");
+
+    tcp::server cred("", tcp::auth::OFF);
+    cred.set_peer_cred(true);
+    cred.set_read_callback(unix_read);
+    cred.listen("unix:@socket2me", "");
+
+    sleep(1);
+
+    tcp::client c("unix key", tcp::auth::MD5);
+    if (c.authenticate("unix:/tmp/socket2me.sock", "")) unix_request(c);
+    else std::cerr << "test_unix: authentication FAILED!\n";
+
+    c.add_failover("127.0.0.1", "671");
+
+    tcp::client p("", tcp::auth::OFF);
+    p.set_peer_cred(true);
+    if (p.authenticate("unix:@socket2me", "")) unix_request(p);
+    else std::cerr << "test_unix: peer credentials FAILED!\n";
+
+    delete u;
+
+    if (c.failover()) unix_request(c);
+}
+
+#endif
+
+#ifdef PUSH_TEST
+
+tcp::conn_handle last_pusher = 0;
+
+std::string push_read(std::string str) {
+    last_pusher = tcp::server::current_connection();
+    return "push_read: OK\n";
+}
+
+/* two agents on "routes", one on "config". every agent
+ * reads its own reply, then the pushes meant for it. */
+void test_push(void) {
+    std::cout << "test_push" << std::endl;
+
+    tcp::server s("push key", tcp::auth::MD5);
+    s.set_read_callback(push_read);
+    s.listen("127.0.0.1", "672");
+
+    sleep(1);
+
+    tcp::client a("push key", tcp::auth::MD5);
+    tcp::client b("push key", tcp::auth::MD5);
+    if (!a.authenticate("127.0.0.1", "672") ||
+            !b.authenticate("127.0.0.1", "672")) {
+        std::cerr << "test_push: authentication FAILED!\n";
+        return;
+    }
+
+    a.subscribe("routes");
+    b.subscribe("routes", tcp::tx_policy::DISCONNECT);
+    b.subscribe("config");
+
+    // the reply proves the subscriptions were handled
+    a.write("push_request\n");
+    a.send();
+    std::cout << "a: " << a.readline();
+    b.write("push_request\n");
+    b.send();
+    std::cout << "b: " << b.readline();
+
+    std::cout << "routes: " << s.publish("routes", "route 10.0.0.0/8\n")
+            << " config: " << s.publish("config", "config v2\n")
+            << " all: " << s.broadcast("bye\n") << std::endl;
+
+    std::cout << "a: " << a.readline();
+    std::cout << "a: " << a.readline();
+    std::cout << "b: " << b.readline();
+    std::cout << "b: " << b.readline();
+    std::cout << "b: " << b.readline();
+
+    // b sent the last request
+    s.send_to(last_pusher, "just for b\n");
+    std::cout << "b: " << b.readline();
+
+    // the callback may call back into the server
+    s.for_each_connection([&s](tcp::conn_handle h, const tcp::conn_stats & st) {
+        std::cout << "conn " << h << " requests " << st.requests
+                << " rx " << st.rx_bytes << " tx " << st.tx_bytes << std::endl;
+        if (h == last_pusher) s.kick(h);
+    });
+
+    sleep(1);
+    std::cout << "after kick: " << s.connection_count() << " connection(s), "
+            << (s.send_to(last_pusher, "gone\n") ? "stale handle used!" : "stale handle refused")
+            << std::endl;
+}
+
+#endif
+
+#ifdef CHANNEL_TEST
+
+std::string bulk_read(std::string str) {
+    return "bulk " + std::to_string(str.size()) + " bytes";
+}
+
+std::string ping_read(std::string str) {
+    return "pong";
+}
+
+/* a 4 MB upload on a low priority channel must not hold
+ * up a ping on a high priority one, an upload past the
+ * message limit closes the connection */
+void test_channels(void) {
+    std::cout << "test_channels" << std::endl;
+
+    tcp::server s("channel key", tcp::auth::MD5);
+    s.set_channel_handler(1, bulk_read);
+    s.set_channel_handler(7, ping_read);
+    s.listen("127.0.0.1", "673");
+
+    sleep(1);
+
+    tcp::client c("channel key", tcp::auth::MD5);
+    if (!c.authenticate("127.0.0.1", "673")) {
+        std::cerr << "test_channels: authentication FAILED!\n";
+        return;
+    }
+
+    c.open_channel(1, 0);
+    c.open_channel(7, 9);
+
+    c.channel_send(1, std::string(4 << 20, 'b'));
+    c.channel_send(7, "ping");
+
+    uint16_t id;
+    std::string msg;
+    for (int i = 0; i < 2 && c.channel_read(id, msg); ++i)
+        std::cout << "channel " << id << ": " << msg << std::endl;
+
+    // past CHANNEL_MESSAGE_MAX the server hangs up
+    c.channel_send(1, std::string(tcp::CHANNEL_MESSAGE_MAX + 1, 'b'));
+    std::cout << "oversized: "
+            << (c.channel_read(id, msg) ? "answered!" : "closed") << std::endl;
+}
+
+#endif
+
+#ifdef STREAM_TEST
+
+// rows trickle out, an empty line ends the reply
+void stream_rows(std::string str, tcp::reply_sink &sink) {
+    for (int i = 0; i < 5 && sink.ok(); ++i) {
+        sink.write("row " + std::to_string(i) + "\n");
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+    sink.write("\n");
+}
+
+/* the first row must arrive long before
+ * the handler is done */
+void test_stream(void) {
+    std::cout << "test_stream" << std::endl;
+
+    tcp::server s("stream key", tcp::auth::MD5);
+    s.set_stream_callback(stream_rows);
+    s.listen("127.0.0.1", "674");
+
+    sleep(1);
+
+    tcp::client c("stream key", tcp::auth::MD5);
+    if (!c.authenticate("127.0.0.1", "674")) {
+        std::cerr << "test_stream: authentication FAILED!\n";
+        return;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    c.write("select rows\n");
+    c.send();
+
+    for (std::string line = c.readline(); line != "\n" && !line.empty();
+            line = c.readline()) {
+        auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                std::chrono::steady_clock::now() - start).count();
+        std::cout << (ms < 250 ? "early " : "late ") << line;
+        start = std::chrono::steady_clock::now();
+    }
+}
+
+#endif
+
+#ifdef ASYNC_TEST
+
+// completions a handler holds on to and never answers
+std::vector<tcp::completion> async_lost;
+
+// "<name> <ms>", answered by another thread after ms
+void async_read(std::string str, tcp::completion done) {
+    if (str.compare(0, 4, "lost") == 0) {
+        async_lost.push_back(done);
+        return;
+    }
+
+    std::thread([str, done]() mutable {
+        int ms = std::stoi(str.substr(str.find(' ') + 1));
+        std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+        done.reply(str.substr(0, str.find(' ')) + " done\n");
+    }).detach();
+}
+
+/* replies complete out of order but arrive in order, and
+ * the waits overlap instead of adding up. a completion
+ * never answered must not hold up the server's shutdown */
+void test_async(void) {
+    std::cout << "test_async" << std::endl;
+
+    {
+        tcp::server s("async key", tcp::auth::MD5);
+        s.set_async_callback(async_read);
+        s.listen("127.0.0.1", "675");
+
+        sleep(1);
+
+        tcp::client c("async key", tcp::auth::MD5);
+        if (!c.authenticate("127.0.0.1", "675")) {
+            std::cerr << "test_async: authentication FAILED!\n";
+            return;
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        c.write("slow 300\nfast 0\nmid 100\n");
+        c.send();
+
+        for (int i = 0; i < 3; ++i) std::cout << c.readline();
+
+        auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                std::chrono::steady_clock::now() - start).count();
+        std::cout << (ms < 380 ? "overlapped" : "serialized") << std::endl;
+
+        c.write("lost 0\n");
+        c.send();
+        sleep(1);
+    }
+
+    // answering after the connection is gone is a no-op
+    std::cout << "server stopped, late reply "
+            << (async_lost.at(0).reply("late\n") ? "sent!" : "dropped")
+            << std::endl;
+    async_lost.clear();
+}
+
+#endif
+
+#ifdef RELIABLE_TEST
+
+std::atomic<int> reliable_delivered(0);
+
+std::string reliable_read(std::string str) {
+    ++reliable_delivered;
+    return "";
+}
+
+/* lines unacked when the connection drops are sent
+ * again, the server delivers each of them once */
+void test_reliable(void) {
+    std::cout << "test_reliable" << std::endl;
+
+    tcp::server s("reliable key", tcp::auth::MD5);
+    s.set_read_callback(reliable_read);
+    s.listen("127.0.0.1", "676");
+
+    sleep(1);
+
+    tcp::client c("reliable key", tcp::auth::MD5);
+    c.set_reliable();
+    if (!c.authenticate("127.0.0.1", "676")) {
+        std::cerr << "test_reliable: authentication FAILED!\n";
+        return;
+    }
+
+    for (int i = 0; i < 1000; ++i)
+        c.send_reliable("update " + std::to_string(i));
+
+    std::cout << "unacked before failover: " << (c.unacked() > 0 ? "some" : "none")
+            << std::endl;
+    c.failover();
+
+    for (int i = 1000; i < 2000; ++i)
+        c.send_reliable("update " + std::to_string(i));
+
+    c.wait_acked();
+    std::cout << "unacked " << c.unacked() << " delivered "
+            << reliable_delivered << std::endl;
+}
+
+#endif
+
+#ifdef SPILL_TEST
+
+std::vector<int> spill_seen;
+std::mutex spill_mutex;
+
+std::string spill_read(std::string str) {
+    std::lock_guard<std::mutex> lock(spill_mutex);
+    spill_seen.push_back(std::stoi(str.substr(4)));
+    return "";
+}
+
+/* posts while the server is down land in the journal
+ * without stalling, and arrive in order once it is back */
+void test_spill(void) {
+    std::cout << "test_spill" << std::endl;
+
+    std::unique_ptr<tcp::server> s(new tcp::server("spill key", tcp::auth::MD5));
+    s->set_read_callback(spill_read);
+    s->listen("127.0.0.1", "677");
+
+    sleep(1);
+
+    tcp::client c("spill key", tcp::auth::MD5);
+    c.set_reconnect_backoff(50, 200);
+    if (!c.set_spill("/tmp/tcp_spill_test", 1 << 20, 64 * 1024) ||
+            !c.authenticate("127.0.0.1", "677")) {
+        std::cerr << "test_spill: setup FAILED!\n";
+        return;
+    }
+
+    s.reset();
+    sleep(1);
+
+    int n = 0;
+    auto slowest = std::chrono::steady_clock::duration::zero();
+    for (; n < 5000; ++n) {
+        auto start = std::chrono::steady_clock::now();
+        c.post("msg " + std::to_string(n) + "\n");
+        slowest = std::max(slowest, std::chrono::steady_clock::now() - start);
+    }
+
+    std::cout << "spilled: " << (c.spilled() > 0 ? "yes" : "no")
+            << ", slowest post under 50ms: "
+            << (slowest < std::chrono::milliseconds(50) ? "yes" : "no") << std::endl;
+
+    s.reset(new tcp::server("spill key", tcp::auth::MD5));
+    s->set_read_callback(spill_read);
+    s->listen("127.0.0.1", "677");
+    sleep(1);
+
+    // the first post after the restart reconnects and drains
+    while (c.spilled() > 0) {
+        c.post("msg " + std::to_string(n++) + "\n");
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    sleep(1);
+
+    std::lock_guard<std::mutex> lock(spill_mutex);
+    bool ordered = std::is_sorted(spill_seen.begin(), spill_seen.end());
+    std::cout << "in order: " << (ordered ? "yes" : "no") << ", last "
+            << (spill_seen.empty() ? -1 : spill_seen.back()) << " of " << n - 1
+            << std::endl;
+}
+
+#endif
+
+#ifdef HEDGE_TEST
+
+std::atomic<int> hedge_calls(0);
+
+// every 20th request stalls
+std::string hedge_slow_read(std::string str) {
+    if (++hedge_calls % 20 == 0)
+        std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    return "value " + str;
+}
+
+std::string hedge_fast_read(std::string str) {
+    return "value " + str;
+}
+
+/* a stalled reply is raced by the standby, the caller
+ * sees the fast one and replies stay matched up */
+void test_hedge(void) {
+    std::cout << "test_hedge" << std::endl;
+
+    tcp::server a("hedge key", tcp::auth::MD5);
+    a.set_read_callback(hedge_slow_read);
+    a.listen("127.0.0.1", "678");
+
+    tcp::server b("hedge key", tcp::auth::MD5);
+    b.set_read_callback(hedge_fast_read);
+    b.listen("127.0.0.1", "679");
+
+    sleep(1);
+
+    tcp::client c("hedge key", tcp::auth::MD5);
+    if (!c.authenticate("127.0.0.1", "678")) {
+        std::cerr << "test_hedge: authentication FAILED!\n";
+        return;
+    }
+    c.add_failover("127.0.0.1", "679");
+    c.set_hedging(0.9, 10);
+
+    int slow = 0, wrong = 0;
+    for (int i = 0; i < 400; ++i) {
+        std::string key = std::to_string(i) + "\n";
+        auto start = std::chrono::steady_clock::now();
+        if (c.request(key, true) != "value " + key) ++wrong;
+        if (std::chrono::steady_clock::now() - start > std::chrono::milliseconds(150))
+            ++slow;
+    }
+
+    std::cout << "hedged: " << (c.hedged() > 0 ? "yes" : "no")
+            << ", standby won: " << (c.hedge_wins() > 0 ? "yes" : "no")
+            << ", stalls seen: " << (slow < 5 ? "few" : "many")
+            << ", mismatched replies: " << wrong << std::endl;
+}
+
+#endif
+
+#ifdef QUORUM_TEST
+
+std::string quorum_fast_read(std::string str) {
+    return "ok\n";
+}
+
+std::string quorum_slow_read(std::string str) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    return "ok\n";
+}
+
+/* 2 of 3 replicas answer at once, the write does not
+ * wait for the slow one, which catches up afterwards */
+void test_quorum(void) {
+    std::cout << "test_quorum" << std::endl;
+
+    tcp::server a("quorum key", tcp::auth::MD5);
+    tcp::server b("quorum key", tcp::auth::MD5);
+    tcp::server c("quorum key", tcp::auth::MD5);
+    a.set_read_callback(quorum_fast_read);
+    b.set_read_callback(quorum_fast_read);
+    c.set_read_callback(quorum_slow_read);
+    a.listen("127.0.0.1", "680");
+    b.listen("127.0.0.1", "681");
+    c.listen("127.0.0.1", "682");
+
+    sleep(1);
+
+    tcp::quorum_writer w("quorum key", tcp::auth::MD5);
+    w.add_replica("127.0.0.1", "680");
+    w.add_replica("127.0.0.1", "681");
+    w.add_replica("127.0.0.1", "682");
+    if (!w.start()) {
+        std::cerr << "test_quorum: start FAILED!\n";
+        return;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    int acked = 0;
+    for (int i = 0; i < 20; ++i)
+        acked += w.write("record " + std::to_string(i) + "\n", 2, 5000);
+    auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now() - start).count();
+
+    std::cout << "quorum acked " << acked << " of 20, "
+            << (ms < 1000 ? "without" : "with") << " the slow replica" << std::endl;
+
+    std::vector<tcp::replica_stats> st = w.stats();
+    std::cout << "slow replica lagging: " << (st[2].pending > 0 ? "yes" : "no")
+            << std::endl;
+
+    for (int i = 0; i < 50 && w.stats()[2].pending > 0; ++i)
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    std::cout << "slow replica acked " << w.stats()[2].acked << std::endl;
+
+    // it falls too far behind, a write to all 3 is refused at once
+    w.set_max_lag(64);
+    for (int i = 0; i < 20; ++i)
+        w.write("burst " + std::to_string(i) + "\n", 2, 5000);
+
+    start = std::chrono::steady_clock::now();
+    bool all = w.write("all\n", 3);
+    ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now() - start).count();
+
+    st = w.stats();
+    std::cout << "slow replica stale " << st[2].stale << ", missed " << st[2].missed
+            << ", write to 3 " << (all ? "acked" : "refused") << " in "
+            << (ms < 50 ? "no time" : std::to_string(ms) + " ms") << std::endl;
+
+    // resynced, it is back in the quorum
+    for (int i = 0; i < 50 && w.stats()[2].pending > 0; ++i)
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    w.set_max_lag(0);
+    bool back = w.readmit("127.0.0.1", "682") && w.write("again\n", 3, 5000);
+    std::cout << "readmitted replica acks: " << (back ? "yes" : "no") << std::endl;
+
+    if (all || ms >= 50 || !st[2].stale || !back)
+        std::cerr << "test_quorum: FAILED!\n";
+}
+
+#endif
+
+#ifdef ROUTER_TEST
+
+std::string router_a_read(std::string str) {
+    return "a\n";
+}
+
+std::string router_b_read(std::string str) {
+    return "b\n";
+}
+
+std::string router_c_read(std::string str) {
+    return "c\n";
+}
+
+/* keys spread over three servers. when one goes down
+ * only its keys move, the rest stay where they were */
+void test_router(void) {
+    std::cout << "test_router" << std::endl;
+
+    tcp::server a("router key", tcp::auth::MD5);
+    std::unique_ptr<tcp::server> b(new tcp::server("router key", tcp::auth::MD5));
+    tcp::server c("router key", tcp::auth::MD5);
+    a.set_read_callback(router_a_read);
+    b->set_read_callback(router_b_read);
+    c.set_read_callback(router_c_read);
+    a.listen("127.0.0.1", "683");
+    b->listen("127.0.0.1", "684");
+    c.listen("127.0.0.1", "685");
+
+    sleep(1);
+
+    tcp::hash_router r("router key", tcp::auth::MD5);
+    r.add_endpoint("127.0.0.1", "683");
+    r.add_endpoint("127.0.0.1", "684");
+    r.add_endpoint("127.0.0.1", "685");
+
+    std::map<std::string, std::string> before;
+    std::map<std::string, int> spread;
+    for (int i = 0; i < 300; ++i) {
+        std::string key = "user" + std::to_string(i);
+        before[key] = r.request(key, "get " + key);
+        ++spread[before[key]];
+    }
+
+    std::cout << "all endpoints used: " << (spread.size() == 3 ? "yes" : "no")
+            << std::endl;
+
+    b.reset();
+    sleep(1);
+
+    int moved = 0, wrong = 0;
+    for (auto &k : before) {
+        std::string now = r.request(k.first, "get " + k.first);
+        if (now != k.second) {
+            ++moved;
+            if (k.second != "b\n") ++wrong;
+        }
+    }
+
+    std::cout << "moved " << (moved == spread["b\n"] ? "exactly b's keys" : "other keys")
+            << ", others moved: " << wrong
+            << ", endpoints up: " << r.endpoints_up() << std::endl;
+}
+
+std::string router_hung_read(std::string str) {
+    std::this_thread::sleep_for(std::chrono::seconds(2));
+    return "hung\n";
+}
+
+/* an endpoint that authenticates but never answers times out,
+ * is marked down and its keys go to the next endpoint */
+void test_router_hung(void) {
+    std::cout << "test_router_hung" << std::endl;
+
+    tcp::server a("router key", tcp::auth::MD5);
+    tcp::server hung("router key", tcp::auth::MD5);
+    a.set_read_callback(router_a_read);
+    hung.set_read_callback(router_hung_read);
+    a.listen("127.0.0.1", "697");
+    hung.listen("127.0.0.1", "698");
+
+    sleep(1);
+
+    tcp::hash_router r("router key", tcp::auth::MD5);
+    r.set_request_timeout(200);
+    r.add_endpoint("127.0.0.1", "697");
+    r.add_endpoint("127.0.0.1", "698");
+
+    std::string key;
+    for (int i = 0; key.empty(); ++i) {
+        if (r.route("user" + std::to_string(i)) == "127.0.0.1:698")
+            key = "user" + std::to_string(i);
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    std::string reply = r.request(key, "get " + key);
+    auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now() - start).count();
+
+    std::cout << "reply " << reply.substr(0, 1) << ", "
+            << (ms < 1000 ? "timed out" : "waited!")
+            << ", endpoints up: " << r.endpoints_up() << std::endl;
+
+    if (reply != "a\n" || ms >= 1000 || r.endpoints_up() != 1)
+        std::cerr << "test_router_hung: FAILED!\n";
+}
+
+#endif
+
+#ifdef STANDBY_TEST
+
+std::atomic<int> standby_applied(0);
+
+std::string standby_primary_read(std::string str) {
+    return "ok\n";
+}
+
+std::string standby_read(std::string str) {
+    ++standby_applied;
+    return "never sent\n";
+}
+
+/* what the primary accepts reaches the standby in order,
+ * replication lag drains to zero */
+void test_standby(void) {
+    std::cout << "test_standby" << std::endl;
+
+    tcp::server standby("standby key", tcp::auth::MD5);
+    standby.set_read_callback(standby_read);
+    standby.listen("127.0.0.1", "687");
+
+    tcp::server primary("standby key", tcp::auth::MD5);
+    primary.set_read_callback(standby_primary_read);
+    primary.add_standby("127.0.0.1", "687");
+    primary.listen("127.0.0.1", "686");
+
+    sleep(1);
+
+    tcp::client c("standby key", tcp::auth::MD5);
+    if (!c.authenticate("127.0.0.1", "686")) {
+        std::cerr << "test_standby: authentication FAILED!\n";
+        return;
+    }
+
+    for (int i = 0; i < 500; ++i) {
+        c.write("set " + std::to_string(i) + "\n");
+        c.send();
+        c.readline();
+    }
+
+    for (int i = 0; i < 100 && primary.replication_stats()[0].lag_bytes > 0; ++i)
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+
+    tcp::standby_stats st = primary.replication_stats()[0];
+    std::cout << "standby applied " << standby_applied << ", acked " << st.acked
+            << ", lag " << st.lag_bytes << " bytes" << std::endl;
+}
+
+std::atomic<bool> stuck_standby(true);
+
+std::string stuck_standby_read(std::string str) {
+    while (stuck_standby)
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    return "";
+}
+
+/* a standby that stops reading must not hold up the
+ * primary's shutdown, nor a stale one stay out for good */
+void test_standby_stuck(void) {
+    std::cout << "test_standby_stuck" << std::endl;
+
+    tcp::server standby("standby key", tcp::auth::MD5);
+    standby.set_standby_callback(stuck_standby_read);
+    standby.listen("127.0.0.1", "690");
+
+    std::unique_ptr<tcp::server> primary(new tcp::server("standby key", tcp::auth::MD5));
+    primary->set_read_callback(standby_primary_read);
+    primary->add_standby("127.0.0.1", "690", 16 * 1024 * 1024);
+    primary->listen("127.0.0.1", "691");
+
+    sleep(1);
+
+    tcp::client c("standby key", tcp::auth::MD5);
+    if (!c.authenticate("127.0.0.1", "691")) {
+        std::cerr << "test_standby_stuck: authentication FAILED!\n";
+        return;
+    }
+
+    // enough to fill the socket buffers, then the lag bound
+    std::string big(64 * 1024, 'x');
+    big += "\n";
+    for (int i = 0; i < 512; ++i) {
+        c.write(big);
+        c.send();
+        c.readline();
+    }
+
+    tcp::standby_stats st = primary->replication_stats()[0];
+    bool readmitted = primary->readmit_standby("127.0.0.1", "690");
+    std::cout << "stuck standby stale " << st.stale << ", missed " << (st.missed > 0)
+            << ", readmitted " << readmitted << std::endl;
+
+    c.disconnect();
+    auto start = std::chrono::steady_clock::now();
+    primary.reset();
+    auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now() - start).count();
+    stuck_standby = false;
+
+    std::cout << "primary stopped " << (ms < 1000 ? "at once" : "late") << std::endl;
+
+    if (!st.stale || !readmitted || ms >= 1000)
+        std::cerr << "test_standby_stuck: FAILED!\n";
+}
+
+/* takes the handshake like a server, then never says
+ * another word. counts the connections it accepted */
+static void silent_standby(int listener, std::atomic<int> *accepted,
+        std::atomic<bool> *done) {
+    std::vector<int> conns;
+    while (!*done) {
+        pollfd p = {listener, POLLIN, 0};
+        if (poll(&p, 1, 50) != 1) continue;
+
+        int conn = accept(listener, nullptr, nullptr);
+        if (conn == -1) continue;
+        ++*accepted;
+        conns.push_back(conn);
+
+        char token[16];
+        const uint8_t ok = (uint8_t) tcp::auth_status::AUTH_OK;
+        if (recv(conn, token, sizeof (token), MSG_WAITALL) == sizeof (token))
+            send(conn, &ok, 1, MSG_NOSIGNAL);
+    }
+
+    for (int conn : conns) close(conn);
+}
+
+/* a standby that never acks the session is not up,
+ * the link backs off and tries again */
+void test_standby_silent(void) {
+    std::cout << "test_standby_silent" << std::endl;
+
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+    int on = 1;
+    setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &on, sizeof (on));
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof (addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(699);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(listener, (sockaddr *) &addr, sizeof (addr)) == -1 ||
+            listen(listener, 8) == -1) {
+        std::cerr << "test_standby_silent: listen FAILED!\n";
+        close(listener);
+        return;
+    }
+
+    std::atomic<int> accepted(0);
+    std::atomic<bool> done(false);
+    std::thread fake(silent_standby, listener, &accepted, &done);
+
+    {
+        tcp::server primary("standby key", tcp::auth::MD5);
+        primary.set_read_callback(standby_primary_read);
+        primary.add_standby("127.0.0.1", "699");
+
+        // past the 5 s the link waits for the session ack
+        std::this_thread::sleep_for(std::chrono::milliseconds(6500));
+
+        tcp::standby_stats st = primary.replication_stats()[0];
+        std::cout << "silent standby connected " << st.connected
+                << ", retried " << (accepted > 1) << std::endl;
+
+        if (st.connected || accepted < 2)
+            std::cerr << "test_standby_silent: FAILED!\n";
+    }
+
+    done = true;
+    fake.join();
+    close(listener);
+}
+
+#endif
+
+#ifdef ACCEPT_TEST
+
+std::atomic<int> accept_count(0);
+
+// counts the accepted connection and hangs up
+void accept_conn(std::thread *, const int socket) {
+    ++accept_count;
+    close(socket);
+}
+
+std::string accept_read(std::string str) {
+    return "fast " + str;
+}
+
+static int accept_connect(const char *port) {
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof (addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(atoi(port));
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (connect(sock, (sockaddr *) &addr, sizeof (addr)) == -1) {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+/* with deferred accept a silent peer is not accepted until
+ * it sends, a burst of peers is accepted in full. a fast
+ * open client authenticates and round trips as usual */
+void test_accept(void) {
+    std::cout << "test_accept" << std::endl;
+
+    tcp::server s("accept key", tcp::auth::MD5);
+    s.set_conn_handler(accept_conn);
+    s.set_defer_accept(5);
+    s.listen("127.0.0.1", "701");
+
+    tcp::server f("accept key", tcp::auth::MD5);
+    f.set_read_callback(accept_read);
+    f.set_fast_open(16);
+    f.listen("127.0.0.1", "702");
+
+    sleep(1);
+
+    int silent = accept_connect("701");
+    std::this_thread::sleep_for(std::chrono::milliseconds(300));
+    int before_data = accept_count;
+    send(silent, "x", 1, MSG_NOSIGNAL);
+    std::this_thread::sleep_for(std::chrono::milliseconds(300));
+    int after_data = accept_count;
+    close(silent);
+
+    std::vector<int> burst;
+    for (int i = 0; i < 64; ++i) {
+        int sock = accept_connect("701");
+        if (sock == -1) continue;
+        send(sock, "x", 1, MSG_NOSIGNAL);
+        burst.push_back(sock);
+    }
+    for (int i = 0; i < 100 && accept_count < after_data + 64; ++i)
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    int burst_accepted = accept_count - after_data;
+    for (int sock : burst) close(sock);
+
+    tcp::client c("accept key", tcp::auth::MD5);
+    c.set_fast_open(1);
+    std::string reply = c.authenticate("127.0.0.1", "702") ?
+            (c.write("hello\n"), c.send(), c.readline()) : "AUTH_FAILED\n";
+
+    std::cout << "silent peer accepted " << before_data << ", after data "
+            << after_data << ", burst accepted " << burst_accepted
+            << ", fast open " << reply;
+
+    if (before_data != 0 || after_data != 1 || burst_accepted != 64 ||
+            reply != "fast hello\n")
+        std::cerr << "test_accept: FAILED!\n";
+}
+
+#endif
+
+#ifdef CACHE_TEST
+
+std::atomic<int> cache_calls(0);
+
+std::string cache_read(std::string str) {
+    ++cache_calls;
+    return "value of " + str;
+}
+
+/* a repeated line is answered from the cache without the
+ * reader, a full cache evicts the least recently used */
+void test_cache(void) {
+    std::cout << "test_cache" << std::endl;
+
+    tcp::server s("cache key", tcp::auth::MD5);
+    s.set_read_callback(cache_read, true);
+    // one shard, room for a handful of entries
+    s.set_response_cache(1024, 0, 1);
+    s.listen("127.0.0.1", "700");
+
+    sleep(1);
+
+    bool late = s.set_response_cache(4096, 0);
+
+    tcp::client c("cache key", tcp::auth::MD5);
+    if (!c.authenticate("127.0.0.1", "700")) {
+        std::cerr << "test_cache: authentication FAILED!\n";
+        return;
+    }
+
+    auto get = [&c](const std::string &key) {
+        c.write("get " + key + "\n");
+        c.send();
+        return c.readline();
+    };
+
+    std::string first = get("a");
+    std::string again = get("a");
+    int after_hit = cache_calls;
+
+    for (int i = 0; i < 20; ++i) get(std::to_string(i));
+    std::string evicted = get("a");
+
+    tcp::cache_stats st = s.response_cache_stats();
+    std::cout << "calls after hit " << after_hit << ", same reply " << (first == again)
+            << ", hits " << st.hits << ", evictions " << (st.evictions > 0 ? "some" : "none")
+            << ", evicted line called again " << (cache_calls == 22)
+            << ", late set " << (late ? "taken!" : "refused") << std::endl;
+
+    if (after_hit != 1 || first != again || first != "value of get a\n" ||
+            st.hits != 1 || st.evictions == 0 || cache_calls != 22 ||
+            evicted != first || late)
+        std::cerr << "test_cache: FAILED!\n";
+}
+
+#endif
+
+#ifdef TXQUEUE_TEST
+
+// "msg <n>" padded to size bytes, newline terminated
+static std::string txq_message(int n, size_t size) {
+    std::string msg = "msg " + std::to_string(n);
+    msg.resize(size - 1, ' ');
+    return msg + "\n";
+}
+
+// everything the peer can read until the writer goes quiet or away
+static std::string txq_collect(int socket) {
+    std::string got;
+    char buf[65536];
+    pollfd p = {socket, POLLIN, 0};
+    while (poll(&p, 1, 500) == 1) {
+        ssize_t n = recv(socket, buf, sizeof (buf), 0);
+        if (n <= 0) break;
+        got.append(buf, n);
+    }
+    return got;
+}
+
+/* a peer that does not read. DROP_OLDEST keeps the
+ * newest whole messages within the budget, DISCONNECT
+ * fails the queue and shuts the socket down */
+void test_tx_queue(void) {
+    std::cout << "test_tx_queue" << std::endl;
+
+    const size_t size = 1024;
+    const int count = 1000;
+    int small = 4096;
+
+    int drop[2];
+    socketpair(AF_UNIX, SOCK_STREAM, 0, drop);
+    setsockopt(drop[0], SOL_SOCKET, SO_SNDBUF, &small, sizeof (small));
+    setsockopt(drop[1], SOL_SOCKET, SO_RCVBUF, &small, sizeof (small));
+
+    tcp::tx_queue dq(drop[0], 4096, 16384, tcp::tx_policy::DROP_OLDEST);
+    int queued = 0;
+    for (int i = 0; i < count; ++i)
+        if (dq.push(txq_message(i, size))) ++queued;
+    size_t pending = dq.pending();
+
+    std::string got = txq_collect(drop[1]);
+    bool whole = got.size() % size == 0;
+    for (size_t at = 0; whole && at < got.size(); at += size)
+        whole = got.compare(at, 4, "msg ") == 0 && got[at + size - 1] == '\n';
+    bool newest = got.size() >= size &&
+            got.compare(got.size() - size, size, txq_message(count - 1, size)) == 0;
+
+    std::cout << "drop oldest: queued " << queued << ", dropped "
+            << (dq.dropped() > 0 ? "some" : "none") << ", pending "
+            << (pending <= 16384 ? "within budget" : "over budget!")
+            << ", whole messages " << whole << ", newest kept " << newest << std::endl;
+
+    if (queued != count || dq.dropped() == 0 || pending > 16384 ||
+            !whole || !newest)
+        std::cerr << "test_tx_queue: DROP_OLDEST FAILED!\n";
+
+    dq.close();
+    close(drop[0]);
+    close(drop[1]);
+
+    int disc[2];
+    socketpair(AF_UNIX, SOCK_STREAM, 0, disc);
+    setsockopt(disc[0], SOL_SOCKET, SO_SNDBUF, &small, sizeof (small));
+    setsockopt(disc[1], SOL_SOCKET, SO_RCVBUF, &small, sizeof (small));
+
+    tcp::tx_queue xq(disc[0], 4096, 16384, tcp::tx_policy::DISCONNECT);
+    int accepted = 0;
+    while (accepted < count && xq.push(txq_message(accepted, size)))
+        ++accepted;
+
+    // shut down, the peer reads what was on the wire, then EOF
+    txq_collect(disc[1]);
+    char byte;
+    bool eof = recv(disc[1], &byte, 1, MSG_DONTWAIT) == 0;
+
+    std::cout << "disconnect: refused after " << (accepted < count ? "budget" : "nothing!")
+            << ", closed " << xq.closed() << ", peer sees eof " << eof
+            << ", later push " << (xq.push(txq_message(0, size)) ? "queued!" : "refused")
+            << std::endl;
+
+    if (accepted >= count || !xq.closed() || !eof)
+        std::cerr << "test_tx_queue: DISCONNECT FAILED!\n";
+
+    xq.close();
+    close(disc[0]);
+    close(disc[1]);
+}
+
+#endif
+
+#ifdef CODEC_TEST
+
+enum class codec_kind : int16_t {
+    LOW = -300, HIGH = 300
+};
+
+struct codec_sample {
+    int8_t i8;
+    uint16_t u16;
+    int32_t i32;
+    int64_t i64;
+    bool flag;
+    double d;
+    float f;
+    codec_kind kind;
+    std::array<uint8_t, 4> raw;
+};
+
+typedef tcp::schema<codec_sample,
+TCP_FIELD(codec_sample, i8),
+TCP_FIELD(codec_sample, u16),
+TCP_FIELD(codec_sample, i32),
+TCP_FIELD(codec_sample, i64),
+TCP_FIELD(codec_sample, flag),
+TCP_FIELD(codec_sample, d),
+TCP_FIELD(codec_sample, f),
+TCP_FIELD(codec_sample, kind),
+TCP_FIELD(codec_sample, raw)> codec_msg;
+
+static_assert(codec_msg::size == 34, "packed, no padding");
+static_assert(codec_msg::at<3>::offset == 7, "i64 after i8, u16, i32");
+static_assert(codec_msg::at<8>::offset == 30, "raw last");
+
+codec_sample codec_extremes(bool high) {
+    codec_sample s;
+    s.i8 = high ? INT8_MAX : INT8_MIN;
+    s.u16 = high ? UINT16_MAX : 0xBEEF;
+    s.i32 = high ? INT32_MAX : INT32_MIN;
+    s.i64 = high ? INT64_MAX : INT64_MIN;
+    s.flag = high;
+    s.d = high ? std::numeric_limits<double>::infinity() : -0.0;
+    s.f = high ? std::numeric_limits<float>::max() : -1.5f;
+    s.kind = high ? codec_kind::HIGH : codec_kind::LOW;
+    s.raw = {{0xDE, 0xAD, 0xBE, 0xEF}};
+    return s;
+}
+
+bool codec_same(const codec_sample &a, const codec_sample &b) {
+    return a.i8 == b.i8 && a.u16 == b.u16 && a.i32 == b.i32 && a.i64 == b.i64 &&
+            a.flag == b.flag && a.d == b.d && std::signbit(a.d) == std::signbit(b.d) &&
+            a.f == b.f && a.kind == b.kind && a.raw == b.raw;
+}
+
+std::string codec_read(std::string str) {
+    uint8_t bytes[codec_msg::size];
+    codec_msg::encode(codec_extremes(true), bytes);
+
+    // half a message, the client must not read past it
+    size_t n = str.compare(0, 4, "half") == 0 ? codec_msg::size / 2 : codec_msg::size;
+    return std::string((const char *) bytes, n);
+}
+
+/* every field survives encode and decode at the ends of its
+ * range, in network byte order, within Schema::size bytes */
+void test_codec(void) {
+    std::cout << "test_codec" << std::endl;
+
+    bool ok = true;
+    for (int high = 0; high < 2; ++high) {
+        codec_sample in = codec_extremes(high);
+
+        // guard bytes either side of the message
+        uint8_t buf[codec_msg::size + 2];
+        memset(buf, 0xAA, sizeof (buf));
+        codec_msg::encode(in, buf + 1);
+        ok &= buf[0] == 0xAA && buf[codec_msg::size + 1] == 0xAA;
+
+        tcp::view<codec_msg> v(buf + 1);
+        ok &= codec_same(v.decode(), in);
+        ok &= v.get<0>() == in.i8 && v.get<3>() == in.i64 && v.get<7>() == in.kind;
+
+        if (!high) {
+            // big endian on the wire
+            const uint8_t *u16 = buf + 1 + codec_msg::at<1>::offset;
+            ok &= u16[0] == 0xBE && u16[1] == 0xEF;
+        }
+    }
+
+    std::cout << "codec round trip " << (ok ? "ok" : "FAILED") << std::endl;
+
+    tcp::server s("codec key", tcp::auth::MD5);
+    s.set_read_callback(codec_read);
+    s.listen("127.0.0.1", "693");
+
+    sleep(1);
+
+    tcp::client c("codec key", tcp::auth::MD5);
+    c.set_request_timeout(200);
+    if (!c.authenticate("127.0.0.1", "693")) {
+        std::cerr << "test_codec: authentication FAILED!\n";
+        return;
+    }
+
+    c.write("whole\n");
+    c.send();
+    tcp::view<codec_msg> whole = c.read_msg<codec_msg>();
+    bool whole_ok = whole.valid() && codec_same(whole.decode(), codec_extremes(true));
+
+    c.write("half\n");
+    c.send();
+    bool half_refused = !c.read_msg<codec_msg>().valid();
+
+    std::cout << "over the socket: whole " << (whole_ok ? "ok" : "FAILED")
+            << ", half " << (half_refused ? "refused" : "FAILED") << std::endl;
+
+    if (!ok || !whole_ok || !half_refused)
+        std::cerr << "test_codec: FAILED!\n";
+}
+
+#endif
+
+#ifdef TIMER_TEST
+
+void count_timer(void *arg) {
+    ++*(std::atomic<int> *) arg;
+}
+
+std::string timer_slow_read(std::string str) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    return "late\n";
+}
+
+template <typename T>
+long ms_since(T start) {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now() - start).count();
+}
+
+/* timers fire once when due, a cancelled one never. idle,
+ * handshake and request timeouts cut a silent peer off */
+void test_timers(void) {
+    std::cout << "test_timers" << std::endl;
+
+    tcp::timer_wheel wheel;
+    wheel.start();
+
+    // 600 ms cascades down from the second level
+    std::atomic<int> fired(0), cancelled(0);
+    tcp::timer a, b, c, far;
+    wheel.arm(a, 10, count_timer, &fired);
+    wheel.arm(b, 50, count_timer, &fired);
+    wheel.arm(far, 600, count_timer, &fired);
+    wheel.arm(c, 30, count_timer, &cancelled);
+    wheel.cancel(c);
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    int early = fired;
+    std::this_thread::sleep_for(std::chrono::milliseconds(600));
+    wheel.stop();
+
+    std::cout << "wheel fired " << early << " then " << fired << " of 3, cancelled "
+            << cancelled << std::endl;
+
+    tcp::server s("timer key", tcp::auth::MD5);
+    s.set_read_callback(timer_slow_read);
+    s.set_idle_timeout(200);
+    s.set_handshake_timeout(200);
+    s.listen("127.0.0.1", "692");
+
+    sleep(1);
+
+    // authenticated, then silent
+    tcp::client idle("timer key", tcp::auth::MD5);
+    if (!idle.authenticate("127.0.0.1", "692")) {
+        std::cerr << "test_timers: authentication FAILED!\n";
+        return;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    idle.readline();
+    long idle_ms = ms_since(start);
+    bool idle_cut = !idle.connected() && idle_ms < 1000;
+
+    // connected, never sends its token
+    int raw = ::socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof (addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(692);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    timeval tv = {3, 0};
+    setsockopt(raw, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof (tv));
+
+    start = std::chrono::steady_clock::now();
+    char byte;
+    bool handshake_cut = connect(raw, (sockaddr *) &addr, sizeof (addr)) == 0 &&
+            recv(raw, &byte, 1, 0) == 0 && ms_since(start) < 1000;
+    close(raw);
+
+    // the reply takes longer than the client waits
+    tcp::client slow("timer key", tcp::auth::MD5);
+    slow.set_request_timeout(100);
+    if (!slow.authenticate("127.0.0.1", "692")) {
+        std::cerr << "test_timers: authentication FAILED!\n";
+        return;
+    }
+
+    start = std::chrono::steady_clock::now();
+    slow.write("slow\n");
+    slow.send();
+    slow.readline();
+    bool request_cut = !slow.connected() && ms_since(start) < 400;
+
+    std::cout << "cut off: idle " << idle_cut << ", handshake " << handshake_cut
+            << ", request " << request_cut << std::endl;
+
+    if (early != 2 || fired != 3 || cancelled != 0 || !idle_cut ||
+            !handshake_cut || !request_cut)
+        std::cerr << "test_timers: FAILED!\n";
+}
+
+#endif
+
+#ifdef HANDOFF_TEST
+
+std::string handoff_old_read(std::string str) {
+    return "old\n";
+}
+
+std::string handoff_new_read(std::string str) {
+    return "new\n";
+}
+
+/* the listener and an idle connection with a tx queue move
+ * to another server, the connection keeps working there */
+void test_handoff(void) {
+    std::cout << "test_handoff" << std::endl;
+
+    tcp::server old_srv("handoff key", tcp::auth::MD5);
+    old_srv.set_read_callback(handoff_old_read);
+    old_srv.set_tx_budget(64 * 1024, 256 * 1024, tcp::tx_policy::DISCONNECT);
+    old_srv.listen("127.0.0.1", "689");
+
+    sleep(1);
+
+    tcp::client c("handoff key", tcp::auth::MD5);
+    if (!c.authenticate("127.0.0.1", "689")) {
+        std::cerr << "test_handoff: authentication FAILED!\n";
+        return;
+    }
+
+    c.write("before\n");
+    c.send();
+    std::string before = c.readline();
+
+    bool handed = false;
+    std::thread t([&] {
+        handed = old_srv.handoff("@tcp_handoff_test", true, 2000);
+    });
+
+    tcp::server new_srv("handoff key", tcp::auth::MD5);
+    new_srv.set_read_callback(handoff_new_read);
+
+    bool taken = false;
+    for (int i = 0; i < 100 && !taken; ++i) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        taken = new_srv.takeover("@tcp_handoff_test");
+    }
+
+    t.join();
+
+    c.write("after\n");
+    c.send();
+    std::string after = c.readline();
+
+    tcp::client fresh("handoff key", tcp::auth::MD5);
+    std::string accepted = fresh.authenticate("127.0.0.1", "689") ?
+            (fresh.write("fresh\n"), fresh.send(), fresh.readline()) : "AUTH_FAILED\n";
+
+    std::cout << "handed off " << handed << ", taken " << taken << ", replies "
+            << before.substr(0, 3) << " " << after.substr(0, 3) << " "
+            << accepted.substr(0, 3) << std::endl;
+
+    if (!handed || !taken || before != "old\n" || after != "new\n" ||
+            accepted != "new\n")
+        std::cerr << "test_handoff: FAILED!\n";
+}
+
+#endif
+
+#ifdef DEADLINE_TEST
+
+std::string deadline_read(std::string str) {
+    if (str.compare(0, 4, "slow") == 0)
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+    return std::to_string(tcp::server::remaining_us()) + "\n";
+}
+
+/* requests queued behind a slow one run out of budget and
+ * are answered expired, the handler sees what is left */
+void test_deadline(void) {
+    std::cout << "test_deadline" << std::endl;
+
+    tcp::server s("deadline key", tcp::auth::MD5);
+    s.set_read_callback(deadline_read);
+    s.listen("127.0.0.1", "688");
+
+    sleep(1);
+
+    tcp::client c("deadline key", tcp::auth::MD5);
+    if (!c.authenticate("127.0.0.1", "688")) {
+        std::cerr << "test_deadline: authentication FAILED!\n";
+        return;
+    }
+
+    c.write_with_budget("slow\n", 50);
+    for (int i = 0; i < 4; ++i) c.write_with_budget("fast\n", 50);
+    c.write("plain\n");
+    c.write_with_budget("fast\n", 1000);
+    c.send();
+
+    std::string slow = c.readline();
+    int expired = 0;
+    for (int i = 0; i < 4; ++i) expired += tcp::expired(c.readline());
+    std::string plain = c.readline();
+    std::string fast = c.readline();
+
+    std::cout << "expired " << s.expired_requests() << ", replied " << expired
+            << " (expected 4), remaining: slow " << std::stol(slow) << ", plain "
+            << std::stol(plain) << ", fast " << std::stol(fast) << std::endl;
+
+    if (s.expired_requests() != 4 || expired != 4 || std::stol(plain) != -1 ||
+            std::stol(fast) <= 0)
+        std::cerr << "test_deadline: FAILED!\n";
+}
+
+#endif
+
+#ifdef SHM_TEST
+
+std::string shm_read(std::string str) {
+    return "echo " + str;
+}
+
+/* a co-located client moves to shared memory and its
+ * requests round trip over the rings. a region offered
+ * without the server's nonce is refused */
+void test_shm(void) {
+    std::cout << "test_shm" << std::endl;
+
+    tcp::server s("shm key", tcp::auth::MD5);
+    s.set_read_callback(shm_read);
+    s.listen("127.0.0.1", "696");
+
+    sleep(1);
+
+    tcp::client c("shm key", tcp::auth::MD5);
+    c.use_shm(64 * 1024);
+    tcp::client b("shm key", tcp::auth::MD5);
+    if (!c.authenticate("127.0.0.1", "696") ||
+            !b.authenticate("127.0.0.1", "696")) {
+        std::cerr << "test_shm: authentication FAILED!\n";
+        return;
+    }
+
+    bool on = c.negotiate_shm();
+    int echoed = 0;
+    for (int i = 0; i < 1000; ++i) {
+        c.write("line " + std::to_string(i) + "\n");
+        c.send();
+        if (c.readline() == "echo line " + std::to_string(i) + "\n") ++echoed;
+    }
+
+    // a region the server never handed out a nonce for
+    std::shared_ptr<tcp::shm_link> forged =
+            tcp::shm_link::create(64 * 1024, tcp::shm_nonce());
+    std::string offer;
+    offer += tcp::CTL;
+    offer += (char) tcp::control::SHM;
+    offer += forged->name();
+    offer += tcp::EOL;
+    b.write(offer);
+    b.send();
+    std::string answer = b.readline();
+    bool refused = answer.size() == 4 && answer[2] == '0';
+
+    b.write("still tcp\n");
+    b.send();
+    std::string tcp_reply = b.readline();
+
+    std::cout << "shm " << (on ? "on" : "off") << ", echoed " << echoed
+            << ", forged region " << (refused ? "refused" : "mapped!")
+            << ", " << tcp_reply;
+
+    if (!on || echoed != 1000 || !refused || tcp_reply != "echo still tcp\n")
+        std::cerr << "test_shm: FAILED!\n";
+}
+
+#endif
+
+#ifdef FLUSH_TEST
+
+std::mutex flush_mutex;
+long flush_last = -1;
+int flush_seen = 0;
+int flush_reordered = 0;
+std::atomic<long long> flush_arrived(0);
+
+// numbered lines are checked for order, the rest answered
+std::string flush_read(std::string str) {
+    if (!isdigit((unsigned char) str[0])) {
+        flush_arrived = std::chrono::steady_clock::now().time_since_epoch().count();
+        return "now\n";
+    }
+
+    long n = std::stol(str);
+    std::lock_guard<std::mutex> lock(flush_mutex);
+    if (n < flush_last) ++flush_reordered;
+    flush_last = n;
+    ++flush_seen;
+    return "";
+}
+
+/* ms until the server saw line. no read meanwhile, a
+ * read would flush the batch itself */
+static long flush_ms(tcp::client &c, const std::string &line) {
+    flush_arrived = 0;
+    auto start = std::chrono::steady_clock::now();
+    c.write(line);
+    std::this_thread::sleep_for(std::chrono::milliseconds(300));
+
+    long ms = flush_arrived == 0 ? -1 :
+            std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::duration(flush_arrived) -
+            start.time_since_epoch()).count();
+    c.readline();
+    return ms;
+}
+
+/* a lone write leaves after the linger, a full batch at
+ * once. flushes from two threads through a tx queue keep
+ * the write order, and a linger pending at disconnect()
+ * never touches the closed stream */
+void test_flush(void) {
+    std::cout << "test_flush" << std::endl;
+
+    tcp::server s("flush key", tcp::auth::MD5);
+    s.set_read_callback(flush_read);
+    s.listen("127.0.0.1", "695");
+
+    sleep(1);
+
+    tcp::client c("flush key", tcp::auth::MD5);
+    c.set_flush_policy(1024, 0, 50000);
+    tcp::client q("flush key", tcp::auth::MD5);
+    q.tx_queue_budget(4096, 64 * 1024);
+    if (!c.authenticate("127.0.0.1", "695") ||
+            !q.authenticate("127.0.0.1", "695")) {
+        std::cerr << "test_flush: authentication FAILED!\n";
+        return;
+    }
+
+    long lingered = flush_ms(c, "time\n");
+    long batched = flush_ms(c, "time" + std::string(2048, ' ') + "\n");
+
+    std::mutex m;
+    long seq = 0;
+    auto numbered = [&q, &m, &seq] {
+        for (int i = 0; i < 2000; ++i) {
+            {
+                std::lock_guard<std::mutex> lock(m);
+                q.write(std::to_string(seq++) + "\n");
+            }
+            q.send();
+        }
+    };
+    std::thread t1(numbered), t2(numbered);
+    t1.join();
+    t2.join();
+    q.write("time\n");
+    q.send();
+    q.readline();
+
+    c.write("never sent\n");
+    c.disconnect();
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+    std::cout << "linger " << (lingered >= 45 ? ">= 50 ms" : lingered < 0 ? "never!" : "early!")
+            << ", batch " << (batched >= 0 && batched < 45 ? "at once" : "late!")
+            << ", numbered " << flush_seen << " reordered " << flush_reordered
+            << std::endl;
+
+    if (lingered < 45 || batched < 0 || batched >= 45 ||
+            flush_seen != 4000 || flush_reordered != 0)
+        std::cerr << "test_flush: FAILED!\n";
+}
+
+#endif
+
+#ifdef PROFILE_TEST
+
+tcp::server *profile_srv = nullptr;
+std::atomic<int> profile_peer_port(0);
+std::atomic<int> profile_srv_nodelay(-1);
+
+// notes the accepted socket's options and the peer's port
+std::string profile_read(std::string str) {
+    tcp::conn_stats st;
+    if (profile_srv->connection_stats(tcp::server::current_connection(), st)) {
+        sockaddr_in peer;
+        socklen_t len = sizeof (peer);
+        if (getpeername(st.socket, (sockaddr *) &peer, &len) == 0)
+            profile_peer_port = ntohs(peer.sin_port);
+
+        int nodelay = -1;
+        len = sizeof (nodelay);
+        getsockopt(st.socket, IPPROTO_TCP, TCP_NODELAY, &nodelay, &len);
+        profile_srv_nodelay = nodelay;
+    }
+    return "ok\n";
+}
+
+// our end of the connection from local_port to server_port
+static int profile_socket(int local_port, int server_port) {
+    for (int fd = 3; fd < 1024; ++fd) {
+        sockaddr_in local, peer;
+        socklen_t llen = sizeof (local), plen = sizeof (peer);
+        if (getsockname(fd, (sockaddr *) &local, &llen) == 0 &&
+                getpeername(fd, (sockaddr *) &peer, &plen) == 0 &&
+                local.sin_family == AF_INET &&
+                ntohs(local.sin_port) == local_port &&
+                ntohs(peer.sin_port) == server_port)
+            return fd;
+    }
+    return -1;
+}
+
+/* a client profile is applied at connect, the server's
+ * DEFAULT profile still turns Nagle off on its side */
+void test_profile(void) {
+    std::cout << "test_profile" << std::endl;
+
+    tcp::server s("profile key", tcp::auth::MD5);
+    profile_srv = &s;
+    s.set_read_callback(profile_read);
+    s.listen("127.0.0.1", "703");
+
+    sleep(1);
+
+    tcp::client c("profile key", tcp::auth::MD5);
+    c.set_profile(tcp::sock_profile::BULK);
+    if (!c.authenticate("127.0.0.1", "703")) {
+        std::cerr << "test_profile: authentication FAILED!\n";
+        return;
+    }
+
+    c.write("options\n");
+    c.send();
+    c.readline();
+
+    int fd = profile_socket(profile_peer_port, 703);
+    int nodelay = -1, tos = -1;
+    socklen_t len = sizeof (int);
+    getsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, &len);
+    len = sizeof (int);
+    getsockopt(fd, IPPROTO_IP, IP_TOS, &tos, &len);
+
+    std::cout << "client nodelay " << nodelay << ", tos " << tos
+            << ", server nodelay " << profile_srv_nodelay << std::endl;
+
+    if (fd == -1 || nodelay != 0 || tos != IPTOS_THROUGHPUT ||
+            profile_srv_nodelay != 1)
+        std::cerr << "test_profile: FAILED!\n";
+}
+
+#endif
+
+#ifdef AFFINITY_TEST
+
+tcp::server *placed_srv = nullptr;
+
+static int thread_cpus(void) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    pthread_getaffinity_np(pthread_self(), sizeof (set), &set);
+    return CPU_COUNT(&set);
+}
+
+// "<cpus> <nodelay> <tos>" as the connection thread sees them
+std::string placed_read(std::string str) {
+    tcp::conn_stats st;
+    if (!placed_srv->connection_stats(tcp::server::current_connection(), st))
+        return "gone\n";
+
+    int nodelay = -1, tos = -1;
+    socklen_t len = sizeof (int);
+    getsockopt(st.socket, IPPROTO_TCP, TCP_NODELAY, &nodelay, &len);
+    len = sizeof (int);
+    getsockopt(st.socket, IPPROTO_IP, IP_TOS, &tos, &len);
+
+    return std::to_string(thread_cpus()) + " " + std::to_string(nodelay) +
+            " " + std::to_string(tos) + "\n";
+}
+
+/* a connection thread floats when only the accept thread
+ * is pinned, accepted sockets carry the profile's options */
+void test_affinity(void) {
+    std::cout << "test_affinity" << std::endl;
+
+    tcp::server s("affinity key", tcp::auth::MD5);
+    placed_srv = &s;
+    s.set_read_callback(placed_read);
+    s.set_profile(tcp::sock_profile::LOW_LATENCY);
+    s.set_cpu_affinity(tcp::cpu_list(1, 0), tcp::cpu_list());
+    s.listen("127.0.0.1", "694");
+
+    sleep(1);
+
+    tcp::client c("affinity key", tcp::auth::MD5);
+    if (!c.authenticate("127.0.0.1", "694")) {
+        std::cerr << "test_affinity: authentication FAILED!\n";
+        return;
+    }
+
+    c.write("where\n");
+    c.send();
+    std::string line = c.readline();
+
+    int cpus = 0, nodelay = 0, tos = 0;
+    sscanf(line.c_str(), "%d %d %d", &cpus, &nodelay, &tos);
+    std::cout << "connection cpus " << cpus << " of " << thread_cpus()
+            << ", nodelay " << nodelay << ", tos " << tos << std::endl;
+
+    if (cpus != thread_cpus() || nodelay != 1 || tos != IPTOS_LOWDELAY)
+        std::cerr << "test_affinity: FAILED!\n";
+}
+
+#endif
+
 #ifdef SRV1_TEST
 
 std::string srv1_read(std::string str) {
@@ -182,6 +1929,153 @@ int main(int argc, char** argv) {
     std::cout << "%TEST_FINISHED% test_auth (md5 authentication)" << std::endl;
 #endif
 
+#ifdef MULTI_TEST
+    std::cout << "%TEST_STARTED% test_multi_server (independent servers)" << std::endl;
+    test_multi_server();
+    std::cout << "%TEST_FINISHED% test_multi_server (independent servers)" << std::endl;
+#endif
+
+#ifdef UNIX_TEST
+    std::cout << "%TEST_STARTED% test_unix (unix domain sockets)" << std::endl;
+    test_unix();
+    std::cout << "%TEST_FINISHED% test_unix (unix domain sockets)" << std::endl;
+#endif
+
+#ifdef PUSH_TEST
+    std::cout << "%TEST_STARTED% test_push (publish and broadcast)" << std::endl;
+    test_push();
+    std::cout << "%TEST_FINISHED% test_push (publish and broadcast)" << std::endl;
+#endif
+
+#ifdef CHANNEL_TEST
+    std::cout << "%TEST_STARTED% test_channels (multiplexed channels)" << std::endl;
+    test_channels();
+    std::cout << "%TEST_FINISHED% test_channels (multiplexed channels)" << std::endl;
+#endif
+
+#ifdef STREAM_TEST
+    std::cout << "%TEST_STARTED% test_stream (streaming replies)" << std::endl;
+    test_stream();
+    std::cout << "%TEST_FINISHED% test_stream (streaming replies)" << std::endl;
+#endif
+
+#ifdef ASYNC_TEST
+    std::cout << "%TEST_STARTED% test_async (async handlers)" << std::endl;
+    test_async();
+    std::cout << "%TEST_FINISHED% test_async (async handlers)" << std::endl;
+#endif
+
+#ifdef RELIABLE_TEST
+    std::cout << "%TEST_STARTED% test_reliable (sequenced delivery)" << std::endl;
+    test_reliable();
+    std::cout << "%TEST_FINISHED% test_reliable (sequenced delivery)" << std::endl;
+#endif
+
+#ifdef SPILL_TEST
+    std::cout << "%TEST_STARTED% test_spill (outage journal)" << std::endl;
+    test_spill();
+    std::cout << "%TEST_FINISHED% test_spill (outage journal)" << std::endl;
+#endif
+
+#ifdef HEDGE_TEST
+    std::cout << "%TEST_STARTED% test_hedge (hedged requests)" << std::endl;
+    test_hedge();
+    std::cout << "%TEST_FINISHED% test_hedge (hedged requests)" << std::endl;
+#endif
+
+#ifdef QUORUM_TEST
+    std::cout << "%TEST_STARTED% test_quorum (quorum writes)" << std::endl;
+    test_quorum();
+    std::cout << "%TEST_FINISHED% test_quorum (quorum writes)" << std::endl;
+#endif
+
+#ifdef ROUTER_TEST
+    std::cout << "%TEST_STARTED% test_router (consistent hash routing)" << std::endl;
+    test_router();
+    std::cout << "%TEST_FINISHED% test_router (consistent hash routing)" << std::endl;
+    std::cout << "%TEST_STARTED% test_router_hung (hung endpoint)" << std::endl;
+    test_router_hung();
+    std::cout << "%TEST_FINISHED% test_router_hung (hung endpoint)" << std::endl;
+#endif
+
+#ifdef STANDBY_TEST
+    std::cout << "%TEST_STARTED% test_standby (standby replication)" << std::endl;
+    test_standby();
+    std::cout << "%TEST_FINISHED% test_standby (standby replication)" << std::endl;
+    std::cout << "%TEST_STARTED% test_standby_stuck (stuck standby)" << std::endl;
+    test_standby_stuck();
+    std::cout << "%TEST_FINISHED% test_standby_stuck (stuck standby)" << std::endl;
+    std::cout << "%TEST_STARTED% test_standby_silent (silent standby)" << std::endl;
+    test_standby_silent();
+    std::cout << "%TEST_FINISHED% test_standby_silent (silent standby)" << std::endl;
+#endif
+
+#ifdef ACCEPT_TEST
+    std::cout << "%TEST_STARTED% test_accept (accept path)" << std::endl;
+    test_accept();
+    std::cout << "%TEST_FINISHED% test_accept (accept path)" << std::endl;
+#endif
+
+#ifdef CACHE_TEST
+    std::cout << "%TEST_STARTED% test_cache (response cache)" << std::endl;
+    test_cache();
+    std::cout << "%TEST_FINISHED% test_cache (response cache)" << std::endl;
+#endif
+
+#ifdef TXQUEUE_TEST
+    std::cout << "%TEST_STARTED% test_tx_queue (overflow policies)" << std::endl;
+    test_tx_queue();
+    std::cout << "%TEST_FINISHED% test_tx_queue (overflow policies)" << std::endl;
+#endif
+
+#ifdef CODEC_TEST
+    std::cout << "%TEST_STARTED% test_codec (schema codec)" << std::endl;
+    test_codec();
+    std::cout << "%TEST_FINISHED% test_codec (schema codec)" << std::endl;
+#endif
+
+#ifdef TIMER_TEST
+    std::cout << "%TEST_STARTED% test_timers (timer wheel and timeouts)" << std::endl;
+    test_timers();
+    std::cout << "%TEST_FINISHED% test_timers (timer wheel and timeouts)" << std::endl;
+#endif
+
+#ifdef HANDOFF_TEST
+    std::cout << "%TEST_STARTED% test_handoff (listener handoff)" << std::endl;
+    test_handoff();
+    std::cout << "%TEST_FINISHED% test_handoff (listener handoff)" << std::endl;
+#endif
+
+#ifdef DEADLINE_TEST
+    std::cout << "%TEST_STARTED% test_deadline (request deadlines)" << std::endl;
+    test_deadline();
+    std::cout << "%TEST_FINISHED% test_deadline (request deadlines)" << std::endl;
+#endif
+
+#ifdef SHM_TEST
+    std::cout << "%TEST_STARTED% test_shm (shared memory transport)" << std::endl;
+    test_shm();
+    std::cout << "%TEST_FINISHED% test_shm (shared memory transport)" << std::endl;
+#endif
+
+#ifdef FLUSH_TEST
+    std::cout << "%TEST_STARTED% test_flush (flush policy and linger)" << std::endl;
+    test_flush();
+    std::cout << "%TEST_FINISHED% test_flush (flush policy and linger)" << std::endl;
+#endif
+
+#ifdef PROFILE_TEST
+    std::cout << "%TEST_STARTED% test_profile (socket profiles)" << std::endl;
+    test_profile();
+    std::cout << "%TEST_FINISHED% test_profile (socket profiles)" << std::endl;
+#endif
+
+#ifdef AFFINITY_TEST
+    std::cout << "%TEST_STARTED% test_affinity (thread placement and socket profile)" << std::endl;
+    test_affinity();
+    std::cout << "%TEST_FINISHED% test_affinity (thread placement and socket profile)" << std::endl;
+#endif
+
 #ifdef CLIENT_TEST
     std::cout << "%TEST_STARTED% test_failover (redundant server, client failover)" << std::endl;
     test_failover();
@@ -0,0 +1,346 @@
+/*
+ * File:   bench.cpp
+ *
+ * Self-contained load generator and latency benchmark.
+ *
+ * starts a tcp::server echoing every line and drives it with
+ * a number of tcp::client connections. latency is measured
+ * against the intended send time so open-loop runs are
+ * corrected for coordinated omission.
+ *
+ * usage:
+ *   bench [--host 127.0.0.1] [--port 6666] [--conns 4] [--size 64]
+ *         [--depth 1] [--rate 0] [--duration 5] [--auth]
+ *         [--tx-budget 0] [--shm] [--batch 0] [--linger 0]
+ *         [--cache 0] [--fast-open] [--defer-accept]
+ *         [--profile default|low-latency|bulk] [--io-cpus 0-3]
+ *         [--out bench.json]
+ *
+ *   --rate is the total open-loop rate in msgs/sec, 0 = closed loop.
+ *   --batch/--linger (usec) switch the client to auto flush.
+ *   --cache is the server response cache size in bytes, 0 = off.
+ */
+
+#include <stdlib.h>
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <thread>
+#include <chrono>
+#include <deque>
+#include <vector>
+#include <atomic>
+#include <cmath>
+#include "server.h"
+#include "client.h"
+
+typedef std::chrono::steady_clock bench_clock;
+
+/* log-linear latency histogram (nanoseconds).
+ * 2^SUB_BITS sub-buckets per power of two, < 1% error. */
+class histogram {
+public:
+    static const int SUB_BITS = 7;
+    static const int SUB_COUNT = 1 << SUB_BITS;
+
+    histogram() : counts_(64 * SUB_COUNT, 0), total_(0), max_(0) {
+    }
+
+    void record(uint64_t ns) {
+        ++counts_[index(ns)];
+        ++total_;
+        if (ns > max_) max_ = ns;
+    }
+
+    void merge(const histogram &h) {
+        for (size_t i = 0; i < counts_.size(); ++i)
+            counts_[i] += h.counts_[i];
+        total_ += h.total_;
+        if (h.max_ > max_) max_ = h.max_;
+    }
+
+    uint64_t percentile(double p) const {
+        if (total_ == 0) return 0;
+        uint64_t want = (uint64_t) std::ceil(total_ * p / 100.0);
+        if (want == 0) want = 1;
+        uint64_t seen = 0;
+        for (size_t i = 0; i < counts_.size(); ++i) {
+            seen += counts_[i];
+            if (seen >= want) return value(i);
+        }
+        return max_;
+    }
+
+    uint64_t count(void) const {
+        return total_;
+    }
+
+    uint64_t max(void) const {
+        return max_;
+    }
+
+private:
+    std::vector<uint64_t> counts_;
+    uint64_t total_;
+    uint64_t max_;
+
+    static size_t index(uint64_t v) {
+        if (v < (uint64_t) SUB_COUNT) return v;
+        int mag = 63 - __builtin_clzll(v) - SUB_BITS + 1;
+        return mag * (SUB_COUNT / 2) + (v >> mag);
+    }
+
+    // upper bound of the bucket
+    static uint64_t value(size_t i) {
+        if (i < (size_t) SUB_COUNT) return i;
+        size_t mag = i / (SUB_COUNT / 2) - 1;
+        uint64_t sub = i - mag * (SUB_COUNT / 2);
+        return ((sub + 1) << mag) - 1;
+    }
+};
+
+struct options {
+    std::string host = "127.0.0.1";
+    std::string port = "6666";
+    std::string out = "bench.json";
+    int conns = 4;
+    int size = 64;
+    int depth = 1;
+    double rate = 0;
+    double duration = 5;
+    size_t tx_budget = 0;
+    size_t batch = 0;
+    uint32_t linger = 0;
+    size_t cache = 0;
+    bool auth = false;
+    bool shm = false;
+    bool fast_open = false;
+    bool defer_accept = false;
+    tcp::sock_profile profile = tcp::sock_profile::DEFAULT;
+    tcp::cpu_list io_cpus;
+};
+
+static const char *bench_key = "bench md5 key";
+
+std::string echo_read(std::string str) {
+    return str;
+}
+
+/* one connection worker. keeps up to 'depth' requests in
+ * flight; in open-loop mode each request has an intended
+ * send time and latency is measured from it. */
+void run_connection(const options &opt, histogram &hist,
+        std::atomic<uint64_t> &errors) {
+
+    tcp::client c(bench_key, opt.auth ? tcp::auth::MD5 : tcp::auth::OFF);
+    if (opt.tx_budget > 0)
+        c.tx_queue_budget(opt.tx_budget / 2, opt.tx_budget);
+    if (opt.shm)
+        c.use_shm();
+    if (opt.fast_open)
+        c.set_fast_open(1);
+    c.set_profile(opt.profile);
+    if (opt.batch > 0 || opt.linger > 0)
+        c.set_flush_policy(0, opt.batch, opt.linger);
+    const bool auto_flush = opt.batch > 0 || opt.linger > 0;
+
+    if (opt.auth) {
+        if (!c.authenticate(opt.host, opt.port)) {
+            ++errors;
+            return;
+        }
+    } else {
+        std::shared_ptr<tcp::ip_point> ep = std::make_shared<tcp::ip_point>();
+        c.ip_endpoint(ep);
+        if (!c.connect(opt.host, opt.port)) {
+            ++errors;
+            return;
+        }
+        c.negotiate_shm();
+    }
+
+    std::string msg(opt.size > 1 ? opt.size - 1 : 0, 'x');
+    msg += tcp::EOL;
+
+    const bool open_loop = opt.rate > 0;
+    const std::chrono::nanoseconds interval(open_loop ?
+            (int64_t) (1e9 * opt.conns / opt.rate) : 0);
+
+    bench_clock::time_point start = bench_clock::now();
+    bench_clock::time_point end = start +
+            std::chrono::microseconds((int64_t) (opt.duration * 1e6));
+    bench_clock::time_point next_send = start;
+
+    std::deque<bench_clock::time_point> in_flight;
+
+    while (c.connected()) {
+        bench_clock::time_point now = bench_clock::now();
+        if (now >= end && in_flight.empty()) break;
+
+        // fill the pipeline
+        bool wrote = false;
+        while (now < end && (int) in_flight.size() < opt.depth &&
+                (!open_loop || now >= next_send)) {
+            c.write(msg);
+            in_flight.push_back(open_loop ? next_send : now);
+            next_send += interval;
+            wrote = true;
+        }
+        if (wrote && !auto_flush) c.send();
+
+        if (in_flight.empty()) {
+            std::this_thread::sleep_until(next_send);
+            continue;
+        }
+
+        std::string reply = c.readline();
+        if (reply.size() != msg.size()) {
+            ++errors;
+            break;
+        }
+
+        hist.record(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                bench_clock::now() - in_flight.front()).count());
+        in_flight.pop_front();
+    }
+
+    c.disconnect();
+}
+
+bool parse_options(int argc, char **argv, options &opt) {
+    for (int i = 1; i < argc; ++i) {
+        std::string arg(argv[i]);
+        bool has_val = i + 1 < argc;
+
+        if (arg == "--auth") opt.auth = true;
+        else if (arg == "--shm") opt.shm = true;
+        else if (arg == "--fast-open") opt.fast_open = true;
+        else if (arg == "--defer-accept") opt.defer_accept = true;
+        else if (arg == "--host" && has_val) opt.host = argv[++i];
+        else if (arg == "--port" && has_val) opt.port = argv[++i];
+        else if (arg == "--out" && has_val) opt.out = argv[++i];
+        else if (arg == "--io-cpus" && has_val) {
+            if (!tcp::parse_cpu_list(argv[++i], opt.io_cpus)) {
+                std::cerr << "bad cpu list " << argv[i] << std::endl;
+                return false;
+            }
+        }
+        else if (arg == "--profile" && has_val) {
+            std::string p(argv[++i]);
+            if (p == "low-latency") opt.profile = tcp::sock_profile::LOW_LATENCY;
+            else if (p == "bulk") opt.profile = tcp::sock_profile::BULK;
+            else opt.profile = tcp::sock_profile::DEFAULT;
+        }
+        else if (arg == "--conns" && has_val) opt.conns = atoi(argv[++i]);
+        else if (arg == "--size" && has_val) opt.size = atoi(argv[++i]);
+        else if (arg == "--depth" && has_val) opt.depth = atoi(argv[++i]);
+        else if (arg == "--rate" && has_val) opt.rate = atof(argv[++i]);
+        else if (arg == "--duration" && has_val) opt.duration = atof(argv[++i]);
+        else if (arg == "--tx-budget" && has_val) opt.tx_budget = atol(argv[++i]);
+        else if (arg == "--batch" && has_val) opt.batch = atol(argv[++i]);
+        else if (arg == "--linger" && has_val) opt.linger = atol(argv[++i]);
+        else if (arg == "--cache" && has_val) opt.cache = atol(argv[++i]);
+        else {
+            std::cerr << "unknown option " << arg << std::endl;
+            return false;
+        }
+    }
+
+    if (opt.conns < 1) opt.conns = 1;
+    if (opt.depth < 1) opt.depth = 1;
+    if (opt.size < 1) opt.size = 1;
+    return true;
+}
+
+int main(int argc, char** argv) {
+    options opt;
+    if (!parse_options(argc, argv, opt)) return (EXIT_FAILURE);
+
+    std::cout << "%TEST_STARTED% bench (load generator)" << std::endl;
+
+    tcp::server s(bench_key, opt.auth ? tcp::auth::MD5 : tcp::auth::OFF);
+    s.set_read_callback(echo_read, opt.cache > 0);
+    if (opt.cache > 0)
+        s.set_response_cache(opt.cache, 0);
+    s.set_max_conn_buffer(opt.conns);
+    s.set_profile(opt.profile);
+    s.set_cpu_affinity(opt.io_cpus, opt.io_cpus);
+    if (opt.fast_open)
+        s.set_fast_open(opt.conns);
+    if (opt.defer_accept)
+        s.set_defer_accept(5);
+    if (opt.tx_budget > 0)
+        s.set_tx_budget(opt.tx_budget / 2, opt.tx_budget, tcp::tx_policy::BLOCK);
+    if (!s.listen(opt.host, opt.port)) {
+        std::cerr << "bench: unable to listen on " << opt.port << std::endl;
+        return (EXIT_FAILURE);
+    }
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+    std::vector<histogram> hists(opt.conns);
+    std::vector<std::thread> workers;
+    std::atomic<uint64_t> errors(0);
+
+    bench_clock::time_point start = bench_clock::now();
+    for (int i = 0; i < opt.conns; ++i)
+        workers.push_back(std::thread(run_connection, std::cref(opt),
+            std::ref(hists[i]), std::ref(errors)));
+    for (auto &w : workers)
+        w.join();
+    double elapsed = std::chrono::duration<double>(
+            bench_clock::now() - start).count();
+
+    s.kill();
+
+    histogram total;
+    for (auto &h : hists)
+        total.merge(h);
+
+    double msgs_sec = total.count() / elapsed;
+    double mb_sec = msgs_sec * opt.size / (1024.0 * 1024.0);
+
+    std::cout << "conns " << opt.conns << " size " << opt.size
+            << " depth " << opt.depth << " rate " << opt.rate
+            << " auth " << (opt.auth ? "md5" : "off")
+            << " shm " << (opt.shm ? "on" : "off")
+            << " batch " << opt.batch << " linger " << opt.linger << std::endl
+            << "msgs " << total.count() << " errors " << errors
+            << " msgs/s " << msgs_sec << " MB/s " << mb_sec << std::endl
+            << "latency us p50 " << total.percentile(50) / 1e3
+            << " p99 " << total.percentile(99) / 1e3
+            << " p999 " << total.percentile(99.9) / 1e3
+            << " max " << total.max() / 1e3 << std::endl;
+
+    tcp::cache_stats cache = s.response_cache_stats();
+    if (opt.cache > 0)
+        std::cout << "cache hits " << cache.hits << " misses " << cache.misses
+            << " entries " << cache.entries << " bytes " << cache.bytes << std::endl;
+
+    std::ofstream out(opt.out);
+    out << "{\n"
+            << "  \"conns\": " << opt.conns << ",\n"
+            << "  \"size\": " << opt.size << ",\n"
+            << "  \"depth\": " << opt.depth << ",\n"
+            << "  \"rate\": " << opt.rate << ",\n"
+            << "  \"auth\": " << (opt.auth ? "true" : "false") << ",\n"
+            << "  \"shm\": " << (opt.shm ? "true" : "false") << ",\n"
+            << "  \"batch\": " << opt.batch << ",\n"
+            << "  \"linger_us\": " << opt.linger << ",\n"
+            << "  \"cache_hits\": " << cache.hits << ",\n"
+            << "  \"cache_misses\": " << cache.misses << ",\n"
+            << "  \"duration_s\": " << elapsed << ",\n"
+            << "  \"messages\": " << total.count() << ",\n"
+            << "  \"errors\": " << errors << ",\n"
+            << "  \"msgs_per_sec\": " << msgs_sec << ",\n"
+            << "  \"mb_per_sec\": " << mb_sec << ",\n"
+            << "  \"latency_ns\": {\"p50\": " << total.percentile(50)
+            << ", \"p99\": " << total.percentile(99)
+            << ", \"p999\": " << total.percentile(99.9)
+            << ", \"max\": " << total.max() << "}\n"
+            << "}\n";
+
+    std::cout << "%TEST_FINISHED% bench (load generator)" << std::endl;
+
+    return errors == 0 ? (EXIT_SUCCESS) : (EXIT_FAILURE);
+}